@@ -0,0 +1,87 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/*
+ * Allocator benchmark.
+ *
+ * Runs an allocation heavy script (small tables, strings and closures)
+ * on states using the default allocator and on states using the
+ * SlabAllocator, and reports the time per run.
+ *
+ * Usage: benchmark_Allocator [iterations]
+ */
+
+#include "../LuaCpp.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+static const char* script =
+	"local items = {}\n"
+	"for i = 1, 2000 do\n"
+	"  items[i] = { id = i, name = 'item' .. i, get = function() return i end }\n"
+	"end\n"
+	"local sum = 0\n"
+	"for _, item in ipairs(items) do sum = sum + item.get() end\n"
+	"return sum\n";
+
+static double run(bool slab, size_t iterations) {
+	std::unique_ptr<LuaState> state;
+	if (slab) {
+		state = std::make_unique<LuaState>(SlabAllocator::CreateParams());
+	} else {
+		state = std::make_unique<LuaState>();
+	}
+	luaL_openlibs(*state);
+	luaL_loadstring(*state, script);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		lua_pushvalue(*state, -1);
+		lua_pcall(*state, 0, 0, 0);
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() * 1e6 / (double)iterations;
+}
+
+int main(int argc, char **argv) {
+	size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 500;
+
+	double system = run(false, iterations);
+	double slab = run(true, iterations);
+
+	std::cout << "=== Lua allocator: microseconds per script run ===" << "\n";
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(20) << "default allocator" << std::setw(12) << system << "\n";
+	std::cout << std::setw(20) << "slab allocator" << std::setw(12) << slab << "\n";
+	std::cout << std::setw(20) << "speedup" << std::setw(11) << system / slab << "x" << "\n";
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/*
+ * Contention benchmark for the StatePool idle list.
+ *
+ * Every thread repeatedly acquires and releases a state from one shared
+ * pool color, which is the hot path of RunPooled(). The pool is sized so
+ * that it never runs dry; the numbers therefore measure the cost of the
+ * idle list itself (mutex + std::queue vs. the lock-free ring vs. one
+ * shard per CPU).
+ *
+ * Usage: benchmark_PoolContention [iterations per thread]
+ */
+
+#include "../LuaCpp.hpp"
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+static double run(bool lockFree, size_t shards, size_t threads, size_t iterations) {
+	PoolConfig config;
+	config.libraries = {"base"};
+	config.maxSize = threads;
+	config.lockFreeQueue = lockFree;
+	config.shards = shards;
+
+	StatePool pool("bench", config);
+	pool.setThreadSafe(true);
+	pool.warmup(threads);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; t++) {
+		workers.emplace_back([&pool, iterations]() {
+			for (size_t i = 0; i < iterations; i++) {
+				auto state = pool.acquire();
+				pool.release(std::move(state));
+			}
+		});
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return (double)(threads * iterations) / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+	size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+	size_t maxThreads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+
+	std::cout << "=== StatePool contention: acquire/release pairs per second ===" << "\n";
+	std::cout << std::setw(8) << "threads"
+		  << std::setw(16) << "mutex queue"
+		  << std::setw(16) << "lock-free ring"
+		  << std::setw(16) << "per-cpu shards"
+		  << std::setw(10) << "speedup" << "\n";
+
+	for (size_t threads = 1; threads <= maxThreads * 2; threads *= 2) {
+		double mutexOps = run(false, 0, threads, iterations);
+		double ringOps = run(true, 0, threads, iterations);
+		double shardOps = run(false, maxThreads, threads, iterations);
+		std::cout << std::setw(8) << threads
+			  << std::setw(16) << std::fixed << std::setprecision(0) << mutexOps
+			  << std::setw(16) << ringOps
+			  << std::setw(16) << shardOps
+			  << std::setw(9) << std::setprecision(2) << std::max(ringOps, shardOps) / mutexOps << "x" << "\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/*
+ * Reset benchmark for the StatePool.
+ *
+ * Every iteration acquires a state, runs a small script that leaves
+ * globals behind and releases the state again. It compares the cost of
+ * the two reset modes with closing the state and creating a new one,
+ * which is the only other way to get a clean state for every run.
+ *
+ * Usage: benchmark_PoolReset [iterations]
+ */
+
+#include "../LuaCpp.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+static const char* script =
+	"counter = (counter or 0) + 1\n"
+	"cache = { a = 1, b = 2, c = 3 }\n"
+	"function helper(x) return x * 2 end\n";
+
+static double run(ResetMode mode, bool recreate, size_t iterations) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.resetMode = mode;
+
+	StatePool pool("bench", config);
+	pool.warmup(1);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		auto state = pool.acquire();
+		luaL_dostring(*state, script);
+		pool.release(std::move(state));
+		if (recreate) {
+			pool.drain();
+		}
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() * 1e6 / (double)iterations;
+}
+
+int main(int argc, char **argv) {
+	size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+
+	double light = run(ResetMode::Light, false, iterations);
+	double snapshot = run(ResetMode::Snapshot, false, iterations);
+	double recreate = run(ResetMode::Light, true, iterations);
+
+	std::cout << "=== StatePool reset: microseconds per acquire/run/release ===" << "\n";
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(24) << "light reset" << std::setw(12) << light << "\n";
+	std::cout << std::setw(24) << "snapshot reset" << std::setw(12) << snapshot << "\n";
+	std::cout << std::setw(24) << "recreate state" << std::setw(12) << recreate << "\n";
+	std::cout << std::setw(24) << "recreate / snapshot" << std::setw(11) << recreate / snapshot << "x" << "\n";
+
+	return 0;
+}
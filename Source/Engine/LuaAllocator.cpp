@@ -0,0 +1,281 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include "LuaAllocator.hpp"
+
+using namespace LuaCpp::Engine;
+
+namespace {
+	void* systemAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+		(void)ud;
+		(void)osize;
+		if (nsize == 0) {
+			std::free(ptr);
+			return nullptr;
+		}
+		return std::realloc(ptr, nsize);
+	}
+}
+
+SlabAllocator::SlabAllocator(size_t maxSlabs) : maxSlabs_(maxSlabs) {
+}
+
+SlabAllocator::~SlabAllocator() {
+	for (void* slab : slabs_) {
+		std::free(slab);
+	}
+	for (void* block : adopted_) {
+		std::free(block);
+	}
+}
+
+void* SlabAllocator::allocateSmall(size_t cls) {
+	FreeBlock* block = freeLists_[cls];
+	if (block != nullptr) {
+		freeLists_[cls] = block->next;
+		return block;
+	}
+
+	size_t size = (cls + 1) * Granularity;
+	if (cursor_[cls] == nullptr || cursor_[cls] + size > limit_[cls]) {
+		if (maxSlabs_ > 0 && slabs_.size() >= maxSlabs_) {
+			return nullptr;
+		}
+		char* slab = static_cast<char*>(std::malloc(SlabSize));
+		if (slab == nullptr) {
+			return nullptr;
+		}
+		slabs_.push_back(slab);
+		cursor_[cls] = slab;
+		limit_[cls] = slab + SlabSize;
+	}
+
+	void* result = cursor_[cls];
+	cursor_[cls] += size;
+	return result;
+}
+
+void* SlabAllocator::allocate(size_t size) {
+	if (size > MaxSmallSize) {
+		return std::malloc(size);
+	}
+
+	size_t cls = classOf(size);
+	void* result = allocateSmall(cls);
+	if (result != nullptr) {
+		smallBytesInUse_ += (cls + 1) * Granularity;
+	}
+	return result;
+}
+
+void SlabAllocator::deallocate(void* ptr, size_t size) {
+	if (ptr == nullptr) {
+		return;
+	}
+	if (size > MaxSmallSize) {
+		std::free(ptr);
+		return;
+	}
+
+	size_t cls = classOf(size);
+	FreeBlock* block = static_cast<FreeBlock*>(ptr);
+	block->next = freeLists_[cls];
+	freeLists_[cls] = block;
+	smallBytesInUse_ -= (cls + 1) * Granularity;
+}
+
+void* SlabAllocator::reallocate(void* ptr, size_t oldSize, size_t newSize) {
+	if (newSize == 0) {
+		deallocate(ptr, oldSize);
+		return nullptr;
+	}
+	if (ptr == nullptr) {
+		return allocate(newSize);
+	}
+	if (oldSize > MaxSmallSize && newSize > MaxSmallSize) {
+		void* result = std::realloc(ptr, newSize);
+		return result == nullptr && newSize < oldSize ? ptr : result;
+	}
+	if (oldSize <= MaxSmallSize && newSize <= MaxSmallSize && classOf(oldSize) == classOf(newSize)) {
+		return ptr;
+	}
+
+	void* result = allocate(newSize);
+	if (result == nullptr) {
+		// Lua relies on shrinking never failing: keep the block, which
+		// is at least as big as the smaller size class needs
+		return newSize < oldSize ? keepShrunk(ptr, oldSize, newSize) : nullptr;
+	}
+	std::memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+	deallocate(ptr, oldSize);
+	return result;
+}
+
+void* SlabAllocator::keepShrunk(void* ptr, size_t oldSize, size_t newSize) {
+	if (oldSize <= MaxSmallSize) {
+		smallBytesInUse_ -= (classOf(oldSize) - classOf(newSize)) * Granularity;
+		return ptr;
+	}
+
+	// A malloc'ed block becomes a small one and goes to a free list when
+	// Lua frees it, so it is released together with the slabs
+	try {
+		adopted_.push_back(ptr);
+	} catch (const std::bad_alloc&) {
+		// Out of memory altogether: the block leaks rather than failing
+	}
+	smallBytesInUse_ += (classOf(newSize) + 1) * Granularity;
+	return ptr;
+}
+
+size_t SlabAllocator::slabCount() const {
+	return slabs_.size();
+}
+
+size_t SlabAllocator::smallBytesInUse() const {
+	return smallBytesInUse_;
+}
+
+void* SlabAllocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	// For new blocks Lua passes the object type in `osize`
+	if (ptr == nullptr) {
+		osize = 0;
+	}
+	return static_cast<SlabAllocator*>(ud)->reallocate(ptr, osize, nsize);
+}
+
+StateParams SlabAllocator::CreateParams() {
+	auto allocator = std::make_shared<SlabAllocator>();
+
+	StateParams params;
+	params.allocator = &SlabAllocator::Alloc;
+	params.userData = allocator.get();
+	params.owner = allocator;
+	return params;
+}
+
+MemoryBudget::MemoryBudget(size_t limit) : limit_(limit) {
+}
+
+bool MemoryBudget::tryReserve(size_t bytes) {
+	size_t used = used_.load(std::memory_order_relaxed);
+	do {
+		if (limit_ > 0 && used + bytes > limit_) {
+			return false;
+		}
+	} while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+	return true;
+}
+
+void MemoryBudget::release(size_t bytes) {
+	used_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t MemoryBudget::used() const {
+	return used_.load(std::memory_order_relaxed);
+}
+
+size_t MemoryBudget::limit() const {
+	return limit_;
+}
+
+AccountingAllocator::AccountingAllocator(lua_Alloc inner, void* innerData, std::shared_ptr<void> innerOwner,
+	size_t limit, std::shared_ptr<MemoryBudget> budget)
+	: inner_(inner != nullptr ? inner : &systemAlloc)
+	, innerData_(innerData)
+	, innerOwner_(std::move(innerOwner))
+	, limit_(limit)
+	, budget_(std::move(budget))
+{
+}
+
+AccountingAllocator::~AccountingAllocator() {
+	// lua_close frees every block, so this is normally zero
+	if (budget_) {
+		budget_->release(used_.load(std::memory_order_relaxed));
+	}
+}
+
+void* AccountingAllocator::reallocate(void* ptr, size_t osize, size_t nsize) {
+	size_t old = ptr != nullptr ? osize : 0;
+
+	if (nsize > old) {
+		size_t grow = nsize - old;
+		size_t used = used_.load(std::memory_order_relaxed);
+		if (limit_ > 0 && used + grow > limit_) {
+			return nullptr;
+		}
+		if (budget_ && !budget_->tryReserve(grow)) {
+			return nullptr;
+		}
+
+		void* result = inner_(innerData_, ptr, osize, nsize);
+		if (result == nullptr) {
+			if (budget_) {
+				budget_->release(grow);
+			}
+			return nullptr;
+		}
+		used_.store(used + grow, std::memory_order_relaxed);
+		return result;
+	}
+
+	void* result = inner_(innerData_, ptr, osize, nsize);
+	if (result != nullptr || nsize == 0) {
+		size_t shrink = old - nsize;
+		used_.fetch_sub(shrink, std::memory_order_relaxed);
+		if (budget_) {
+			budget_->release(shrink);
+		}
+	}
+	return result;
+}
+
+size_t AccountingAllocator::used() const {
+	return used_.load(std::memory_order_relaxed);
+}
+
+size_t AccountingAllocator::limit() const {
+	return limit_;
+}
+
+void* AccountingAllocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	return static_cast<AccountingAllocator*>(ud)->reallocate(ptr, osize, nsize);
+}
+
+StateParams AccountingAllocator::Wrap(StateParams params) {
+	auto allocator = std::make_shared<AccountingAllocator>(params.allocator, params.userData,
+		std::move(params.owner), params.memoryLimitBytes, params.memoryBudget);
+
+	StateParams wrapped;
+	wrapped.allocator = &AccountingAllocator::Alloc;
+	wrapped.userData = allocator.get();
+	wrapped.owner = allocator;
+	return wrapped;
+}
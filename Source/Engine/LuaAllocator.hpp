@@ -0,0 +1,222 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_LUAALLOCATOR_HPP
+#define LUACPP_LUAALLOCATOR_HPP
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+#include "../Lua.hpp"
+#include "LuaState.hpp"
+
+namespace LuaCpp {
+	namespace Engine {
+
+		/**
+		 * @brief Size-class slab allocator for a single Lua state
+		 *
+		 * @details
+		 * Most allocations of a Lua state are small objects (strings,
+		 * tables, closures, upvalues) between 16 and 128 bytes. The
+		 * allocator serves those from 16 byte size classes carved out
+		 * of larger slabs, with one free list per class, and forwards
+		 * bigger blocks to `malloc`. Freed small blocks are kept on the
+		 * free lists and only returned to the system when the allocator
+		 * is destroyed.
+		 *
+		 * The number of slabs can be capped; once the cap is reached a
+		 * small allocation that finds its free list empty fails. Shrinking
+		 * a block never fails: if the smaller size class has no room the
+		 * block is kept as it is.
+		 *
+		 * A Lua state is used by one thread at a time, so the allocator
+		 * takes no locks; every state needs its own instance. Use
+		 * CreateParams() to get the parameters for a LuaState or a
+		 * pool's `allocatorFactory`.
+		 */
+		class SlabAllocator {
+		public:
+			static constexpr size_t Granularity = 16;
+			static constexpr size_t MaxSmallSize = 128;
+			static constexpr size_t ClassCount = MaxSmallSize / Granularity;
+			static constexpr size_t SlabSize = 8192;
+
+		private:
+			struct FreeBlock {
+				FreeBlock* next;
+			};
+
+			std::array<FreeBlock*, ClassCount> freeLists_{};
+			std::array<char*, ClassCount> cursor_{};
+			std::array<char*, ClassCount> limit_{};
+			std::vector<void*> slabs_;
+			/**
+			 * @brief Large blocks that a failed shrink turned into small
+			 * ones; they can only go back to `free` with the allocator
+			 */
+			std::vector<void*> adopted_;
+			size_t maxSlabs_ = 0;
+			size_t smallBytesInUse_ = 0;
+
+			static size_t classOf(size_t size) {
+				return (size + Granularity - 1) / Granularity - 1;
+			}
+
+			void* allocateSmall(size_t cls);
+
+			/**
+			 * @brief Keeps a block whose shrink found no room in the
+			 * smaller size class
+			 */
+			void* keepShrunk(void* ptr, size_t oldSize, size_t newSize);
+
+		public:
+			SlabAllocator() = default;
+
+			/**
+			 * @param maxSlabs Upper bound for the number of slabs, 0 for
+			 * no limit
+			 */
+			explicit SlabAllocator(size_t maxSlabs);
+			~SlabAllocator();
+
+			SlabAllocator(const SlabAllocator&) = delete;
+			SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+			void* allocate(size_t size);
+			void deallocate(void* ptr, size_t size);
+
+			/**
+			 * @brief Resizes a block following the `lua_Alloc` contract
+			 *
+			 * @details
+			 * A `newSize` of 0 frees the block, a `nullptr` block is
+			 * allocated. If growing fails `nullptr` is returned and the
+			 * old block is left untouched; shrinking always succeeds.
+			 */
+			void* reallocate(void* ptr, size_t oldSize, size_t newSize);
+
+			size_t slabCount() const;
+			size_t smallBytesInUse() const;
+
+			/**
+			 * @brief `lua_Alloc` entry point, `ud` is the SlabAllocator
+			 */
+			static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+			/**
+			 * @brief Creates a new allocator and the StateParams using it
+			 *
+			 * @details
+			 * The returned parameters own the allocator, so it lives as
+			 * long as the LuaState created from them.
+			 */
+			static StateParams CreateParams();
+		};
+
+		/**
+		 * @brief Memory ceiling shared by several Lua states
+		 *
+		 * @details
+		 * Used by the AccountingAllocator of every state that shares
+		 * the budget, e.g. all states of one pool color.
+		 */
+		class MemoryBudget {
+		private:
+			std::atomic<size_t> used_{0};
+			size_t limit_;
+
+		public:
+			/**
+			 * @param limit Maximum bytes for all states together, 0 for no limit
+			 */
+			explicit MemoryBudget(size_t limit);
+
+			MemoryBudget(const MemoryBudget&) = delete;
+			MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+			/**
+			 * @brief Reserves bytes, fails if the limit would be exceeded
+			 */
+			bool tryReserve(size_t bytes);
+			void release(size_t bytes);
+
+			size_t used() const;
+			size_t limit() const;
+		};
+
+		/**
+		 * @brief `lua_Alloc` wrapper enforcing memory limits
+		 *
+		 * @details
+		 * Counts the bytes a single state has allocated and refuses to
+		 * grow beyond the per-state limit or the shared MemoryBudget by
+		 * returning `nullptr`, which Lua reports as `LUA_ERRMEM`.
+		 * Shrinking and freeing always succeed, as required by Lua.
+		 */
+		class AccountingAllocator {
+		private:
+			lua_Alloc inner_;
+			void* innerData_;
+			std::shared_ptr<void> innerOwner_;
+			size_t limit_;
+			std::shared_ptr<MemoryBudget> budget_;
+			std::atomic<size_t> used_{0};
+
+		public:
+			AccountingAllocator(lua_Alloc inner, void* innerData, std::shared_ptr<void> innerOwner,
+				size_t limit, std::shared_ptr<MemoryBudget> budget);
+			~AccountingAllocator();
+
+			AccountingAllocator(const AccountingAllocator&) = delete;
+			AccountingAllocator& operator=(const AccountingAllocator&) = delete;
+
+			void* reallocate(void* ptr, size_t osize, size_t nsize);
+
+			size_t used() const;
+			size_t limit() const;
+
+			/**
+			 * @brief `lua_Alloc` entry point, `ud` is the AccountingAllocator
+			 */
+			static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+			/**
+			 * @brief Wraps the allocator of the parameters in an AccountingAllocator
+			 *
+			 * @details
+			 * Uses `memoryLimitBytes` and `memoryBudget` of the parameters.
+			 * The returned parameters own the new allocator, which in turn
+			 * keeps the owner of the wrapped allocator alive.
+			 */
+			static StateParams Wrap(StateParams params);
+		};
+	}
+}
+
+#endif // LUACPP_LUAALLOCATOR_HPP
@@ -0,0 +1,496 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+#include "LuaScheduler.hpp"
+
+using namespace LuaCpp::Engine;
+
+LuaScheduler::LuaScheduler(LuaState& state, SchedulerConfig config)
+	: state_(state), config_(std::move(config)), start_(std::chrono::steady_clock::now()) {
+	config_.tickMs = std::max<size_t>(1, config_.tickMs);
+
+	size_t slots = 1;
+	while (slots < config_.wheelSlots) {
+		slots <<= 1;
+	}
+	wheel_.resize(slots);
+	wheelMask_ = slots - 1;
+
+	registerLibrary();
+}
+
+LuaScheduler::~LuaScheduler() {
+	for (auto& task : tasks_) {
+		luaL_unref(state_, LUA_REGISTRYINDEX, task.second.ref);
+	}
+	if (libraryRef_ != LUA_NOREF) {
+		lua_rawgeti(state_, LUA_REGISTRYINDEX, libraryRef_);
+		*static_cast<LuaScheduler**>(lua_touserdata(state_, -1)) = nullptr;
+		lua_pop(state_, 1);
+		luaL_unref(state_, LUA_REGISTRYINDEX, libraryRef_);
+
+		lua_pushnil(state_);
+		lua_setglobal(state_, config_.libraryName.c_str());
+	}
+}
+
+LuaScheduler::TaskId LuaScheduler::addTask(lua_State* from, int nargs) {
+	lua_State* thread = lua_newthread(from);
+	int ref = luaL_ref(from, LUA_REGISTRYINDEX);
+	// Reported by the caller: a C function must not throw
+	if (!lua_checkstack(thread, nargs + 1)) {
+		lua_pop(from, nargs + 1);
+		luaL_unref(from, LUA_REGISTRYINDEX, ref);
+		return 0;
+	}
+	lua_xmove(from, thread, nargs + 1);
+
+	TaskId id = nextId_++;
+	Task& task = tasks_[id];
+	task.thread = thread;
+	task.ref = ref;
+	task.nargs = nargs;
+	threads_[thread] = id;
+	ready_.push_back(id);
+	return id;
+}
+
+void LuaScheduler::removeTask(TaskId id) {
+	auto it = tasks_.find(id);
+	if (it == tasks_.end()) {
+		return;
+	}
+	threads_.erase(it->second.thread);
+	luaL_unref(state_, LUA_REGISTRYINDEX, it->second.ref);
+	tasks_.erase(it);
+}
+
+LuaScheduler::TaskId LuaScheduler::spawn(int nargs) {
+	if (!lua_isfunction(state_, -(nargs + 1))) {
+		throw std::runtime_error("Scheduler: spawn() expects a function below its arguments");
+	}
+	TaskId id = addTask(state_, nargs);
+	if (id == 0) {
+		throw std::runtime_error("Scheduler: too many arguments for a task");
+	}
+	return id;
+}
+
+void LuaScheduler::step(TaskId id) {
+	auto it = tasks_.find(id);
+	if (it == tasks_.end()) {
+		return;
+	}
+	// References to map elements survive the rehash caused by spawns
+	Task& task = it->second;
+
+	request_ = Request::None;
+	current_ = id;
+	int nres = 0;
+#if LUA_VERSION_NUM >= 504
+	int status = lua_resume(task.thread, state_, task.nargs, &nres);
+#else
+	int status = lua_resume(task.thread, state_, task.nargs);
+	nres = lua_gettop(task.thread);
+#endif
+	current_ = 0;
+	task.nargs = 0;
+
+	if (status == LUA_YIELD) {
+		lua_pop(task.thread, nres);
+		switch (request_) {
+			case Request::Sleep:
+				task.status = TaskStatus::Sleeping;
+				addTimer(id, requestMs_);
+				break;
+			case Request::Join:
+				task.status = TaskStatus::Joining;
+				tasks_.at(requestJoin_).joiners.push_back(id);
+				break;
+			default:
+				// scheduler.yield() or a plain coroutine.yield()
+				task.status = TaskStatus::Ready;
+				ready_.push_back(id);
+				break;
+		}
+	} else if (status == LUA_OK) {
+		task.nresults = nres;
+		finish(id, task, TaskStatus::Finished);
+	} else {
+		task.error = lua_isstring(task.thread, -1) ? lua_tostring(task.thread, -1) : "unknown error";
+		task.nresults = 1;
+		finish(id, task, TaskStatus::Failed);
+	}
+}
+
+void LuaScheduler::finish(TaskId id, Task& task, TaskStatus status) {
+	task.status = status;
+	if (status == TaskStatus::Finished) {
+		completed_++;
+	} else {
+		failed_++;
+	}
+
+	if (!task.joiners.empty()) {
+		for (TaskId joinerId : task.joiners) {
+			Task& joiner = tasks_.at(joinerId);
+			lua_checkstack(joiner.thread, 1);
+			lua_pushboolean(joiner.thread, status == TaskStatus::Finished);
+			int n = pushResults(task, joiner.thread);
+			if (n < 0) {
+				throw std::runtime_error("Scheduler: stack overflow while passing task results");
+			}
+			joiner.nargs = 1 + n;
+			joiner.status = TaskStatus::Ready;
+			ready_.push_back(joinerId);
+		}
+		removeTask(id);
+	} else if (task.detached) {
+		removeTask(id);
+	}
+}
+
+int LuaScheduler::pushResults(Task& task, lua_State* to) {
+	int n = task.nresults;
+	int top = lua_gettop(task.thread);
+	// Reported by the caller: a C function must not throw
+	if (!lua_checkstack(task.thread, n) || !lua_checkstack(to, n)) {
+		return -1;
+	}
+	for (int i = top - n + 1; i <= top; i++) {
+		lua_pushvalue(task.thread, i);
+	}
+	lua_xmove(task.thread, to, n);
+	return n;
+}
+
+size_t LuaScheduler::runOnce() {
+	advanceTimers();
+
+	size_t resumed = 0;
+	for (size_t pending = ready_.size(); pending > 0 && !ready_.empty(); pending--) {
+		TaskId id = ready_.front();
+		ready_.pop_front();
+		step(id);
+		resumed++;
+	}
+	return resumed;
+}
+
+void LuaScheduler::run() {
+	while (true) {
+		runOnce();
+		if (!ready_.empty()) {
+			continue;
+		}
+		if (sleeping_ == 0) {
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(config_.tickMs));
+	}
+}
+
+int LuaScheduler::await(TaskId id) {
+	if (current_ != 0) {
+		throw std::runtime_error("Scheduler: await() can not be called from a task");
+	}
+
+	auto it = tasks_.find(id);
+	if (it == tasks_.end()) {
+		throw std::runtime_error("Scheduler: unknown task " + std::to_string(id));
+	}
+
+	while (it->second.status != TaskStatus::Finished && it->second.status != TaskStatus::Failed) {
+		if (ready_.empty() && sleeping_ == 0) {
+			throw std::runtime_error("Scheduler: task " + std::to_string(id) + " can not finish, no task is ready or sleeping");
+		}
+		if (runOnce() == 0 && ready_.empty()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(config_.tickMs));
+		}
+		it = tasks_.find(id);
+		if (it == tasks_.end()) {
+			throw std::runtime_error("Scheduler: task " + std::to_string(id) + " was joined by another task");
+		}
+	}
+
+	Task& task = it->second;
+	if (task.status == TaskStatus::Failed) {
+		std::string error = task.error;
+		removeTask(id);
+		throw std::runtime_error(error);
+	}
+
+	int n = pushResults(task, state_);
+	if (n < 0) {
+		throw std::runtime_error("Scheduler: stack overflow while passing task results");
+	}
+	removeTask(id);
+	return n;
+}
+
+void LuaScheduler::detach(TaskId id) {
+	auto it = tasks_.find(id);
+	if (it == tasks_.end()) {
+		return;
+	}
+	if (it->second.status == TaskStatus::Finished || it->second.status == TaskStatus::Failed) {
+		removeTask(id);
+	} else {
+		it->second.detached = true;
+	}
+}
+
+TaskStatus LuaScheduler::getStatus(TaskId id) const {
+	auto it = tasks_.find(id);
+	return it == tasks_.end() ? TaskStatus::Unknown : it->second.status;
+}
+
+std::string LuaScheduler::getError(TaskId id) const {
+	auto it = tasks_.find(id);
+	return it == tasks_.end() ? std::string() : it->second.error;
+}
+
+uint64_t LuaScheduler::currentTick() const {
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+	return (uint64_t) elapsed.count() / config_.tickMs;
+}
+
+void LuaScheduler::addTimer(TaskId id, size_t ms) {
+	uint64_t ticks = (ms + config_.tickMs - 1) / config_.tickMs;
+	uint64_t deadline = std::max(currentTick() + ticks, tick_ + 1);
+	wheel_[deadline & wheelMask_].push_back(Timer{deadline, id});
+	sleeping_++;
+}
+
+void LuaScheduler::advanceTimers() {
+	uint64_t now = currentTick();
+	if (now <= tick_) {
+		return;
+	}
+
+	auto expire = [this](std::vector<Timer>& slot, uint64_t until) {
+		size_t kept = 0;
+		for (size_t i = 0; i < slot.size(); i++) {
+			if (slot[i].tick <= until) {
+				wake(slot[i].id);
+			} else {
+				slot[kept++] = slot[i];
+			}
+		}
+		slot.resize(kept);
+	};
+
+	if (now - tick_ >= wheel_.size()) {
+		// Fell behind by a full turn; every slot may hold expired timers
+		for (size_t i = 1; i <= wheel_.size(); i++) {
+			expire(wheel_[(tick_ + i) & wheelMask_], now);
+		}
+		tick_ = now;
+		return;
+	}
+
+	while (tick_ < now) {
+		tick_++;
+		expire(wheel_[tick_ & wheelMask_], tick_);
+	}
+}
+
+void LuaScheduler::wake(TaskId id) {
+	sleeping_--;
+	auto it = tasks_.find(id);
+	if (it == tasks_.end()) {
+		return;
+	}
+	it->second.status = TaskStatus::Ready;
+	ready_.push_back(id);
+}
+
+LuaState& LuaScheduler::getState() {
+	return state_;
+}
+
+const SchedulerConfig& LuaScheduler::getConfig() const {
+	return config_;
+}
+
+size_t LuaScheduler::taskCount() const {
+	return tasks_.size();
+}
+
+size_t LuaScheduler::readyCount() const {
+	return ready_.size();
+}
+
+size_t LuaScheduler::sleepingCount() const {
+	return sleeping_;
+}
+
+uint64_t LuaScheduler::completedCount() const {
+	return completed_;
+}
+
+uint64_t LuaScheduler::failedCount() const {
+	return failed_;
+}
+
+void LuaScheduler::registerLibrary() {
+	if (config_.libraryName.empty()) {
+		return;
+	}
+
+	static const luaL_Reg functions[] = {
+		{"spawn", s_spawn},
+		{"yield", s_yield},
+		{"sleep", s_sleep},
+		{"join", s_join},
+		{"detach", s_detach},
+		{"self", s_self},
+		{"status", s_status},
+		{NULL, NULL}
+	};
+
+	lua_newtable(state_);
+	*static_cast<LuaScheduler**>(lua_newuserdata(state_, sizeof(LuaScheduler*))) = this;
+	lua_pushvalue(state_, -1);
+	libraryRef_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+	luaL_setfuncs(state_, functions, 1);
+	lua_setglobal(state_, config_.libraryName.c_str());
+}
+
+LuaScheduler& LuaScheduler::fromUpvalue(lua_State* L) {
+	LuaScheduler* scheduler = *static_cast<LuaScheduler**>(lua_touserdata(L, lua_upvalueindex(1)));
+	if (scheduler == nullptr) {
+		luaL_error(L, "scheduler: the scheduler was destroyed");
+	}
+	return *scheduler;
+}
+
+LuaScheduler::TaskId LuaScheduler::checkTask(lua_State* L, const char* fname) {
+	auto it = threads_.find(L);
+	if (it == threads_.end() || it->second != current_) {
+		luaL_error(L, "%s: must be called from a scheduler task", fname);
+	}
+	return it->second;
+}
+
+int LuaScheduler::s_spawn(lua_State* L) {
+	LuaScheduler& scheduler = fromUpvalue(L);
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	TaskId id = scheduler.addTask(L, lua_gettop(L) - 1);
+	if (id == 0) {
+		return luaL_error(L, "spawn: too many arguments for a task");
+	}
+	lua_pushinteger(L, (lua_Integer) id);
+	return 1;
+}
+
+int LuaScheduler::s_yield(lua_State* L) {
+	LuaScheduler& scheduler = fromUpvalue(L);
+	scheduler.checkTask(L, "yield");
+	scheduler.request_ = Request::Yield;
+	return lua_yield(L, 0);
+}
+
+int LuaScheduler::s_sleep(lua_State* L) {
+	LuaScheduler& scheduler = fromUpvalue(L);
+	scheduler.checkTask(L, "sleep");
+	lua_Number ms = luaL_checknumber(L, 1);
+	scheduler.request_ = Request::Sleep;
+	scheduler.requestMs_ = ms > 0 ? (size_t) std::ceil(ms) : 0;
+	return lua_yield(L, 0);
+}
+
+int LuaScheduler::s_join(lua_State* L) {
+	LuaScheduler& scheduler = fromUpvalue(L);
+	TaskId self = scheduler.checkTask(L, "join");
+	TaskId target = (TaskId) luaL_checkinteger(L, 1);
+	if (target == self) {
+		return luaL_error(L, "join: a task can not join itself");
+	}
+
+	auto it = scheduler.tasks_.find(target);
+	if (it == scheduler.tasks_.end()) {
+		return luaL_error(L, "join: unknown task %d", (int) target);
+	}
+
+	Task& task = it->second;
+	if (task.status == TaskStatus::Finished || task.status == TaskStatus::Failed) {
+		lua_pushboolean(L, task.status == TaskStatus::Finished);
+		int n = pushResults(task, L);
+		if (n < 0) {
+			return luaL_error(L, "join: stack overflow while passing task results");
+		}
+		scheduler.removeTask(target);
+		return n + 1;
+	}
+
+	scheduler.request_ = Request::Join;
+	scheduler.requestJoin_ = target;
+	return lua_yield(L, 0);
+}
+
+int LuaScheduler::s_detach(lua_State* L) {
+	fromUpvalue(L).detach((TaskId) luaL_checkinteger(L, 1));
+	return 0;
+}
+
+int LuaScheduler::s_self(lua_State* L) {
+	LuaScheduler& scheduler = fromUpvalue(L);
+	auto it = scheduler.threads_.find(L);
+	if (it == scheduler.threads_.end()) {
+		lua_pushnil(L);
+	} else {
+		lua_pushinteger(L, (lua_Integer) it->second);
+	}
+	return 1;
+}
+
+int LuaScheduler::s_status(lua_State* L) {
+	switch (fromUpvalue(L).getStatus((TaskId) luaL_checkinteger(L, 1))) {
+		case TaskStatus::Ready:
+			lua_pushstring(L, "ready");
+			break;
+		case TaskStatus::Sleeping:
+			lua_pushstring(L, "sleeping");
+			break;
+		case TaskStatus::Joining:
+			lua_pushstring(L, "joining");
+			break;
+		case TaskStatus::Finished:
+			lua_pushstring(L, "finished");
+			break;
+		case TaskStatus::Failed:
+			lua_pushstring(L, "failed");
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+	}
+	return 1;
+}
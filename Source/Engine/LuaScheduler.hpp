@@ -0,0 +1,273 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_LUASCHEDULER_HPP
+#define LUACPP_LUASCHEDULER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../Lua.hpp"
+#include "LuaState.hpp"
+
+namespace LuaCpp {
+	namespace Engine {
+
+		struct SchedulerConfig final {
+			/**
+			 * @brief Resolution of `sleep()` in milliseconds
+			 */
+			size_t tickMs = 1;
+			/**
+			 * @brief Number of slots of the timer wheel, rounded up to a
+			 * power of two
+			 */
+			size_t wheelSlots = 256;
+			/**
+			 * @brief Global under which the Lua library is registered,
+			 * empty to not register it
+			 */
+			std::string libraryName = "scheduler";
+
+			SchedulerConfig& SetTickMs(size_t ms) {
+				tickMs = ms;
+				return *this;
+			}
+
+			SchedulerConfig& SetWheelSlots(size_t slots) {
+				wheelSlots = slots;
+				return *this;
+			}
+
+			SchedulerConfig& SetLibraryName(const std::string& name) {
+				libraryName = name;
+				return *this;
+			}
+		};
+
+		enum class TaskStatus {
+			/** @brief Not known to the scheduler, or already joined */
+			Unknown,
+			Ready,
+			Sleeping,
+			/** @brief Waiting in `join()` for another task */
+			Joining,
+			Finished,
+			Failed
+		};
+
+		/**
+		 * @brief Runs many Lua coroutines cooperatively inside one state
+		 *
+		 * @details
+		 * Every task is a `lua_newthread` of the scheduler's state, so it
+		 * costs about a kilobyte instead of a full state. Ready tasks are
+		 * resumed in FIFO order; a task runs until it yields, sleeps,
+		 * joins another task or ends. Sleeping tasks are kept in a hashed
+		 * timer wheel with a resolution of `tickMs`.
+		 *
+		 * The Lua library (`scheduler` by default) offers:
+		 *
+		 * | Function | Description |
+		 * |----------|-------------|
+		 * | `spawn(f, ...)` | Start a task running `f(...)`, returns its id |
+		 * | `yield()` | Let the other ready tasks run |
+		 * | `sleep(ms)` | Suspend the task for `ms` milliseconds |
+		 * | `join(id)` | Wait for a task; returns `true, results...` or `false, error` |
+		 * | `detach(id)` | Drop the results of a task when it ends |
+		 * | `self()` | Id of the running task, `nil` outside a task |
+		 * | `status(id)` | `"ready"`, `"sleeping"`, `"joining"`, `"finished"`, `"failed"` or `nil` |
+		 *
+		 * `yield`, `sleep` and `join` must be called from the body of a
+		 * task, not from a coroutine created inside it. The results of a
+		 * finished task are kept until it is joined (from Lua or with
+		 * await()) or detached.
+		 *
+		 * The scheduler is not thread-safe and must be destroyed before
+		 * its state is closed or released to a pool. Destroying it
+		 * removes the library; functions of it that a script kept raise
+		 * an error from then on.
+		 */
+		class LuaScheduler {
+		public:
+			typedef uint64_t TaskId;
+
+		private:
+			enum class Request {
+				None,
+				Yield,
+				Sleep,
+				Join
+			};
+
+			struct Task {
+				lua_State* thread = nullptr;
+				int ref = LUA_NOREF;
+				TaskStatus status = TaskStatus::Ready;
+				/** @brief Values on the thread's stack for the next resume */
+				int nargs = 0;
+				/** @brief Results (or the error) at the top of the thread's stack */
+				int nresults = 0;
+				bool detached = false;
+				std::vector<TaskId> joiners;
+				std::string error;
+			};
+
+			struct Timer {
+				uint64_t tick;
+				TaskId id;
+			};
+
+			LuaState& state_;
+			SchedulerConfig config_;
+			std::unordered_map<TaskId, Task> tasks_;
+			std::unordered_map<lua_State*, TaskId> threads_;
+			std::deque<TaskId> ready_;
+			TaskId nextId_ = 1;
+			TaskId current_ = 0;
+
+			Request request_ = Request::None;
+			size_t requestMs_ = 0;
+			TaskId requestJoin_ = 0;
+
+			std::vector<std::vector<Timer>> wheel_;
+			size_t wheelMask_ = 0;
+			uint64_t tick_ = 0;
+			size_t sleeping_ = 0;
+			std::chrono::steady_clock::time_point start_;
+
+			uint64_t completed_ = 0;
+			uint64_t failed_ = 0;
+
+			/**
+			 * @brief Registry reference to the userdata holding `this`
+			 *
+			 * @details
+			 * The functions of the library share the userdata as their
+			 * upvalue. The destructor clears it, so a function a script
+			 * kept after that raises an error instead of using a
+			 * destroyed scheduler.
+			 */
+			int libraryRef_ = LUA_NOREF;
+
+			TaskId addTask(lua_State* from, int nargs);
+			void removeTask(TaskId id);
+			void step(TaskId id);
+			void finish(TaskId id, Task& task, TaskStatus status);
+			static int pushResults(Task& task, lua_State* to);
+
+			uint64_t currentTick() const;
+			void addTimer(TaskId id, size_t ms);
+			void advanceTimers();
+			void wake(TaskId id);
+
+			void registerLibrary();
+			static LuaScheduler& fromUpvalue(lua_State* L);
+			TaskId checkTask(lua_State* L, const char* fname);
+
+			static int s_spawn(lua_State* L);
+			static int s_yield(lua_State* L);
+			static int s_sleep(lua_State* L);
+			static int s_join(lua_State* L);
+			static int s_detach(lua_State* L);
+			static int s_self(lua_State* L);
+			static int s_status(lua_State* L);
+
+		public:
+			explicit LuaScheduler(LuaState& state, SchedulerConfig config = SchedulerConfig());
+			~LuaScheduler();
+
+			LuaScheduler(const LuaScheduler&) = delete;
+			LuaScheduler& operator=(const LuaScheduler&) = delete;
+			LuaScheduler(LuaScheduler&&) = delete;
+			LuaScheduler& operator=(LuaScheduler&&) = delete;
+
+			/**
+			 * @brief Starts a task from the function and arguments on
+			 * top of the state's stack
+			 *
+			 * @details
+			 * Pops the function and its `nargs` arguments. The task
+			 * first runs at the next runOnce().
+			 */
+			TaskId spawn(int nargs = 0);
+
+			/**
+			 * @brief Resumes every task that is ready, once
+			 *
+			 * @details
+			 * Wakes the sleepers whose time has come first. Tasks that
+			 * become ready while the pass runs are resumed by the next
+			 * pass.
+			 *
+			 * @return number of tasks resumed
+			 */
+			size_t runOnce();
+
+			/**
+			 * @brief Runs until no task is ready or sleeping
+			 *
+			 * @details
+			 * Tasks blocked in `join()` on a task that never ends are
+			 * left in place.
+			 */
+			void run();
+
+			/**
+			 * @brief Runs the scheduler until the task ended and pushes
+			 * its results onto the state's stack
+			 *
+			 * @details
+			 * Throws `std::runtime_error` with the task's error if it
+			 * failed, or if nothing is left that could end it. The task
+			 * is removed either way.
+			 *
+			 * @return number of results pushed
+			 */
+			int await(TaskId id);
+
+			/**
+			 * @brief Drops the results of the task once it ended
+			 */
+			void detach(TaskId id);
+
+			TaskStatus getStatus(TaskId id) const;
+			std::string getError(TaskId id) const;
+
+			LuaState& getState();
+			const SchedulerConfig& getConfig() const;
+			size_t taskCount() const;
+			size_t readyCount() const;
+			size_t sleepingCount() const;
+			uint64_t completedCount() const;
+			uint64_t failedCount() const;
+		};
+	}
+}
+
+#endif // LUACPP_LUASCHEDULER_HPP
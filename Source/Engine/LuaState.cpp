@@ -24,6 +24,7 @@
    */
 
 #include "LuaState.hpp"
+#include "LuaAllocator.hpp"
 
 using namespace LuaCpp::Engine;
 
@@ -34,11 +35,15 @@ LuaState::LuaState() {
 
 LuaState::LuaState(StateParams params) {
    shared = false;
+   if (params.memoryLimitBytes > 0 || params.memoryBudget) {
+      params = AccountingAllocator::Wrap(std::move(params));
+   }
+   owner = std::move(params.owner);
    L = lua_newstate(params.allocator, params.userData);
 }
 
 LuaState::~LuaState() {
-	if (!shared) {
+	if (!shared && L != nullptr) {
 		lua_close(L);
 	}
 }
@@ -51,6 +56,10 @@ lua_State * LuaState::getState() {
 	return L;
 }
 
+PoolUsage& LuaState::getPoolUsage() {
+	return usage;
+}
+
 void LuaState::PrintStack(std::ostream &out) {
 
 	int top = lua_gettop(L);
@@ -27,6 +27,9 @@
 #define LUACPP_LUASTATE_HPP
 
 #include <ostream>
+#include <chrono>
+#include <memory>
+#include <cstdint>
 
 #include "../Lua.hpp"
 
@@ -36,12 +39,44 @@ namespace LuaCpp {
 	 */
 	namespace Engine {
 
+		class MemoryBudget;
+
 		/**
 		 * @brief Parameters for creating a Lua state with a custom allocator
+		 *
+		 * @details
+		 * When `owner` is set, the LuaState keeps it alive until the
+		 * Lua state is closed, which allows `userData` to point to an
+		 * allocator that belongs to a single state.
+		 *
+		 * When `memoryLimitBytes` or `memoryBudget` is set, the allocator
+		 * (or the system allocator if none is given) is wrapped in an
+		 * AccountingAllocator that fails allocations above the limit,
+		 * so the script gets a `LUA_ERRMEM` error. The limit must leave
+		 * room for the libraries opened in the state.
 		 */
 		struct StateParams final {
 			lua_Alloc allocator = nullptr;
 			void* userData = nullptr;
+			std::shared_ptr<void> owner;
+			size_t memoryLimitBytes = 0;
+			std::shared_ptr<MemoryBudget> memoryBudget;
+		};
+
+		/**
+		 * @brief Lifecycle of a state handed out by a StatePool
+		 *
+		 * @details
+		 * Maintained by the pool that owns the state; all fields stay
+		 * at their defaults for states created outside a pool.
+		 */
+		struct PoolUsage final {
+			std::chrono::steady_clock::time_point created;
+			std::chrono::steady_clock::time_point acquired;
+			std::chrono::steady_clock::time_point released;
+			size_t uses = 0;
+			/** @brief Generation of the InheritedSetup the state was built with */
+			uint64_t setupGeneration = 0;
 		};
 
 		/**
@@ -56,6 +91,8 @@ namespace LuaCpp {
 		private:
 			lua_State *L;
 			bool shared;
+			PoolUsage usage;
+			std::shared_ptr<void> owner;
 		public:
 			/**
 			 * @brief Constructor that creates a new state
@@ -123,6 +160,15 @@ namespace LuaCpp {
 			 */	
 			lua_State * getState();
 
+			/**
+			 * @brief Returns the pool bookkeeping of the state
+			 *
+			 * @details
+			 * Used by StatePool to track when the state was created,
+			 * acquired and released and how many times it has been used.
+			 */
+			PoolUsage& getPoolUsage();
+
 			/**
 			 * @brief Print the stack content on a stream
 			 *
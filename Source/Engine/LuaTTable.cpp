@@ -113,7 +113,8 @@ void LuaTTable::PushValue(LuaState &L) {
 		if (key.isNumber()) {
 			lua_seti(L, -2, key.getIntValue());
 		} else {
-			lua_setfield(L, -2, key.getStringValue().c_str());
+			// No temporary string: this may run in a protected call
+			lua_setfield(L, -2, key.str_val.c_str());
 		}
 	}
 
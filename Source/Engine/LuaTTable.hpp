@@ -35,6 +35,8 @@
 
 namespace LuaCpp {
 	namespace Engine {
+		class LuaTTable;
+
 		namespace Table {
 			/**
 			 * @brief A helper class that holds the key type
@@ -64,6 +66,7 @@ namespace LuaCpp {
 				friend bool operator <(const Key &lhs, const Key &rhs);
 				friend bool operator ==(const Key &lhs, const Key &rhs);
 				friend std::ostream& operator<<(std::ostream& os, const Key &key);
+				friend class LuaCpp::Engine::LuaTTable;
 
 			};
 		}
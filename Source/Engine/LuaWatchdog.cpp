@@ -0,0 +1,123 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include "LuaWatchdog.hpp"
+
+using namespace LuaCpp::Engine;
+
+namespace {
+	void timeoutHook(lua_State* L, lua_Debug*) {
+		luaL_error(L, "%s", LuaWatchdog::TimeoutMessage);
+	}
+}
+
+const char* LuaWatchdog::TimeoutMessage = "execution deadline exceeded";
+
+LuaWatchdog& LuaWatchdog::shared() {
+	static LuaWatchdog watchdog;
+	return watchdog;
+}
+
+LuaWatchdog::~LuaWatchdog() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cv_.notify_all();
+	if (thread_.joinable()) {
+		thread_.join();
+	}
+}
+
+uint64_t LuaWatchdog::arm(lua_State* L, Deadline deadline) {
+	Watch watch;
+	watch.L = L;
+	watch.deadline = deadline;
+	watch.hook = lua_gethook(L);
+	watch.mask = lua_gethookmask(L);
+	watch.count = lua_gethookcount(L);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!thread_.joinable()) {
+		thread_ = std::thread(&LuaWatchdog::run, this);
+	}
+
+	uint64_t id = nextId_++;
+	watches_.emplace(id, watch);
+	deadlines_.emplace(deadline, id);
+	if (deadlines_.begin()->second == id) {
+		cv_.notify_one();
+	}
+	return id;
+}
+
+bool LuaWatchdog::disarm(uint64_t id) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = watches_.find(id);
+	if (it == watches_.end()) {
+		return false;
+	}
+
+	Watch& watch = it->second;
+	bool fired = watch.fired;
+	if (fired) {
+		lua_sethook(watch.L, watch.hook, watch.mask, watch.count);
+	} else {
+		deadlines_.erase(std::make_pair(watch.deadline, id));
+	}
+	watches_.erase(it);
+	return fired;
+}
+
+void LuaWatchdog::run() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stopping_) {
+		if (deadlines_.empty()) {
+			cv_.wait(lock);
+			continue;
+		}
+
+		auto next = *deadlines_.begin();
+		if (std::chrono::steady_clock::now() < next.first) {
+			cv_.wait_until(lock, next.first);
+			continue;
+		}
+
+		deadlines_.erase(deadlines_.begin());
+		Watch& watch = watches_.at(next.second);
+		watch.fired = true;
+		fired_++;
+		lua_sethook(watch.L, timeoutHook, LUA_MASKCOUNT, 1);
+	}
+}
+
+size_t LuaWatchdog::watchCount() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return watches_.size();
+}
+
+uint64_t LuaWatchdog::firedCount() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return fired_;
+}
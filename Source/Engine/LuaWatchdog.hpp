@@ -0,0 +1,173 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_LUAWATCHDOG_HPP
+#define LUACPP_LUAWATCHDOG_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "../Lua.hpp"
+
+namespace LuaCpp {
+	namespace Engine {
+
+		typedef std::chrono::steady_clock::time_point Deadline;
+
+		/**
+		 * @brief Thrown when a run is stopped because its deadline passed
+		 */
+		class LuaTimeoutException : public std::runtime_error {
+		public:
+			explicit LuaTimeoutException(const std::string& message)
+				: std::runtime_error(message) {}
+		};
+
+		/**
+		 * @brief Background thread that stops Lua code running past its
+		 * deadline
+		 *
+		 * @details
+		 * A watched state runs without any hook. Only when its deadline
+		 * passes does the watchdog install a count hook with
+		 * `lua_sethook()`, which Lua allows from another thread, that
+		 * raises an error at the next instruction. The hook keeps
+		 * firing, so the script cannot swallow the error with `pcall`.
+		 * disarm() puts back the hook the state had when it was armed.
+		 *
+		 * Only the watched `lua_State` gets the hook; coroutines it runs
+		 * are stopped once they return to it.
+		 */
+		class LuaWatchdog {
+		private:
+			struct Watch {
+				lua_State* L = nullptr;
+				Deadline deadline;
+				bool fired = false;
+				lua_Hook hook = nullptr;
+				int mask = 0;
+				int count = 0;
+			};
+
+			std::mutex mutex_;
+			std::condition_variable cv_;
+			std::thread thread_;
+			bool stopping_ = false;
+
+			std::map<uint64_t, Watch> watches_;
+			std::set<std::pair<Deadline, uint64_t>> deadlines_;
+			uint64_t nextId_ = 1;
+			uint64_t fired_ = 0;
+
+			void run();
+
+		public:
+			/**
+			 * @brief Message of the error raised in a timed out state
+			 */
+			static const char* TimeoutMessage;
+
+			LuaWatchdog() = default;
+			~LuaWatchdog();
+
+			LuaWatchdog(const LuaWatchdog&) = delete;
+			LuaWatchdog& operator=(const LuaWatchdog&) = delete;
+
+			/**
+			 * @brief The watchdog shared by all contexts; its thread is
+			 * started by the first arm()
+			 */
+			static LuaWatchdog& shared();
+
+			/**
+			 * @brief Watches `L` until disarm()
+			 *
+			 * @details
+			 * Must be called from the thread that runs `L`.
+			 *
+			 * @return id to pass to disarm()
+			 */
+			uint64_t arm(lua_State* L, Deadline deadline);
+
+			/**
+			 * @brief Stops watching and restores the hook of the state
+			 *
+			 * @details
+			 * Must be called from the thread that runs the state, after
+			 * the protected call returned.
+			 *
+			 * @return true if the deadline had passed and the timeout
+			 * hook was installed
+			 */
+			bool disarm(uint64_t id);
+
+			size_t watchCount();
+			uint64_t firedCount();
+		};
+
+		/**
+		 * @brief Arms the shared watchdog for the lifetime of the guard
+		 */
+		class DeadlineGuard {
+		private:
+			LuaWatchdog& watchdog_;
+			uint64_t id_;
+			bool armed_ = true;
+			bool expired_ = false;
+
+		public:
+			DeadlineGuard(lua_State* L, Deadline deadline, LuaWatchdog& watchdog = LuaWatchdog::shared())
+				: watchdog_(watchdog), id_(watchdog.arm(L, deadline)) {}
+
+			~DeadlineGuard() {
+				disarm();
+			}
+
+			DeadlineGuard(const DeadlineGuard&) = delete;
+			DeadlineGuard& operator=(const DeadlineGuard&) = delete;
+
+			/**
+			 * @brief Disarms the watchdog early
+			 *
+			 * @return true if the deadline expired while armed
+			 */
+			bool disarm() {
+				if (armed_) {
+					armed_ = false;
+					expired_ = watchdog_.disarm(id_);
+				}
+				return expired_;
+			}
+		};
+	}
+}
+
+#endif // LUACPP_LUAWATCHDOG_HPP
@@ -0,0 +1,140 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_MPMCQUEUE_HPP
+#define LUACPP_MPMCQUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace LuaCpp {
+	namespace Engine {
+
+		/**
+		 * @brief Bounded lock-free multi-producer multi-consumer queue
+		 *
+		 * @details
+		 * Ring buffer after Dmitry Vyukov's bounded MPMC queue. Every cell
+		 * carries a sequence number that tells producers and consumers
+		 * whether the cell is free to write or ready to read, so a push or
+		 * pop is a single CAS on the shared position plus one store to the
+		 * cell. The capacity is rounded up to a power of two and is fixed
+		 * at construction.
+		 *
+		 * Elements must be cheap to copy; the pool stores raw `LuaState`
+		 * pointers and keeps ownership itself.
+		 */
+		template <typename T>
+		class MPMCQueue {
+		private:
+			struct Cell {
+				std::atomic<size_t> sequence;
+				T data;
+			};
+
+			static constexpr size_t CacheLine = 64;
+
+			std::unique_ptr<Cell[]> buffer_;
+			size_t mask_;
+			alignas(CacheLine) std::atomic<size_t> enqueuePos_;
+			alignas(CacheLine) std::atomic<size_t> dequeuePos_;
+
+			static size_t roundUp(size_t capacity) {
+				size_t size = 2;
+				while (size < capacity) {
+					size <<= 1;
+				}
+				return size;
+			}
+
+		public:
+			explicit MPMCQueue(size_t capacity)
+				: buffer_(new Cell[roundUp(capacity)])
+				, mask_(roundUp(capacity) - 1)
+				, enqueuePos_(0)
+				, dequeuePos_(0)
+			{
+				for (size_t i = 0; i <= mask_; i++) {
+					buffer_[i].sequence.store(i, std::memory_order_relaxed);
+				}
+			}
+
+			MPMCQueue(const MPMCQueue&) = delete;
+			MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+			/**
+			 * @brief Appends a value, returns false if the queue is full
+			 */
+			bool tryPush(const T& value) {
+				size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+				for (;;) {
+					Cell& cell = buffer_[pos & mask_];
+					size_t seq = cell.sequence.load(std::memory_order_acquire);
+					intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+					if (diff == 0) {
+						if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+							cell.data = value;
+							cell.sequence.store(pos + 1, std::memory_order_release);
+							return true;
+						}
+					} else if (diff < 0) {
+						return false;
+					} else {
+						pos = enqueuePos_.load(std::memory_order_relaxed);
+					}
+				}
+			}
+
+			/**
+			 * @brief Removes the oldest value, returns false if the queue is empty
+			 */
+			bool tryPop(T& value) {
+				size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+				for (;;) {
+					Cell& cell = buffer_[pos & mask_];
+					size_t seq = cell.sequence.load(std::memory_order_acquire);
+					intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+					if (diff == 0) {
+						if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+							value = cell.data;
+							cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+							return true;
+						}
+					} else if (diff < 0) {
+						return false;
+					} else {
+						pos = dequeuePos_.load(std::memory_order_relaxed);
+					}
+				}
+			}
+
+			size_t capacity() const {
+				return mask_ + 1;
+			}
+		};
+	}
+}
+
+#endif // LUACPP_MPMCQUEUE_HPP
@@ -30,21 +30,82 @@
 #include <map>
 #include <memory>
 #include <tuple>
+#include <functional>
+#include <cstdint>
+#include <thread>
 
 #include "../Lua.hpp"
 #include "LuaType.hpp"
+#include "LuaState.hpp"
+#include "../Registry/LuaLibrary.hpp"
 
 namespace LuaCpp {
 	namespace Engine {
 
 		typedef std::map<std::string, std::shared_ptr<LuaType>> PoolEnvironment;
 
+		/**
+		 * @brief How a released state is cleaned before it is reused
+		 */
+		enum class ResetMode {
+			/**
+			 * @brief Clear the stack and re-push the configured globals;
+			 * anything else a script leaves behind stays in the state
+			 */
+			Light,
+			/**
+			 * @brief Additionally restore `_G` and `package.loaded` to
+			 * the snapshot taken when the state was created
+			 */
+			Snapshot
+		};
+
+		/**
+		 * @brief Creates the allocator parameters for one pooled state
+		 *
+		 * @details
+		 * Called once for every state the pool creates. Per-state
+		 * allocator data can be kept alive through `StateParams::owner`.
+		 */
+		typedef std::function<StateParams()> AllocatorFactory;
+
+		/**
+		 * @brief What the pools of a LuaContext inherit from it
+		 *
+		 * @details
+		 * The custom libraries, built-in functions and hooks that
+		 * LuaContext::newState() registers in every state. The context
+		 * publishes a new setup with a higher generation whenever one of
+		 * them changes; states built with an older generation are
+		 * brought up to date by maintain() or on their next acquire.
+		 */
+		struct InheritedSetup final {
+			uint64_t generation = 0;
+			std::vector<std::shared_ptr<Registry::LuaLibrary>> customLibraries;
+			std::map<std::string, lua_CFunction> builtInFunctions;
+			std::vector<std::tuple<std::string, int, lua_Hook>> hooks;
+		};
+
 		struct PoolConfig final {
 			std::vector<std::string> libraries;
 			PoolEnvironment globalVariables;
 			std::vector<std::tuple<std::string, int, lua_Hook>> hooks;
 			size_t maxSize = 5;
 			size_t exhaustionTimeoutMs = 0;
+			bool lockFreeQueue = false;
+			size_t threadCacheSize = 0;
+			size_t shards = 0;
+			size_t minIdle = 0;
+			size_t maxIdle = 0;
+			size_t idleTimeoutMs = 0;
+			ResetMode resetMode = ResetMode::Light;
+			AllocatorFactory allocatorFactory;
+			size_t memoryLimitBytes = 0;
+			size_t poolMemoryLimitBytes = 0;
+			size_t maxUsesPerState = 0;
+			size_t maxHeapBytes = 0;
+			size_t maxStateAgeMs = 0;
+			bool asyncRecycle = false;
 
 			PoolConfig() = default;
 
@@ -72,6 +133,81 @@ namespace LuaCpp {
 				exhaustionTimeoutMs = timeoutMs;
 				return *this;
 			}
+
+			PoolConfig& SetLockFreeQueue(bool lockFree) {
+				lockFreeQueue = lockFree;
+				return *this;
+			}
+
+			PoolConfig& SetThreadCacheSize(size_t size) {
+				threadCacheSize = size;
+				return *this;
+			}
+
+			PoolConfig& SetShards(size_t count) {
+				shards = count;
+				return *this;
+			}
+
+			PoolConfig& SetShardPerCpu() {
+				shards = std::thread::hardware_concurrency();
+				return *this;
+			}
+
+			PoolConfig& SetMinIdle(size_t count) {
+				minIdle = count;
+				return *this;
+			}
+
+			PoolConfig& SetMaxIdle(size_t count) {
+				maxIdle = count;
+				return *this;
+			}
+
+			PoolConfig& SetIdleTimeoutMs(size_t timeoutMs) {
+				idleTimeoutMs = timeoutMs;
+				return *this;
+			}
+
+			PoolConfig& SetResetMode(ResetMode mode) {
+				resetMode = mode;
+				return *this;
+			}
+
+			PoolConfig& SetAllocatorFactory(AllocatorFactory factory) {
+				allocatorFactory = std::move(factory);
+				return *this;
+			}
+
+			PoolConfig& SetMemoryLimitBytes(size_t bytes) {
+				memoryLimitBytes = bytes;
+				return *this;
+			}
+
+			PoolConfig& SetPoolMemoryLimitBytes(size_t bytes) {
+				poolMemoryLimitBytes = bytes;
+				return *this;
+			}
+
+			PoolConfig& SetMaxUsesPerState(size_t uses) {
+				maxUsesPerState = uses;
+				return *this;
+			}
+
+			PoolConfig& SetMaxHeapBytes(size_t bytes) {
+				maxHeapBytes = bytes;
+				return *this;
+			}
+
+			PoolConfig& SetMaxStateAgeMs(size_t ageMs) {
+				maxStateAgeMs = ageMs;
+				return *this;
+			}
+
+			PoolConfig& SetAsyncRecycle(bool async) {
+				asyncRecycle = async;
+				return *this;
+			}
 		};
 	}
 }
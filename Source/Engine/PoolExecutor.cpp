@@ -0,0 +1,280 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <algorithm>
+
+#include "PoolExecutor.hpp"
+
+using namespace LuaCpp::Engine;
+
+namespace {
+	/**
+	 * @brief Executor and queue index of the worker running on this thread
+	 */
+	thread_local const PoolExecutor* workerExecutor = nullptr;
+	thread_local size_t workerIndex = 0;
+
+	/**
+	 * @brief How long a worker waits for a state at a time; it goes on
+	 * waiting until the pool hands it one
+	 */
+	const std::chrono::milliseconds stateWaitSlice(1000);
+}
+
+PoolExecutor::PoolExecutor(ExecutorConfig config)
+	: config_(std::move(config))
+{
+	if (config_.workers == 0) {
+		config_.workers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+	config_.queueCapacity = std::max<size_t>(config_.queueCapacity, 1);
+
+	for (size_t i = 0; i < config_.workers; i++) {
+		queues_.push_back(std::make_unique<WorkerQueue>());
+	}
+	for (size_t i = 0; i < config_.workers; i++) {
+		workers_.emplace_back(&PoolExecutor::workerLoop, this, i);
+	}
+}
+
+PoolExecutor::~PoolExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	notEmpty_.notify_all();
+	notFull_.notify_all();
+	for (auto& worker : workers_) {
+		worker.join();
+	}
+}
+
+std::future<void> PoolExecutor::submit(const PoolHandle& pool, std::function<void(LuaState&)> task) {
+	auto promise = std::make_shared<std::promise<void>>();
+	std::future<void> future = promise->get_future();
+	submit(pool, std::move(task), [promise](std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value();
+		}
+	});
+	return future;
+}
+
+void PoolExecutor::submit(const PoolHandle& pool, std::function<void(LuaState&)> task, std::function<void(std::exception_ptr)> done) {
+	// Fail in the caller rather than in a worker
+	if (!pool) {
+		throw std::runtime_error("Empty pool handle");
+	}
+	enqueue(Job{pool, std::move(task), std::move(done), {}});
+}
+
+size_t PoolExecutor::currentWorker() const {
+	return workerExecutor == this ? workerIndex : queues_.size();
+}
+
+bool PoolExecutor::reserve() {
+	size_t reserved = reserved_.load();
+	while (reserved < config_.queueCapacity) {
+		if (reserved_.compare_exchange_weak(reserved, reserved + 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void PoolExecutor::enqueue(Job job) {
+	size_t worker = currentWorker();
+	// Workers may still queue follow-up tasks while the executor drains
+	if (stopping_ && worker == queues_.size()) {
+		throw std::runtime_error("Executor is shutting down");
+	}
+
+	if (!reserve()) {
+		auto timeout = std::chrono::milliseconds(config_.submitTimeoutMs);
+		bool reserved = false;
+		if (timeout.count() > 0) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			blockedSubmitters_++;
+			reserved = notFull_.wait_for(lock, timeout, [this]() { return reserve(); });
+			blockedSubmitters_--;
+		}
+		if (!reserved) {
+			rejected_.fetch_add(1, std::memory_order_relaxed);
+			throw ExecutorQueueFullException();
+		}
+	}
+
+	size_t index = worker < queues_.size() ? worker : nextQueue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+	job.submitted = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+		queues_[index]->jobs.push_back(std::move(job));
+	}
+	submitted_.fetch_add(1, std::memory_order_relaxed);
+
+	// Pairs with the idleWorkers_ increment in workerLoop(): either the
+	// worker sees the task or we see the worker
+	pending_++;
+	if (idleWorkers_ > 0) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+		}
+		notEmpty_.notify_one();
+	}
+}
+
+bool PoolExecutor::takeJob(size_t index, Job& job) {
+	{
+		WorkerQueue& own = *queues_[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty()) {
+			job = std::move(own.jobs.front());
+			own.jobs.pop_front();
+			return true;
+		}
+	}
+
+	for (size_t offset = 1; offset < queues_.size(); offset++) {
+		WorkerQueue& victim = *queues_[(index + offset) % queues_.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty()) {
+			job = std::move(victim.jobs.back());
+			victim.jobs.pop_back();
+			steals_.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+void PoolExecutor::workerLoop(size_t index) {
+	workerExecutor = this;
+	workerIndex = index;
+	// Keeps the state of the last task of every color for the next one
+	StatePool::setThreadCacheFloor(1);
+
+	while (true) {
+		Job job;
+		if (takeJob(index, job)) {
+			pending_--;
+			running_++;
+			reserved_--;
+			if (blockedSubmitters_ > 0) {
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+				}
+				notFull_.notify_one();
+			}
+
+			runJob(job);
+			continue;
+		}
+
+		// An idle worker holds no states
+		StatePool::returnThreadCaches();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (stopping_ && pending_ == 0) {
+			break;
+		}
+		idleWorkers_++;
+		notEmpty_.wait(lock, [this]() { return stopping_ || pending_ > 0; });
+		idleWorkers_--;
+	}
+}
+
+void PoolExecutor::runJob(Job& job) {
+	auto start = std::chrono::steady_clock::now();
+	queueTime_.record(start - job.submitted);
+
+	StatePool& pool = *job.pool;
+	std::exception_ptr error;
+	std::unique_ptr<LuaState> state;
+	try {
+		// The task waits in line for a state rather than failing while
+		// all states of its pool are busy; the pool's own timeout is
+		// meant for callers that can not wait
+		while (!state) {
+			try {
+				state = pool.acquire(stateWaitSlice);
+			} catch (const PoolExhaustedException&) {
+				if (!pool.isThreadSafe()) {
+					throw;
+				}
+			}
+		}
+		lua_settop(*state, 0);
+		job.task(*state);
+	} catch (...) {
+		error = std::current_exception();
+	}
+
+	// Released through the pool, so its reset and recycle checks run; the
+	// state then waits in the worker's cache, where other threads can
+	// still take it when the pool runs dry
+	if (state) {
+		pool.release(std::move(state));
+	}
+
+	runTime_.record(std::chrono::steady_clock::now() - start);
+	if (error) {
+		failed_.fetch_add(1, std::memory_order_relaxed);
+	}
+	completed_.fetch_add(1, std::memory_order_relaxed);
+	running_--;
+
+	if (job.done) {
+		job.done(error);
+	}
+}
+
+const ExecutorConfig& PoolExecutor::getConfig() const {
+	return config_;
+}
+
+size_t PoolExecutor::getWorkerCount() const {
+	return workers_.size();
+}
+
+size_t PoolExecutor::queueDepth() {
+	return pending_.load();
+}
+
+ExecutorMetricsSnapshot PoolExecutor::getMetrics() {
+	ExecutorMetricsSnapshot snapshot;
+	snapshot.workers = workers_.size();
+	snapshot.queueCapacity = config_.queueCapacity;
+	snapshot.queueDepth = queueDepth();
+	snapshot.running = running_.load();
+	snapshot.submitted = submitted_.load(std::memory_order_relaxed);
+	snapshot.completed = completed_.load(std::memory_order_relaxed);
+	snapshot.failed = failed_.load(std::memory_order_relaxed);
+	snapshot.rejected = rejected_.load(std::memory_order_relaxed);
+	snapshot.steals = steals_.load(std::memory_order_relaxed);
+	snapshot.queueTime = queueTime_.snapshot();
+	snapshot.runTime = runTime_.snapshot();
+	return snapshot;
+}
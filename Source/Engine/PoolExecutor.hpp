@@ -0,0 +1,230 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_POOLEXECUTOR_HPP
+#define LUACPP_POOLEXECUTOR_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "LuaState.hpp"
+#include "PoolHandle.hpp"
+#include "PoolMetrics.hpp"
+
+namespace LuaCpp {
+	namespace Engine {
+
+		class ExecutorQueueFullException : public std::runtime_error {
+		public:
+			ExecutorQueueFullException()
+				: std::runtime_error("Executor queue full: the task was rejected") {}
+		};
+
+		struct ExecutorConfig final {
+			/**
+			 * @brief Number of worker threads, 0 for one per CPU
+			 */
+			size_t workers = 0;
+			size_t queueCapacity = 1024;
+			/**
+			 * @brief How long submit() waits for room in a full queue
+			 * (0: reject at once)
+			 */
+			size_t submitTimeoutMs = 0;
+
+			ExecutorConfig& SetWorkers(size_t count) {
+				workers = count;
+				return *this;
+			}
+
+			ExecutorConfig& SetQueueCapacity(size_t capacity) {
+				queueCapacity = capacity;
+				return *this;
+			}
+
+			ExecutorConfig& SetSubmitTimeoutMs(size_t timeoutMs) {
+				submitTimeoutMs = timeoutMs;
+				return *this;
+			}
+		};
+
+		struct ExecutorMetricsSnapshot final {
+			size_t workers = 0;
+			size_t queueCapacity = 0;
+			/** @brief Tasks waiting for a worker */
+			size_t queueDepth = 0;
+			/** @brief Tasks being run by a worker */
+			size_t running = 0;
+
+			uint64_t submitted = 0;
+			uint64_t completed = 0;
+			/** @brief Completed tasks that ended with an exception */
+			uint64_t failed = 0;
+			/** @brief Tasks rejected with ExecutorQueueFullException */
+			uint64_t rejected = 0;
+			/** @brief Tasks a worker took from another worker's queue */
+			uint64_t steals = 0;
+
+			/** @brief Time from submission until a worker picked the task up */
+			LatencyHistogramSnapshot queueTime;
+			/** @brief Time to acquire a state and run the task */
+			LatencyHistogramSnapshot runTime;
+		};
+
+		/**
+		 * @brief Work-stealing pool of worker threads running tasks on
+		 * pooled states
+		 *
+		 * @details
+		 * Every worker has its own task queue. Tasks submitted from
+		 * outside are spread over the queues round robin, tasks submitted
+		 * from a running task go to the queue of its worker. A worker
+		 * runs its own queue in FIFO order and, when that is empty,
+		 * steals the newest task from the back of another worker's
+		 * queue, so one executor serves all pool colors without idle
+		 * threads per color. `queueCapacity` bounds the tasks waiting in
+		 * all queues together.
+		 *
+		 * A worker acquires a state for every task and releases it as
+		 * soon as the task returns, so every task gets a state that went
+		 * through the reset and recycle checks of its pool. The released
+		 * state goes into the worker's own cache, which holds at most one
+		 * state per color (or the pool's `threadCacheSize`), so the next
+		 * task of that color gets it back without touching the shared
+		 * idle list. Other threads can take a cached state when the pool
+		 * runs dry, and the worker returns its cache to the pools when it
+		 * goes idle or stops.
+		 * When all states of the pool are busy the worker waits for one,
+		 * however short the pool's `exhaustionTimeoutMs` is, so a color
+		 * with fewer states than there are workers queues its tasks
+		 * instead of failing them.
+		 *
+		 * The pools are used from the worker threads and must be
+		 * thread-safe. Destroying the executor runs the tasks that are
+		 * still queued and joins the workers.
+		 */
+		class PoolExecutor {
+		private:
+			typedef std::function<void(LuaState&)> StateTask;
+			typedef std::function<void(std::exception_ptr)> Completion;
+
+			struct Job {
+				PoolHandle pool;
+				StateTask task;
+				Completion done;
+				std::chrono::steady_clock::time_point submitted;
+			};
+
+			struct alignas(64) WorkerQueue {
+				std::mutex mutex;
+				std::deque<Job> jobs;
+			};
+
+			ExecutorConfig config_;
+			std::vector<std::unique_ptr<WorkerQueue>> queues_;
+			std::vector<std::thread> workers_;
+
+			/** @brief Guards sleeping workers and blocked submitters */
+			std::mutex mutex_;
+			std::condition_variable notEmpty_;
+			std::condition_variable notFull_;
+			std::atomic<bool> stopping_{false};
+
+			/** @brief Slots taken from `queueCapacity` */
+			std::atomic<size_t> reserved_{0};
+			/** @brief Tasks sitting in one of the queues */
+			std::atomic<size_t> pending_{0};
+			std::atomic<size_t> idleWorkers_{0};
+			std::atomic<size_t> blockedSubmitters_{0};
+			std::atomic<size_t> nextQueue_{0};
+
+			std::atomic<size_t> running_{0};
+			std::atomic<uint64_t> submitted_{0};
+			std::atomic<uint64_t> completed_{0};
+			std::atomic<uint64_t> failed_{0};
+			std::atomic<uint64_t> rejected_{0};
+			std::atomic<uint64_t> steals_{0};
+			LatencyHistogram queueTime_;
+			LatencyHistogram runTime_;
+
+			void enqueue(Job job);
+			bool reserve();
+			bool takeJob(size_t index, Job& job);
+			void workerLoop(size_t index);
+			void runJob(Job& job);
+
+			/**
+			 * @brief Index of the calling thread if it is a worker of
+			 * this executor, otherwise the number of workers
+			 */
+			size_t currentWorker() const;
+
+		public:
+			explicit PoolExecutor(ExecutorConfig config = ExecutorConfig());
+			~PoolExecutor();
+
+			PoolExecutor(const PoolExecutor&) = delete;
+			PoolExecutor& operator=(const PoolExecutor&) = delete;
+			PoolExecutor(PoolExecutor&&) = delete;
+			PoolExecutor& operator=(PoolExecutor&&) = delete;
+
+			/**
+			 * @brief Queues a task to run on a state of the given pool
+			 *
+			 * @details
+			 * Throws ExecutorQueueFullException if the queues stay full
+			 * for longer than `submitTimeoutMs`.
+			 *
+			 * @return future completed with the task, or with the
+			 * exception it threw
+			 */
+			std::future<void> submit(const PoolHandle& pool, std::function<void(LuaState&)> task);
+
+			/**
+			 * @brief Queues a task and calls `done` from the worker
+			 * thread when it finished
+			 *
+			 * @param done Called with `nullptr` on success, or with the
+			 * exception thrown by the task; must not throw
+			 */
+			void submit(const PoolHandle& pool, std::function<void(LuaState&)> task, std::function<void(std::exception_ptr)> done);
+
+			const ExecutorConfig& getConfig() const;
+			size_t getWorkerCount() const;
+			size_t queueDepth();
+			ExecutorMetricsSnapshot getMetrics();
+		};
+	}
+}
+
+#endif // LUACPP_POOLEXECUTOR_HPP
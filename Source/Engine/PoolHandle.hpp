@@ -0,0 +1,108 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_POOLHANDLE_HPP
+#define LUACPP_POOLHANDLE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include "StatePool.hpp"
+
+namespace LuaCpp {
+	namespace Engine {
+
+		/**
+		 * @brief Resolved reference to a pool color
+		 *
+		 * @details
+		 * Looking a pool up by its color takes the manager lock and a
+		 * string compare per map node. A handle is resolved once (any
+		 * `StatePool&` converts to one) and then reaches the pool with
+		 * a single pointer dereference. The pool id identifies the pool
+		 * the handle was made for; ids are never reused, so a pool
+		 * created later under the same color gets a different one.
+		 *
+		 * A handle to a pool owned by a PoolManager keeps the pool alive
+		 * after destroyPool(), so a thread that still holds it can finish
+		 * its work. Pass handles by reference on hot paths: copying one
+		 * touches the shared reference count.
+		 */
+		class PoolHandle final {
+		private:
+			std::shared_ptr<StatePool> owner_;
+			StatePool* pool_ = nullptr;
+			uint64_t id_ = 0;
+
+		public:
+			PoolHandle() = default;
+
+			PoolHandle(StatePool& pool)
+				: owner_(pool.weak_from_this().lock())
+				, pool_(&pool)
+				, id_(pool.getId())
+			{}
+
+			explicit PoolHandle(std::shared_ptr<StatePool> pool)
+				: owner_(std::move(pool))
+				, pool_(owner_.get())
+				, id_(pool_ ? pool_->getId() : 0)
+			{}
+
+			StatePool& operator*() const {
+				if (!pool_) {
+					throw std::runtime_error("Empty pool handle");
+				}
+				return *pool_;
+			}
+
+			StatePool* operator->() const {
+				return &**this;
+			}
+
+			StatePool* get() const {
+				return pool_;
+			}
+
+			uint64_t getId() const {
+				return id_;
+			}
+
+			explicit operator bool() const {
+				return pool_ != nullptr;
+			}
+
+			bool operator==(const PoolHandle& other) const {
+				return id_ == other.id_;
+			}
+
+			bool operator!=(const PoolHandle& other) const {
+				return id_ != other.id_;
+			}
+		};
+	}
+}
+
+#endif // LUACPP_POOLHANDLE_HPP
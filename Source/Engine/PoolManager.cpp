@@ -33,111 +33,141 @@ PoolManager::PoolManager()
 	initializePredefinedPools();
 }
 
+PoolManager::~PoolManager() {
+	executor_.reset();
+	stopMaintenance();
+}
+
 void PoolManager::initializePredefinedPools() {
+	auto table = std::make_shared<PoolTable>();
+
 	PoolConfig defaultConfig;
 	defaultConfig.libraries = {};
 	defaultConfig.maxSize = 5;
-	pools_["default"] = std::make_unique<StatePool>("default", defaultConfig);
+	(*table)["default"] = makePool("default", defaultConfig);
 
 	PoolConfig sandboxedConfig;
 	sandboxedConfig.libraries = {"base", "math", "string", "table"};
 	sandboxedConfig.maxSize = 5;
-	pools_["sandboxed"] = std::make_unique<StatePool>("sandboxed", sandboxedConfig);
+	(*table)["sandboxed"] = makePool("sandboxed", sandboxedConfig);
 
 	PoolConfig minimalConfig;
 	minimalConfig.libraries = {"base"};
 	minimalConfig.maxSize = 5;
-	pools_["minimal"] = std::make_unique<StatePool>("minimal", minimalConfig);
+	(*table)["minimal"] = makePool("minimal", minimalConfig);
 
 	PoolConfig ioConfig;
 	ioConfig.libraries = {"base", "io", "os"};
 	ioConfig.maxSize = 5;
-	pools_["io"] = std::make_unique<StatePool>("io", ioConfig);
+	(*table)["io"] = makePool("io", ioConfig);
+
+	publish(std::move(table));
+}
+
+std::shared_ptr<const PoolTable> PoolManager::snapshot() const {
+	return std::atomic_load(&pools_);
+}
+
+void PoolManager::publish(std::shared_ptr<const PoolTable> table) {
+	std::atomic_store(&pools_, std::move(table));
+}
+
+std::shared_ptr<StatePool> PoolManager::makePool(const std::string& color, const PoolConfig& config) {
+	return std::shared_ptr<StatePool>(new StatePool(color, config), &StatePool::Dispose);
 }
 
-std::map<std::string, std::unique_ptr<StatePool>>::iterator PoolManager::findPoolOrThrow(const std::string& color) {
-	auto it = pools_.find(color);
-	if (it == pools_.end()) {
+const std::shared_ptr<StatePool>& PoolManager::findPoolOrThrow(const PoolTable& table, const std::string& color) {
+	auto it = table.find(color);
+	if (it == table.end()) {
 		throw std::runtime_error("Pool '" + color + "' not found");
 	}
-	return it;
+	return it->second;
 }
 
 StatePool& PoolManager::getPool(const std::string& color) {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
+	return *findPoolOrThrow(*snapshot(), color);
+}
 
-	return *(findPoolOrThrow(color)->second);
+PoolHandle PoolManager::getHandle(const std::string& color) const {
+	return PoolHandle(findPoolOrThrow(*snapshot(), color));
 }
 
 StatePool& PoolManager::createPool(const std::string& color, const PoolConfig& config) {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
+	return *createHandle(color, config);
+}
 
-	auto it = pools_.find(color);
-	if (it != pools_.end()) {
+PoolHandle PoolManager::createHandle(const std::string& color, const PoolConfig& config) {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	std::shared_ptr<const PoolTable> current = snapshot();
+	if (current->find(color) != current->end()) {
 		throw std::runtime_error("Pool '" + color + "' already exists");
 	}
 
-	auto pool = std::make_unique<StatePool>(color, config);
+	std::shared_ptr<StatePool> pool = makePool(color, config);
 	pool->setThreadSafe(threadSafe_);
-	
-	StatePool& ref = *pool;
-	pools_[color] = std::move(pool);
-	
-	return ref;
+	pool->setInheritedSetup(inherited_);
+
+	auto table = std::make_shared<PoolTable>(*current);
+	(*table)[color] = pool;
+	publish(std::move(table));
+
+	return PoolHandle(std::move(pool));
 }
 
 void PoolManager::destroyPool(const std::string& color) {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
+	std::lock_guard<std::mutex> lock(mutex_);
 
-	auto it = findPoolOrThrow(color);
+	std::shared_ptr<const PoolTable> current = snapshot();
+	findPoolOrThrow(*current, color);
 
 	if (color == "default" || color == "sandboxed" || color == "minimal" || color == "io") {
 		throw std::runtime_error("Cannot destroy predefined pool '" + color + "'");
 	}
 
-	pools_.erase(it);
+	// Readers of the old table, handles and checked-out states keep
+	// the pool alive; it is freed when the last of them lets go
+	auto table = std::make_shared<PoolTable>(*current);
+	table->erase(color);
+	publish(std::move(table));
 }
 
 bool PoolManager::hasPool(const std::string& color) const {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
-
-	return pools_.find(color) != pools_.end();
+	std::shared_ptr<const PoolTable> table = snapshot();
+	return table->find(color) != table->end();
 }
 
 std::vector<std::string> PoolManager::listPools() const {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
-
 	std::vector<std::string> result;
-	for (const auto& pair : pools_) {
+	for (const auto& pair : *snapshot()) {
 		result.push_back(pair.first);
 	}
 	return result;
 }
 
-void PoolManager::setThreadSafe(bool threadSafe) {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
+std::map<std::string, PoolMetricsSnapshot> PoolManager::snapshotMetrics() const {
+	std::map<std::string, PoolMetricsSnapshot> result;
+	for (const auto& pair : *snapshot()) {
+		result.emplace(pair.first, pair.second->getMetrics());
+	}
+	return result;
+}
+
+void PoolManager::setInheritedSetup(std::shared_ptr<const InheritedSetup> setup) {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	inherited_ = setup;
+	for (auto& pair : *snapshot()) {
+		pair.second->setInheritedSetup(setup);
 	}
+}
+
+void PoolManager::setThreadSafe(bool threadSafe) {
+	std::lock_guard<std::mutex> lock(mutex_);
 
 	threadSafe_ = threadSafe;
 	
-	for (auto& pair : pools_) {
+	for (auto& pair : *snapshot()) {
 		pair.second->setThreadSafe(threadSafe);
 	}
 }
@@ -145,3 +175,71 @@ void PoolManager::setThreadSafe(bool threadSafe) {
 bool PoolManager::isThreadSafe() const {
 	return threadSafe_;
 }
+
+size_t PoolManager::maintain() {
+	size_t evicted = 0;
+	for (auto& pair : *snapshot()) {
+		evicted += pair.second->maintain();
+	}
+	return evicted;
+}
+
+void PoolManager::startMaintenance(std::chrono::milliseconds interval) {
+	stopMaintenance();
+	setThreadSafe(true);
+
+	stopMaintenance_ = false;
+	maintenanceThread_ = std::thread([this, interval]() {
+		std::unique_lock<std::mutex> lock(maintenanceMutex_);
+		while (!maintenanceCv_.wait_for(lock, interval, [this]() { return stopMaintenance_; })) {
+			lock.unlock();
+			try {
+				maintain();
+			} catch (...) {
+				// A failed top-up is retried in the next round
+			}
+			lock.lock();
+		}
+	});
+}
+
+void PoolManager::stopMaintenance() {
+	if (!maintenanceThread_.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(maintenanceMutex_);
+		stopMaintenance_ = true;
+	}
+	maintenanceCv_.notify_all();
+	maintenanceThread_.join();
+}
+
+bool PoolManager::isMaintenanceRunning() const {
+	return maintenanceThread_.joinable();
+}
+
+PoolExecutor& PoolManager::getExecutor() {
+	std::lock_guard<std::mutex> lock(executorMutex_);
+	if (!executor_) {
+		setThreadSafe(true);
+		executor_ = std::make_unique<PoolExecutor>();
+	}
+	return *executor_;
+}
+
+void PoolManager::configureExecutor(const ExecutorConfig& config) {
+	std::lock_guard<std::mutex> lock(executorMutex_);
+	setThreadSafe(true);
+	executor_.reset();
+	executor_ = std::make_unique<PoolExecutor>(config);
+}
+
+std::future<void> PoolManager::submit(const std::string& color, std::function<void(LuaState&)> task) {
+	return getExecutor().submit(getHandle(color), std::move(task));
+}
+
+void PoolManager::submit(const std::string& color, std::function<void(LuaState&)> task, std::function<void(std::exception_ptr)> done) {
+	getExecutor().submit(getHandle(color), std::move(task), std::move(done));
+}
@@ -30,39 +30,153 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
 #include "StatePool.hpp"
 #include "PoolConfig.hpp"
+#include "PoolHandle.hpp"
+#include "PoolExecutor.hpp"
 
 namespace LuaCpp {
 	namespace Engine {
 
+		typedef std::map<std::string, std::shared_ptr<StatePool>> PoolTable;
+
 		class PoolManager {
 		private:
-			std::map<std::string, std::unique_ptr<StatePool>> pools_;
-			bool threadSafe_ = false;
+			/**
+			 * @brief Current pool table
+			 *
+			 * @details
+			 * Published as an immutable snapshot: readers load it with
+			 * `std::atomic_load` and never take `mutex_`, writers copy
+			 * it, change the copy and store it back under `mutex_`. A
+			 * pool removed from the table is freed when the last
+			 * snapshot, handle and checked-out state let go of it.
+			 */
+			std::shared_ptr<const PoolTable> pools_;
+			std::atomic<bool> threadSafe_{false};
 			mutable std::mutex mutex_;
+			std::shared_ptr<const InheritedSetup> inherited_;
+
+			std::thread maintenanceThread_;
+			std::mutex maintenanceMutex_;
+			std::condition_variable maintenanceCv_;
+			bool stopMaintenance_ = false;
+
+			/**
+			 * @brief Shared workers of submit(); declared last so that
+			 * they are stopped before anything else goes away
+			 */
+			std::unique_ptr<PoolExecutor> executor_;
+			std::mutex executorMutex_;
 
 			void initializePredefinedPools();
-			std::map<std::string, std::unique_ptr<StatePool>>::iterator findPoolOrThrow(const std::string& color);
+			std::shared_ptr<const PoolTable> snapshot() const;
+			void publish(std::shared_ptr<const PoolTable> table);
+			static std::shared_ptr<StatePool> makePool(const std::string& color, const PoolConfig& config);
+			static const std::shared_ptr<StatePool>& findPoolOrThrow(const PoolTable& table, const std::string& color);
 
 		public:
 			PoolManager();
-			~PoolManager() = default;
+			~PoolManager();
 
 			PoolManager(const PoolManager&) = delete;
 			PoolManager& operator=(const PoolManager&) = delete;
 			PoolManager(PoolManager&&) = delete;
 			PoolManager& operator=(PoolManager&&) = delete;
 
+			/**
+			 * @brief Returns the pool of a color
+			 *
+			 * @deprecated The reference is not kept alive by anything and
+			 * dangles once another thread destroys the pool; use
+			 * getHandle().
+			 */
 			StatePool& getPool(const std::string& color);
+			PoolHandle getHandle(const std::string& color) const;
+
+			/**
+			 * @brief Creates a pool and returns a reference to it
+			 *
+			 * @deprecated The reference dangles once another thread
+			 * destroys the pool; use createHandle().
+			 */
 			StatePool& createPool(const std::string& color, const PoolConfig& config);
+
+			/**
+			 * @brief Creates a pool and returns a handle sharing its ownership
+			 *
+			 * @details
+			 * Throws if a pool of the color already exists.
+			 */
+			PoolHandle createHandle(const std::string& color, const PoolConfig& config);
 			void destroyPool(const std::string& color);
 			bool hasPool(const std::string& color) const;
 			std::vector<std::string> listPools() const;
+			std::map<std::string, PoolMetricsSnapshot> snapshotMetrics() const;
+
+			/**
+			 * @brief Sets the setup inherited by all current and future pools
+			 *
+			 * @see StatePool::setInheritedSetup()
+			 */
+			void setInheritedSetup(std::shared_ptr<const InheritedSetup> setup);
 
 			void setThreadSafe(bool threadSafe);
 			bool isThreadSafe() const;
+
+			/**
+			 * @brief Runs StatePool::maintain() on every pool
+			 *
+			 * @return the number of evicted states
+			 */
+			size_t maintain();
+
+			/**
+			 * @brief Starts a background thread calling maintain()
+			 *
+			 * @details
+			 * The pools are used from the maintenance thread, so the
+			 * manager and all pools are switched to thread-safe mode.
+			 * The thread is stopped by stopMaintenance() or when the
+			 * manager is destroyed.
+			 *
+			 * @param interval Time between two maintenance rounds
+			 */
+			void startMaintenance(std::chrono::milliseconds interval);
+			void stopMaintenance();
+			bool isMaintenanceRunning() const;
+
+			/**
+			 * @brief Executor shared by all colors, created on first use
+			 *
+			 * @details
+			 * The pools are used from the worker threads, so the manager
+			 * and all pools are switched to thread-safe mode.
+			 */
+			PoolExecutor& getExecutor();
+
+			/**
+			 * @brief Replaces the executor with one built from `config`
+			 *
+			 * @details
+			 * The tasks queued on the previous executor are run before it
+			 * is stopped. Must not be called while tasks are submitted.
+			 */
+			void configureExecutor(const ExecutorConfig& config);
+
+			/**
+			 * @brief Runs a task on a state of the `color` pool from a
+			 * worker of the shared executor
+			 *
+			 * @see PoolExecutor::submit()
+			 */
+			std::future<void> submit(const std::string& color, std::function<void(LuaState&)> task);
+			void submit(const std::string& color, std::function<void(LuaState&)> task, std::function<void(std::exception_ptr)> done);
 		};
 	}
 }
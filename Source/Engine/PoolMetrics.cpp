@@ -0,0 +1,94 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include "PoolMetrics.hpp"
+
+using namespace LuaCpp::Engine;
+
+std::chrono::microseconds LatencyHistogramSnapshot::upperBound(size_t bucket) {
+	if (bucket + 1 >= BucketCount) {
+		return std::chrono::microseconds::max();
+	}
+	return std::chrono::microseconds(static_cast<int64_t>(1) << bucket);
+}
+
+std::chrono::microseconds LatencyHistogramSnapshot::mean() const {
+	if (count == 0) {
+		return std::chrono::microseconds(0);
+	}
+	return std::chrono::microseconds(total.count() / static_cast<int64_t>(count));
+}
+
+std::chrono::microseconds LatencyHistogramSnapshot::percentile(double p) const {
+	if (count == 0) {
+		return std::chrono::microseconds(0);
+	}
+
+	uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(count));
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BucketCount; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			// The open ended bucket is better described by the maximum
+			return i + 1 == BucketCount ? max : upperBound(i);
+		}
+	}
+	return max;
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+	int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	if (us < 0) {
+		us = 0;
+	}
+
+	size_t bucket = 0;
+	while (bucket + 1 < LatencyHistogramSnapshot::BucketCount && us >= (static_cast<int64_t>(1) << bucket)) {
+		bucket++;
+	}
+
+	buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	totalMicros_.fetch_add(static_cast<uint64_t>(us), std::memory_order_relaxed);
+
+	uint64_t max = maxMicros_.load(std::memory_order_relaxed);
+	while (static_cast<uint64_t>(us) > max
+		&& !maxMicros_.compare_exchange_weak(max, static_cast<uint64_t>(us), std::memory_order_relaxed)) {
+	}
+}
+
+LatencyHistogramSnapshot LatencyHistogram::snapshot() const {
+	LatencyHistogramSnapshot result;
+	for (size_t i = 0; i < LatencyHistogramSnapshot::BucketCount; i++) {
+		result.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+	}
+	result.count = count_.load(std::memory_order_relaxed);
+	result.total = std::chrono::microseconds(totalMicros_.load(std::memory_order_relaxed));
+	result.max = std::chrono::microseconds(maxMicros_.load(std::memory_order_relaxed));
+	return result;
+}
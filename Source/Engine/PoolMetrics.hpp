@@ -0,0 +1,176 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_POOLMETRICS_HPP
+#define LUACPP_POOLMETRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace LuaCpp {
+	namespace Engine {
+
+		/**
+		 * @brief Copy of a LatencyHistogram taken at one point in time
+		 *
+		 * @details
+		 * Bucket `0` counts samples below 1 microsecond, bucket `i`
+		 * counts samples in `[2^(i-1), 2^i)` microseconds and the last
+		 * bucket counts everything above the second to last bound.
+		 */
+		struct LatencyHistogramSnapshot final {
+			static constexpr size_t BucketCount = 24;
+
+			std::array<uint64_t, BucketCount> buckets{};
+			uint64_t count = 0;
+			std::chrono::microseconds total{0};
+			std::chrono::microseconds max{0};
+
+			/**
+			 * @brief Exclusive upper bound of a bucket, in microseconds
+			 *
+			 * @details
+			 * The last bucket is open ended and reports the largest
+			 * representable duration.
+			 */
+			static std::chrono::microseconds upperBound(size_t bucket);
+
+			std::chrono::microseconds mean() const;
+
+			/**
+			 * @brief Upper bound of the bucket containing the given
+			 * percentile (0 to 100) of the samples
+			 */
+			std::chrono::microseconds percentile(double p) const;
+		};
+
+		/**
+		 * @brief Fixed-bucket latency histogram
+		 *
+		 * @details
+		 * Recording is a handful of relaxed atomic increments, so the
+		 * histogram can stay enabled in production. Snapshots are not
+		 * atomic as a whole; counters recorded concurrently with a
+		 * snapshot may or may not be included.
+		 */
+		class LatencyHistogram {
+		private:
+			std::array<std::atomic<uint64_t>, LatencyHistogramSnapshot::BucketCount> buckets_{};
+			std::atomic<uint64_t> count_{0};
+			std::atomic<uint64_t> totalMicros_{0};
+			std::atomic<uint64_t> maxMicros_{0};
+
+		public:
+			LatencyHistogram() = default;
+
+			LatencyHistogram(const LatencyHistogram&) = delete;
+			LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+			void record(std::chrono::steady_clock::duration elapsed);
+			LatencyHistogramSnapshot snapshot() const;
+		};
+
+		/**
+		 * @brief Metrics of one pool color at one point in time
+		 */
+		struct PoolMetricsSnapshot final {
+			std::string color;
+
+			/** @brief Successful acquires */
+			uint64_t acquires = 0;
+			/** @brief Acquires served with a previously used state */
+			uint64_t hits = 0;
+			/** @brief States created, including warmup */
+			uint64_t creates = 0;
+			/** @brief Acquires that failed with PoolExhaustedException */
+			uint64_t exhaustions = 0;
+			uint64_t releases = 0;
+			/** @brief Idle states closed by maintain() */
+			uint64_t evictions = 0;
+			/** @brief States retired after `maxUsesPerState` uses */
+			uint64_t recycledByUses = 0;
+			/** @brief States retired above `maxHeapBytes` after a full GC */
+			uint64_t recycledByHeap = 0;
+			/** @brief States retired after `maxStateAgeMs` */
+			uint64_t recycledByAge = 0;
+			/** @brief Acquires served from the caller's own shard */
+			uint64_t shardHits = 0;
+			/** @brief Acquires served from another CPU's shard */
+			uint64_t shardSteals = 0;
+			/** @brief States updated to a new inherited setup */
+			uint64_t rebuilds = 0;
+
+			size_t currentSize = 0;
+			size_t available = 0;
+			size_t checkedOut = 0;
+			size_t waiting = 0;
+			/** @brief Retired states waiting to be closed */
+			size_t retired = 0;
+			/** @brief Lua heap of all states, 0 without `poolMemoryLimitBytes` */
+			size_t memoryInUse = 0;
+
+			LatencyHistogramSnapshot creationTime;
+			LatencyHistogramSnapshot waitTime;
+			LatencyHistogramSnapshot holdTime;
+			LatencyHistogramSnapshot resetTime;
+		};
+
+		/**
+		 * @brief Always-on counters of a StatePool
+		 *
+		 * @details
+		 * All counters are updated with relaxed atomics; they are meant
+		 * for monitoring, not for synchronization.
+		 */
+		struct PoolMetrics final {
+			std::atomic<uint64_t> acquires{0};
+			std::atomic<uint64_t> hits{0};
+			std::atomic<uint64_t> creates{0};
+			std::atomic<uint64_t> exhaustions{0};
+			std::atomic<uint64_t> releases{0};
+			std::atomic<uint64_t> waitTimeouts{0};
+			std::atomic<uint64_t> evictions{0};
+			std::atomic<uint64_t> recycledByUses{0};
+			std::atomic<uint64_t> recycledByHeap{0};
+			std::atomic<uint64_t> recycledByAge{0};
+			std::atomic<uint64_t> shardHits{0};
+			std::atomic<uint64_t> shardSteals{0};
+			std::atomic<uint64_t> rebuilds{0};
+
+			LatencyHistogram creationTime;
+			LatencyHistogram waitTime;
+			LatencyHistogram holdTime;
+			LatencyHistogram resetTime;
+
+			static void increment(std::atomic<uint64_t>& counter) {
+				counter.fetch_add(1, std::memory_order_relaxed);
+			}
+		};
+	}
+}
+
+#endif // LUACPP_POOLMETRICS_HPP
@@ -22,7 +22,17 @@
    SOFTWARE.
    */
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include "StatePool.hpp"
+#include "../LuaVersion.hpp"
 #include "LuaTNil.hpp"
 #include "LuaTString.hpp"
 #include "LuaTNumber.hpp"
@@ -30,26 +40,323 @@
 
 using namespace LuaCpp::Engine;
 
+namespace {
+	/**
+	 * @brief Registry key of the snapshot taken by ResetMode::Snapshot
+	 */
+	const char snapshotKey = 0;
+
+	/**
+	 * @brief Pushes a shallow copy of the table at `idx`
+	 */
+	void copyTable(lua_State* L, int idx) {
+		idx = lua_absindex(L, idx);
+		lua_newtable(L);
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		}
+	}
+
+	/**
+	 * @brief Makes the table at `live` a shallow copy of `snapshot` again
+	 */
+	void restoreTable(lua_State* L, int live, int snapshot) {
+		live = lua_absindex(L, live);
+		snapshot = lua_absindex(L, snapshot);
+
+		// Remove the keys added since the snapshot; clearing an
+		// existing field is allowed while traversing with lua_next
+		lua_pushnil(L);
+		while (lua_next(L, live) != 0) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, snapshot);
+			bool added = lua_isnil(L, -1);
+			lua_pop(L, 1);
+			if (added) {
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, live);
+			}
+		}
+
+		// Put back the removed and overwritten keys
+		lua_pushnil(L);
+		while (lua_next(L, snapshot) != 0) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, live);
+			bool same = lua_rawequal(L, -1, -2) != 0;
+			lua_pop(L, 1);
+			if (same) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, live);
+		}
+	}
+
+	struct ThreadCacheSlot {
+		uint64_t poolId;
+		std::shared_ptr<ThreadStateCache> cache;
+	};
+
+	/**
+	 * @brief The magazines of the current thread, one per pool it has
+	 * released into; flushed back to their pools when the thread exits
+	 */
+	struct ThreadCacheSet {
+		std::vector<ThreadCacheSlot> slots;
+
+		~ThreadCacheSet() {
+			for (auto& slot : slots) {
+				slot.cache->flush();
+			}
+		}
+	};
+
+	/**
+	 * @brief Installs hooks given as (type, count, function); like
+	 * lua_sethook() itself, the last one wins
+	 */
+	void setHooks(lua_State* L, const std::vector<std::tuple<std::string, int, lua_Hook>>& hooks) {
+		for (const auto& hook : hooks) {
+			int mask = 0;
+			const std::string& hookType = std::get<0>(hook);
+			int count = std::get<1>(hook);
+			lua_Hook hookFunc = std::get<2>(hook);
+
+			if (hookType == "call") {
+				mask = LUA_MASKCALL;
+			} else if (hookType == "return") {
+				mask = LUA_MASKRET;
+			} else if (hookType == "line") {
+				mask = LUA_MASKLINE;
+			} else if (hookType == "count") {
+				mask = LUA_MASKCOUNT;
+			}
+
+			lua_sethook(L, hookFunc, mask, count);
+		}
+	}
+
+	thread_local ThreadCacheSet threadCaches;
+	/** @brief Set by setThreadCacheFloor() */
+	thread_local size_t threadCacheFloor = 0;
+	std::atomic<uint64_t> nextPoolId{1};
+
+	/**
+	 * @brief The CPU the calling thread runs on, or a stable per-thread
+	 * value where the platform can not tell
+	 */
+	size_t currentCpu() {
+#ifdef __linux__
+		int cpu = sched_getcpu();
+		if (cpu >= 0) {
+			return (size_t) cpu;
+		}
+#endif
+		return std::hash<std::thread::id>()(std::this_thread::get_id());
+	}
+}
+
+void ThreadStateCache::flush() {
+	std::lock_guard<std::mutex> lock(mutex);
+	StatePool* owner = pool.exchange(nullptr);
+	if (owner) {
+		owner->returnCached(states);
+	}
+	states.clear();
+}
+
+void ThreadStateCache::returnStates() {
+	std::lock_guard<std::mutex> lock(mutex);
+	StatePool* owner = pool.load();
+	if (owner) {
+		owner->returnCached(states);
+	}
+}
+
 StatePool::StatePool(std::string color, PoolConfig config)
 	: color_(std::move(color))
 	, config_(std::move(config))
 	, available_()
+	, ring_()
 	, currentSize_(0)
 	, checkedOut_(0)
 	, threadSafe_(false)
+	, id_(nextPoolId.fetch_add(1))
+	, cacheCapacity_(std::min(config_.threadCacheSize, MaxThreadCacheSize))
+	, budget_(config_.poolMemoryLimitBytes > 0 ? std::make_shared<MemoryBudget>(config_.poolMemoryLimitBytes) : nullptr)
+	, shards_()
+	, cpuCount_(std::max<size_t>(std::thread::hardware_concurrency(), 1))
 {
+	// A single shard would only add a second lock in front of the pool
+	if (config_.shards > 1) {
+		for (size_t i = 0; i < config_.shards; i++) {
+			shards_.push_back(std::make_unique<StateShard>());
+		}
+	}
+}
+
+StatePool::~StatePool() {
+	dropCaches(true);
+	if (ring_) {
+		LuaState* raw = nullptr;
+		while (ring_->tryPop(raw)) {
+			delete raw;
+		}
+	}
 }
 
 std::unique_ptr<LuaState> StatePool::createState() {
-	auto state = std::make_unique<LuaState>();
-	
-	loadLibraries(*state);
-	loadGlobals(*state);
-	loadHooks(*state);
+	auto start = std::chrono::steady_clock::now();
+	std::unique_ptr<LuaState> state;
+	if (config_.allocatorFactory || config_.memoryLimitBytes > 0 || budget_) {
+		StateParams params = config_.allocatorFactory ? config_.allocatorFactory() : StateParams();
+		params.memoryLimitBytes = config_.memoryLimitBytes;
+		params.memoryBudget = budget_;
+		state = std::make_unique<LuaState>(std::move(params));
+	} else {
+		state = std::make_unique<LuaState>();
+	}
+	if (state->getState() == nullptr) {
+		throw std::runtime_error("Pool '" + color_ + "': failed to create a Lua state");
+	}
+
+	// A memory limit can make the setup itself fail
+	if (!runProtected(*state, &StatePool::initializeState)) {
+		std::string err = lua_isstring(*state, -1) ? lua_tostring(*state, -1) : "unknown error";
+		throw std::runtime_error("Pool '" + color_ + "': failed to initialize a Lua state: " + err);
+	}
+
+	state->getPoolUsage().created = start;
+	state->getPoolUsage().released = start;
+	PoolMetrics::increment(metrics_.creates);
+	metrics_.creationTime.record(std::chrono::steady_clock::now() - start);
 	
 	return std::move(state);
 }
 
+void StatePool::initializeState(LuaState& state, const InheritedSetup* setup) {
+	loadLibraries(state);
+	loadGlobals(state);
+	loadInherited(state, setup);
+	loadHooks(state, setup);
+
+	lua_pushstring(state, LuaCpp::Version);
+	lua_setglobal(state, "_luacppversion");
+
+	if (config_.resetMode == ResetMode::Snapshot) {
+		takeSnapshot(state);
+	}
+}
+
+namespace {
+	struct ProtectedStep {
+		StatePool* pool;
+		LuaState* state;
+		void (StatePool::*step)(LuaState&, const InheritedSetup*);
+		const InheritedSetup* setup;
+	};
+}
+
+int StatePool::protectedStep(lua_State* L) {
+	ProtectedStep* call = static_cast<ProtectedStep*>(lua_touserdata(L, 1));
+	lua_remove(L, 1);
+	(call->pool->*(call->step))(*call->state, call->setup);
+	return 0;
+}
+
+bool StatePool::runProtected(LuaState& state, SetupStep step) {
+	// A Lua error longjmps out of the step, so whatever needs a
+	// destructor (like the reference to the setup) stays in this frame
+	std::shared_ptr<const InheritedSetup> setup = std::atomic_load(&inherited_);
+	ProtectedStep call{this, &state, step, setup.get()};
+	lua_pushcfunction(state, &StatePool::protectedStep);
+	lua_pushlightuserdata(state, &call);
+	return lua_pcall(state, 1, 0, 0) == LUA_OK;
+}
+
+void StatePool::discardState(std::unique_ptr<LuaState> state) {
+	state.reset();
+	releaseSlot();
+}
+
+void StatePool::releaseSlot() {
+	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+	if (threadSafe_ || ring_) {
+		lock.lock();
+	}
+	currentSize_--;
+	serveWaiters();
+}
+
+bool StatePool::isTooOld(LuaState& state, std::chrono::steady_clock::time_point now) const {
+	return config_.maxStateAgeMs > 0
+		&& now - state.getPoolUsage().created >= std::chrono::milliseconds(config_.maxStateAgeMs);
+}
+
+bool StatePool::shouldRecycle(LuaState& state, std::chrono::steady_clock::time_point now) {
+	if (config_.maxUsesPerState > 0 && state.getPoolUsage().uses >= config_.maxUsesPerState) {
+		PoolMetrics::increment(metrics_.recycledByUses);
+		return true;
+	}
+
+	if (isTooOld(state, now)) {
+		PoolMetrics::increment(metrics_.recycledByAge);
+		return true;
+	}
+
+	// Only pay for a full collection when the heap looks too big
+	if (config_.maxHeapBytes > 0) {
+		size_t limitKb = config_.maxHeapBytes / 1024;
+		if ((size_t) lua_gc(state, LUA_GCCOUNT, 0) >= limitKb) {
+			lua_gc(state, LUA_GCCOLLECT, 0);
+			size_t heap = (size_t) lua_gc(state, LUA_GCCOUNT, 0) * 1024 + (size_t) lua_gc(state, LUA_GCCOUNTB, 0);
+			if (heap > config_.maxHeapBytes) {
+				PoolMetrics::increment(metrics_.recycledByHeap);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void StatePool::retireState(std::unique_ptr<LuaState> state) {
+	if (!config_.asyncRecycle) {
+		discardState(std::move(state));
+		return;
+	}
+
+	// Without a maintenance thread the releasing threads close the
+	// backlog themselves once it reaches maxSize states
+	std::vector<std::unique_ptr<LuaState>> backlog;
+	{
+		std::lock_guard<std::mutex> lock(retiredMutex_);
+		retired_.push_back(std::move(state));
+		if (retired_.size() >= std::max<size_t>(config_.maxSize, 1)) {
+			backlog.swap(retired_);
+		}
+	}
+	backlog.clear();
+
+	releaseSlot();
+}
+
+void StatePool::closeRetired() {
+	std::vector<std::unique_ptr<LuaState>> retired;
+	{
+		std::lock_guard<std::mutex> lock(retiredMutex_);
+		retired.swap(retired_);
+	}
+}
+
 void StatePool::loadLibraries(LuaState& state) {
 	if (config_.libraries.empty()) {
 		luaL_openlibs(state);
@@ -94,115 +401,853 @@ void StatePool::loadLibraries(LuaState& state) {
 }
 
 void StatePool::loadGlobals(LuaState& state) {
+	// PushGlobal() would copy the name into a temporary
 	for (const auto& var : config_.globalVariables) {
-		var.second->PushGlobal(state, var.first);
+		var.second->PushValue(state);
+		lua_setglobal(state, var.first.c_str());
 	}
 }
 
-void StatePool::loadHooks(LuaState& state) {
-	for (const auto& hook : config_.hooks) {
-		int mask = 0;
-		const std::string& hookType = std::get<0>(hook);
-		int count = std::get<1>(hook);
-		lua_Hook hookFunc = std::get<2>(hook);
+void StatePool::loadInherited(LuaState& state, const InheritedSetup* setup) {
+	if (!setup) {
+		state.getPoolUsage().setupGeneration = 0;
+		return;
+	}
 
-		if (hookType == "call") {
-			mask = LUA_MASKCALL;
-		} else if (hookType == "return") {
-			mask = LUA_MASKRET;
-		} else if (hookType == "line") {
-			mask = LUA_MASKLINE;
-		} else if (hookType == "count") {
-			mask = LUA_MASKCOUNT;
-		}
+	for (const auto& library : setup->customLibraries) {
+		library->RegisterFunctions(state);
+	}
+	for (const auto& function : setup->builtInFunctions) {
+		lua_pushcfunction(state, function.second);
+		lua_setglobal(state, function.first.c_str());
+	}
+	state.getPoolUsage().setupGeneration = setup->generation;
+}
 
-		lua_sethook(state, hookFunc, mask, count);
+void StatePool::refreshState(LuaState& state, const InheritedSetup* setup) {
+	loadInherited(state, setup);
+	loadHooks(state, setup);
+
+	// The snapshot would otherwise remove the new globals on reset
+	if (config_.resetMode == ResetMode::Snapshot) {
+		takeSnapshot(state);
 	}
 }
 
-void StatePool::resetState(LuaState& state) {
-	lua_settop(state, 0);
-	
+bool StatePool::isStale(LuaState& state) const {
+	return state.getPoolUsage().setupGeneration != setupGeneration_.load(std::memory_order_relaxed);
+}
+
+void StatePool::loadHooks(LuaState& state, const InheritedSetup* setup) {
+	setHooks(state, config_.hooks);
+
+	if (setup) {
+		setHooks(state, setup->hooks);
+	}
+}
+
+void StatePool::takeSnapshot(LuaState& state) {
+	lua_State* L = state;
+
+	lua_createtable(L, 0, 3);
+
+	lua_pushglobaltable(L);
+	copyTable(L, -1);
+	lua_setfield(L, -3, "globals");
+	if (lua_getmetatable(L, -1)) {
+		lua_setfield(L, -3, "meta");
+	}
+	lua_pop(L, 1);
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE) == LUA_TTABLE) {
+		copyTable(L, -1);
+		lua_setfield(L, -3, "loaded");
+	}
+	lua_pop(L, 1);
+
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &snapshotKey);
+}
+
+void StatePool::restoreSnapshot(LuaState& state) {
+	lua_State* L = state;
+
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &snapshotKey) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_pushglobaltable(L);
+	lua_getfield(L, -2, "globals");
+	restoreTable(L, -2, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, -2, "meta");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+
+	if (lua_getfield(L, -1, "loaded") == LUA_TTABLE) {
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+		restoreTable(L, -1, -2);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+void StatePool::resetState(LuaState& state, const InheritedSetup* setup) {
+	// Drop whatever hook the script installed and put back the configured ones
 	lua_sethook(state, nullptr, 0, 0);
-	
-	for (const auto& var : config_.globalVariables) {
-		var.second->PushGlobal(state, var.first);
+	if (!config_.hooks.empty() || setup) {
+		loadHooks(state, setup);
+	}
+
+	if (config_.resetMode == ResetMode::Snapshot) {
+		restoreSnapshot(state);
 	}
+
+	loadGlobals(state);
 }
 
 std::unique_ptr<LuaState> StatePool::acquire() {
+	return acquire(getExhaustionTimeout());
+}
+
+std::unique_ptr<LuaState> StatePool::acquire(std::chrono::milliseconds timeout) {
+	std::unique_ptr<LuaState> state;
+	try {
+		state = takeState(timeout);
+	} catch (const PoolExhaustedException&) {
+		PoolMetrics::increment(metrics_.exhaustions);
+		throw;
+	}
+
+	// Normally done by maintain(); a stale state must not be handed out
+	if (isStale(*state)) {
+		PoolMetrics::increment(metrics_.rebuilds);
+		if (!runProtected(*state, &StatePool::refreshState)) {
+			std::string err = lua_isstring(*state, -1) ? lua_tostring(*state, -1) : "unknown error";
+			checkedOut_--;
+			discardState(std::move(state));
+			throw std::runtime_error("Pool '" + color_ + "': failed to update a Lua state: " + err);
+		}
+	}
+
+	PoolUsage& usage = state->getPoolUsage();
+	if (usage.uses > 0) {
+		PoolMetrics::increment(metrics_.hits);
+	}
+	usage.uses++;
+	usage.acquired = std::chrono::steady_clock::now();
+	PoolMetrics::increment(metrics_.acquires);
+	pins_.fetch_add(1, std::memory_order_relaxed);
+	return state;
+}
+
+void StatePool::Dispose(StatePool* pool) {
+	pool->unpin();
+}
+
+void StatePool::unpin() {
+	if (pins_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
+
+std::unique_ptr<LuaState> StatePool::takeState(std::chrono::milliseconds timeout) {
+	if (cachedCount_.load() > 0) {
+		std::unique_ptr<LuaState> cached = takeCached();
+		if (cached) {
+			checkedOut_++;
+			return cached;
+		}
+	}
+
+	if (!shards_.empty()) {
+		std::unique_ptr<LuaState> sharded = takeSharded();
+		if (sharded) {
+			checkedOut_++;
+			return sharded;
+		}
+	}
+
+	// The lock-free idle list needs the pool mutex only to park waiters
 	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
+	if (threadSafe_ && !ring_) {
 		lock.lock();
 	}
 
-	if (!available_.empty()) {
-		std::unique_ptr<LuaState> state = std::move(available_.front());
-		available_.pop();
+	std::unique_ptr<LuaState> state = tryTakeIdle();
+	if (state) {
 		checkedOut_++;
-		return std::move(state);
+		return state;
 	}
 
-	if (currentSize_ < config_.maxSize) {
-		currentSize_++;
+	if (tryReserveSlot()) {
 		checkedOut_++;
-		if (threadSafe_) {
+		if (lock.owns_lock()) {
 			lock.unlock();
 		}
+		return createCheckedOutState();
+	}
+
+	state = stealCached();
+	if (state) {
+		checkedOut_++;
+		return state;
+	}
+
+	// Without thread safety nobody else can release a state while we wait
+	if (!threadSafe_ || timeout.count() <= 0) {
+		throw PoolExhaustedException(color_);
+	}
+
+	if (!lock.owns_lock()) {
+		lock.lock();
+	}
+	return waitForState(lock, timeout);
+}
+
+std::unique_ptr<LuaState> StatePool::waitForState(std::unique_lock<std::mutex>& lock, std::chrono::milliseconds timeout) {
+	Waiter waiter;
+	waiters_.push_back(&waiter);
+	waiting_.fetch_add(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	auto start = std::chrono::steady_clock::now();
+
+	// A lock-free or thread-cached release that did not yet see us may
+	// already have parked its state; it is either visible here or the
+	// releaser sees `waiting_` and serves us under the lock.
+	std::unique_ptr<LuaState> state = ring_ ? tryTakeIdle() : nullptr;
+	if (!state) {
+		state = stealCached();
+	}
+	if (!state && !shards_.empty()) {
+		state = takeSharded();
+	}
+	if (state) {
+		removeWaiter(&waiter);
+		checkedOut_++;
+		return state;
+	}
+
+	// In ring mode the first reservation ran without the lock, and a
+	// slot freed before we registered did not find us; releaseSlot()
+	// takes the lock, so any later one serves us instead
+	if (tryReserveSlot()) {
+		removeWaiter(&waiter);
+		checkedOut_++;
+		lock.unlock();
+		return createCheckedOutState();
+	}
+
+	bool served = waiter.cv.wait_until(lock, start + timeout, [&waiter]() {
+		return waiter.state != nullptr || waiter.mayCreate;
+	});
+
+	if (!served) {
+		removeWaiter(&waiter);
+		recordWait(std::chrono::steady_clock::now() - start, true);
+		throw PoolExhaustedException(color_);
+	}
+
+	recordWait(std::chrono::steady_clock::now() - start, false);
+
+	// The slot accounting was already done by the thread that served us
+	if (waiter.state) {
+		return std::move(waiter.state);
+	}
+
+	lock.unlock();
+	return createCheckedOutState();
+}
+
+void StatePool::removeWaiter(Waiter* waiter) {
+	auto it = std::find(waiters_.begin(), waiters_.end(), waiter);
+	if (it != waiters_.end()) {
+		waiters_.erase(it);
+		waiting_--;
+	}
+}
+
+std::unique_ptr<LuaState> StatePool::tryTakeIdle() {
+	if (ring_) {
+		LuaState* raw = nullptr;
+		if (!ring_->tryPop(raw)) {
+			return nullptr;
+		}
+		idleCount_--;
+		return std::unique_ptr<LuaState>(raw);
+	}
+
+	if (available_.empty()) {
+		return nullptr;
+	}
+	std::unique_ptr<LuaState> state = std::move(available_.front());
+	available_.pop_front();
+	idleCount_--;
+	return state;
+}
+
+void StatePool::pushIdle(std::unique_ptr<LuaState> state) {
+	if (ring_) {
+		// The ring holds at least maxSize entries, so it only fills up
+		// if states that never came from this pool are released into it
+		idleCount_++;
+		if (!ring_->tryPush(state.get())) {
+			idleCount_--;
+			currentSize_--;
+			return;
+		}
+		state.release();
+		return;
+	}
+
+	idleCount_++;
+	available_.push_back(std::move(state));
+}
+
+bool StatePool::tryReserveSlot() {
+	size_t size = currentSize_.load(std::memory_order_relaxed);
+	while (size < config_.maxSize) {
+		if (currentSize_.compare_exchange_weak(size, size + 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::unique_ptr<LuaState> StatePool::createCheckedOutState() {
+	try {
 		return createState();
+	} catch (...) {
+		std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+		if (threadSafe_) {
+			lock.lock();
+		}
+
+		checkedOut_--;
+		currentSize_--;
+		serveWaiters();
+		throw;
 	}
+}
 
-	throw PoolExhaustedException(color_);
+void StatePool::handOff(std::unique_ptr<LuaState> state) {
+	Waiter* next = waiters_.front();
+	waiters_.pop_front();
+	waiting_--;
+	next->state = std::move(state);
+	checkedOut_++;
+	next->cv.notify_one();
+}
+
+void StatePool::serveWaiters() {
+	while (!waiters_.empty()) {
+		std::unique_ptr<LuaState> state = tryTakeIdle();
+		if (state) {
+			handOff(std::move(state));
+			continue;
+		}
+		if (!tryReserveSlot()) {
+			return;
+		}
+		// Grant the freed slot to the oldest waiter
+		Waiter* next = waiters_.front();
+		waiters_.pop_front();
+		waiting_--;
+		next->mayCreate = true;
+		checkedOut_++;
+		next->cv.notify_one();
+	}
+}
+
+void StatePool::pushAvailable(std::unique_ptr<LuaState> state) {
+	if (!waiters_.empty()) {
+		handOff(std::move(state));
+		return;
+	}
+	pushIdle(std::move(state));
+}
+
+void StatePool::recordWait(std::chrono::steady_clock::duration waited, bool timedOut) {
+	metrics_.waitTime.record(waited);
+	if (timedOut) {
+		PoolMetrics::increment(metrics_.waitTimeouts);
+	}
+}
+
+ThreadStateCache* StatePool::localCache(bool create) {
+	auto& slots = threadCaches.slots;
+	for (auto& slot : slots) {
+		if (slot.poolId == id_) {
+			return slot.cache.get();
+		}
+	}
+
+	if (!create) {
+		return nullptr;
+	}
+
+	// Forget the magazines of pools that no longer exist
+	slots.erase(std::remove_if(slots.begin(), slots.end(), [](const ThreadCacheSlot& slot) {
+		return slot.cache->pool.load() == nullptr;
+	}), slots.end());
+
+	auto cache = std::make_shared<ThreadStateCache>();
+	cache->pool = this;
+	{
+		std::lock_guard<std::mutex> lock(cachesMutex_);
+		caches_.push_back(cache);
+	}
+	slots.push_back(ThreadCacheSlot{id_, cache});
+	return cache.get();
+}
+
+std::unique_ptr<LuaState> StatePool::takeCached() {
+	ThreadStateCache* cache = localCache(false);
+	if (!cache) {
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(cache->mutex);
+	if (cache->states.empty()) {
+		return nullptr;
+	}
+	std::unique_ptr<LuaState> state = std::move(cache->states.back());
+	cache->states.pop_back();
+	cachedCount_--;
+	return state;
+}
+
+std::unique_ptr<LuaState> StatePool::stealCached() {
+	if (cachedCount_.load() == 0) {
+		return nullptr;
+	}
+
+	// Only try_lock here: the caller may hold the pool mutex, which a
+	// thread flushing its magazine takes while holding the magazine's
+	std::lock_guard<std::mutex> lock(cachesMutex_);
+	for (auto& cache : caches_) {
+		std::unique_lock<std::mutex> cacheLock(cache->mutex, std::try_to_lock);
+		if (!cacheLock.owns_lock() || cache->states.empty()) {
+			continue;
+		}
+		std::unique_ptr<LuaState> state = std::move(cache->states.back());
+		cache->states.pop_back();
+		cachedCount_--;
+		return state;
+	}
+	return nullptr;
+}
+
+bool StatePool::cacheState(std::unique_ptr<LuaState>& state) {
+	// Waiting threads are served through the shared pool
+	size_t capacity = localCacheCapacity();
+	if (capacity == 0 || waiting_.load() != 0) {
+		return false;
+	}
+
+	ThreadStateCache* cache = localCache(true);
+	{
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		if (cache->states.size() >= capacity) {
+			return false;
+		}
+		cachedCount_++;
+		cache->states.push_back(std::move(state));
+	}
+
+	// Pairs with the fence in waitForState(): if a waiter registered
+	// before it could steal our state, hand the state over ourselves
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiting_.load() != 0) {
+		std::unique_ptr<LuaState> parked = takeCached();
+		if (parked) {
+			returnIdle(std::move(parked));
+		}
+	}
+	return true;
+}
+
+size_t StatePool::localCacheCapacity() const {
+	return std::max(cacheCapacity_, threadCacheFloor);
+}
+
+void StatePool::setThreadCacheFloor(size_t size) {
+	threadCacheFloor = std::min(size, MaxThreadCacheSize);
+}
+
+void StatePool::returnThreadCaches() {
+	for (auto& slot : threadCaches.slots) {
+		slot.cache->returnStates();
+	}
+}
+
+void StatePool::returnCached(std::vector<std::unique_ptr<LuaState>>& states) {
+	for (auto& state : states) {
+		cachedCount_--;
+		returnIdle(std::move(state));
+	}
+	states.clear();
+}
+
+void StatePool::dropCaches(bool detach) {
+	std::vector<std::shared_ptr<ThreadStateCache>> caches;
+	{
+		std::lock_guard<std::mutex> lock(cachesMutex_);
+		caches = caches_;
+	}
+
+	for (auto& cache : caches) {
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		size_t n = cache->states.size();
+		cache->states.clear();
+		cachedCount_ -= n;
+		currentSize_ -= n;
+		if (detach) {
+			cache->pool = nullptr;
+		}
+	}
+
+	// Magazines of exited threads are already detached
+	std::lock_guard<std::mutex> lock(cachesMutex_);
+	caches_.erase(std::remove_if(caches_.begin(), caches_.end(), [](const std::shared_ptr<ThreadStateCache>& cache) {
+		return cache->pool.load() == nullptr;
+	}), caches_.end());
+}
+
+size_t StatePool::localShard() const {
+	// Consecutive CPUs share a shard, so with one shard per NUMA node
+	// the CPUs of a node usually map to the same one
+	size_t cpu = currentCpu();
+	if (cpu < cpuCount_) {
+		return cpu * shards_.size() / cpuCount_;
+	}
+	return cpu % shards_.size();
+}
+
+std::unique_ptr<LuaState> StatePool::popShard(StateShard& shard) {
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.states.empty()) {
+		return nullptr;
+	}
+	std::unique_ptr<LuaState> state = std::move(shard.states.back());
+	shard.states.pop_back();
+	shardedCount_--;
+	return state;
+}
+
+std::unique_ptr<LuaState> StatePool::takeSharded() {
+	if (shardedCount_.load() == 0) {
+		return nullptr;
+	}
+
+	// Prefer the state last released on this CPU, then steal from the
+	// neighbouring shards
+	size_t home = localShard();
+	for (size_t i = 0; i < shards_.size(); i++) {
+		std::unique_ptr<LuaState> state = popShard(*shards_[(home + i) % shards_.size()]);
+		if (state) {
+			PoolMetrics::increment(i == 0 ? metrics_.shardHits : metrics_.shardSteals);
+			return state;
+		}
+	}
+	return nullptr;
+}
+
+bool StatePool::shardState(std::unique_ptr<LuaState>& state) {
+	// Waiting threads are served through the shared pool
+	if (shards_.empty() || waiting_.load() != 0) {
+		return false;
+	}
+
+	StateShard& shard = *shards_[localShard()];
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shardedCount_++;
+		shard.states.push_back(std::move(state));
+	}
+
+	// Same handshake with waitForState() as in cacheState()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiting_.load() != 0) {
+		std::unique_ptr<LuaState> parked = popShard(shard);
+		if (parked) {
+			returnIdle(std::move(parked));
+		}
+	}
+	return true;
+}
+
+void StatePool::takeAllSharded(std::vector<std::unique_ptr<LuaState>>& states) {
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		for (auto& state : shard->states) {
+			states.push_back(std::move(state));
+		}
+		shardedCount_ -= shard->states.size();
+		shard->states.clear();
+	}
 }
 
 void StatePool::release(std::unique_ptr<LuaState> state) {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
+	releaseState(std::move(state));
+	// May free a pool that was already destroyed; nothing may follow
+	unpin();
+}
+
+void StatePool::releaseState(std::unique_ptr<LuaState> state) {
+	auto start = std::chrono::steady_clock::now();
+	PoolUsage& usage = state->getPoolUsage();
+	if (usage.uses > 0) {
+		metrics_.holdTime.record(start - usage.acquired);
 	}
+	usage.released = start;
 
+	lua_settop(*state, 0);
+	bool reset = runProtected(*state, &StatePool::resetState);
+	lua_settop(*state, 0);
+	metrics_.resetTime.record(std::chrono::steady_clock::now() - start);
+	PoolMetrics::increment(metrics_.releases);
 	checkedOut_--;
 
-	resetState(*state);
-	available_.push(std::move(state));
+	// A state that can not be reset (e.g. at its memory limit) is closed
+	if (!reset) {
+		discardState(std::move(state));
+		return;
+	}
+
+	if (shouldRecycle(*state, start)) {
+		retireState(std::move(state));
+		return;
+	}
+
+	if (cacheState(state) || shardState(state)) {
+		return;
+	}
+	returnIdle(std::move(state));
+}
+
+void StatePool::returnIdle(std::unique_ptr<LuaState> state) {
+	if (ring_) {
+		if (waiting_.load() == 0) {
+			pushIdle(std::move(state));
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiting_.load() == 0) {
+				return;
+			}
+		}
+
+		// Somebody is (or just started) waiting: serve them under the lock
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (state) {
+			pushAvailable(std::move(state));
+		}
+		serveWaiters();
+		return;
+	}
 
+	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
 	if (threadSafe_) {
-		cv_.notify_one();
+		lock.lock();
 	}
+
+	pushAvailable(std::move(state));
+}
+
+bool StatePool::reset(LuaState& state) {
+	auto start = std::chrono::steady_clock::now();
+	int top = lua_gettop(state);
+	bool reset = runProtected(state, &StatePool::resetState);
+	lua_settop(state, top);
+	metrics_.resetTime.record(std::chrono::steady_clock::now() - start);
+	return reset;
 }
 
 void StatePool::warmup(size_t n) {
-	size_t toCreate = std::min(n, config_.maxSize - currentSize_);
-	
-	for (size_t i = 0; i < toCreate; i++) {
-		auto state = createState();
-		
+	for (size_t i = 0; i < n; i++) {
+		if (!tryReserveSlot()) {
+			break;
+		}
+
+		std::unique_ptr<LuaState> state;
+		try {
+			state = createState();
+		} catch (...) {
+			currentSize_--;
+			throw;
+		}
+
 		std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
 		if (threadSafe_) {
 			lock.lock();
 		}
-		
-		currentSize_++;
-		available_.push(std::move(state));
+		pushAvailable(std::move(state));
 	}
 }
 
 void StatePool::drain() {
+	dropCaches(false);
+	closeRetired();
+
 	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
 	if (threadSafe_) {
 		lock.lock();
 	}
 
-	while (!available_.empty()) {
-		available_.pop();
+	std::vector<std::unique_ptr<LuaState>> sharded;
+	takeAllSharded(sharded);
+	currentSize_ -= sharded.size();
+	sharded.clear();
+
+	while (std::unique_ptr<LuaState> state = tryTakeIdle()) {
 		currentSize_--;
 	}
+	serveWaiters();
+}
+
+void StatePool::sweepIdle(const std::function<bool(LuaState&)>& take, std::vector<std::unique_ptr<LuaState>>& taken) {
+	if (ring_) {
+		// The ring can not be walked: rotate it, holding one state at a time
+		size_t n = idleCount_.load();
+		for (size_t i = 0; i < n; i++) {
+			std::unique_ptr<LuaState> state = tryTakeIdle();
+			if (!state) {
+				break;
+			}
+			if (take(*state)) {
+				taken.push_back(std::move(state));
+			} else {
+				returnIdle(std::move(state));
+			}
+		}
+	} else {
+		std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+		if (threadSafe_) {
+			lock.lock();
+		}
+		for (auto it = available_.begin(); it != available_.end(); ) {
+			if (take(**it)) {
+				taken.push_back(std::move(*it));
+				it = available_.erase(it);
+				idleCount_--;
+			} else {
+				++it;
+			}
+		}
+	}
+
+	for (auto& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		for (auto it = shard->states.begin(); it != shard->states.end(); ) {
+			if (take(**it)) {
+				taken.push_back(std::move(*it));
+				it = shard->states.erase(it);
+				shardedCount_--;
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+size_t StatePool::maintain() {
+	closeRetired();
+
+	struct Candidate {
+		LuaState* state;
+		bool aged;
+		bool expired;
+		int heapKb;
+	};
+
+	// Look at the idle states without taking them out of the pool
+	auto now = std::chrono::steady_clock::now();
+	auto idleTimeout = std::chrono::milliseconds(config_.idleTimeoutMs);
+	std::vector<Candidate> idle;
+	std::vector<std::unique_ptr<LuaState>> none;
+	sweepIdle([&](LuaState& state) {
+		Candidate candidate{&state, isTooOld(state, now), false, lua_gc(state, LUA_GCCOUNT, 0)};
+		candidate.expired = candidate.aged || (config_.idleTimeoutMs > 0
+			&& now - state.getPoolUsage().released >= idleTimeout);
+		idle.push_back(candidate);
+		return false;
+	}, none);
+
+	size_t aged = 0;
+	size_t expired = 0;
+	for (auto& candidate : idle) {
+		if (candidate.aged) {
+			aged++;
+		}
+		if (candidate.expired) {
+			expired++;
+		}
+	}
+
+	size_t surplus = config_.maxIdle > 0 && idle.size() > config_.maxIdle ? idle.size() - config_.maxIdle : 0;
+	size_t evictable = idle.size() > config_.minIdle ? idle.size() - config_.minIdle : 0;
+	// States past their maximum age are replaced even below minIdle
+	size_t evict = std::max(std::min(std::max(expired, surplus), evictable), aged);
+
+	// Aged and expired states go first, then the ones holding the most memory
+	std::stable_sort(idle.begin(), idle.end(), [](const Candidate& a, const Candidate& b) {
+		if (a.aged != b.aged) {
+			return a.aged;
+		}
+		if (a.expired != b.expired) {
+			return a.expired;
+		}
+		return a.heapKb > b.heapKb;
+	});
+	std::map<LuaState*, bool> evicted;
+	for (size_t i = 0; i < evict; i++) {
+		evicted[idle[i].state] = idle[i].aged;
+	}
+
+	// Take out only the states to close and the ones to bring up to date
+	// with the inherited setup, so that acquire() does not have to. A
+	// state acquired since it was inspected is simply not found.
+	std::vector<std::unique_ptr<LuaState>> taken;
+	sweepIdle([this, &evicted](LuaState& state) {
+		return evicted.count(&state) > 0 || isStale(state);
+	}, taken);
+
+	size_t closed = 0;
+	for (auto& state : taken) {
+		auto it = evicted.find(state.get());
+		if (it != evicted.end()) {
+			PoolMetrics::increment(it->second ? metrics_.recycledByAge : metrics_.evictions);
+			discardState(std::move(state));
+			closed++;
+			continue;
+		}
+
+		bool refreshed = runProtected(*state, &StatePool::refreshState);
+		lua_settop(*state, 0);
+		PoolMetrics::increment(metrics_.rebuilds);
+		if (refreshed) {
+			returnIdle(std::move(state));
+		} else {
+			discardState(std::move(state));
+		}
+	}
+
+	size_t available = availableCount();
+	if (available < config_.minIdle) {
+		warmup(config_.minIdle - available);
+	}
+
+	return closed;
 }
 
 const std::string& StatePool::getColor() const {
 	return color_;
 }
 
+uint64_t StatePool::getId() const {
+	return id_;
+}
+
 const PoolConfig& StatePool::getConfig() const {
 	return config_;
 }
@@ -212,33 +1257,120 @@ size_t StatePool::getMaxSize() const {
 }
 
 size_t StatePool::getCurrentSize() const {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
-	return currentSize_;
+	return currentSize_.load();
 }
 
 size_t StatePool::availableCount() const {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
-	return available_.size();
+	return idleCount_.load() + cachedCount_.load() + shardedCount_.load();
 }
 
 size_t StatePool::checkedOutCount() const {
-	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-	if (threadSafe_) {
-		lock.lock();
-	}
-	return checkedOut_;
+	return checkedOut_.load();
+}
+
+size_t StatePool::threadCachedCount() const {
+	return cachedCount_.load();
+}
+
+void StatePool::setInheritedSetup(std::shared_ptr<const InheritedSetup> setup) {
+	uint64_t generation = setup ? setup->generation : 0;
+	std::atomic_store(&inherited_, std::move(setup));
+	setupGeneration_.store(generation);
+}
+
+std::shared_ptr<const InheritedSetup> StatePool::getInheritedSetup() const {
+	return std::atomic_load(&inherited_);
+}
+
+size_t StatePool::getShardCount() const {
+	return shards_.size();
+}
+
+size_t StatePool::shardedCount() const {
+	return shardedCount_.load();
+}
+
+size_t StatePool::retiredCount() const {
+	std::lock_guard<std::mutex> lock(retiredMutex_);
+	return retired_.size();
 }
 
 void StatePool::setThreadSafe(bool threadSafe) {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	threadSafe_ = threadSafe;
+
+	bool lockFree = threadSafe && config_.lockFreeQueue;
+	if (lockFree && !ring_) {
+		ring_ = std::make_unique<MPMCQueue<LuaState*>>(std::max<size_t>(config_.maxSize, 1));
+		while (!available_.empty()) {
+			ring_->tryPush(available_.front().release());
+			available_.pop_front();
+		}
+	} else if (!lockFree && ring_) {
+		LuaState* raw = nullptr;
+		while (ring_->tryPop(raw)) {
+			available_.push_back(std::unique_ptr<LuaState>(raw));
+		}
+		ring_.reset();
+	}
+}
+
+size_t StatePool::waiterCount() const {
+	return waiting_.load();
+}
+
+WaitStatistics StatePool::getWaitStatistics() const {
+	LatencyHistogramSnapshot waits = metrics_.waitTime.snapshot();
+
+	WaitStatistics stats;
+	stats.waits = waits.count;
+	stats.timeouts = metrics_.waitTimeouts.load(std::memory_order_relaxed);
+	stats.totalWaitTime = waits.total;
+	stats.maxWaitTime = waits.max;
+	return stats;
+}
+
+PoolMetricsSnapshot StatePool::getMetrics() const {
+	PoolMetricsSnapshot snapshot;
+	snapshot.color = color_;
+	snapshot.acquires = metrics_.acquires.load(std::memory_order_relaxed);
+	snapshot.hits = metrics_.hits.load(std::memory_order_relaxed);
+	snapshot.creates = metrics_.creates.load(std::memory_order_relaxed);
+	snapshot.exhaustions = metrics_.exhaustions.load(std::memory_order_relaxed);
+	snapshot.releases = metrics_.releases.load(std::memory_order_relaxed);
+	snapshot.evictions = metrics_.evictions.load(std::memory_order_relaxed);
+	snapshot.recycledByUses = metrics_.recycledByUses.load(std::memory_order_relaxed);
+	snapshot.recycledByHeap = metrics_.recycledByHeap.load(std::memory_order_relaxed);
+	snapshot.recycledByAge = metrics_.recycledByAge.load(std::memory_order_relaxed);
+	snapshot.shardHits = metrics_.shardHits.load(std::memory_order_relaxed);
+	snapshot.shardSteals = metrics_.shardSteals.load(std::memory_order_relaxed);
+	snapshot.rebuilds = metrics_.rebuilds.load(std::memory_order_relaxed);
+	snapshot.currentSize = getCurrentSize();
+	snapshot.available = availableCount();
+	snapshot.checkedOut = checkedOutCount();
+	snapshot.waiting = waiterCount();
+	snapshot.retired = retiredCount();
+	snapshot.memoryInUse = budget_ ? budget_->used() : 0;
+	snapshot.creationTime = metrics_.creationTime.snapshot();
+	snapshot.waitTime = metrics_.waitTime.snapshot();
+	snapshot.holdTime = metrics_.holdTime.snapshot();
+	snapshot.resetTime = metrics_.resetTime.snapshot();
+	return snapshot;
+}
+
+std::chrono::milliseconds StatePool::getExhaustionTimeout() const {
+	return std::chrono::milliseconds(config_.exhaustionTimeoutMs);
+}
+
+std::shared_ptr<MemoryBudget> StatePool::getMemoryBudget() const {
+	return budget_;
 }
 
 bool StatePool::isThreadSafe() const {
 	return threadSafe_;
 }
+
+bool StatePool::isLockFree() const {
+	return ring_ != nullptr;
+}
@@ -26,16 +26,23 @@
 #define LUACPP_STATEPOOL_HPP
 
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <chrono>
+#include <atomic>
+#include <cstdint>
 #include <stdexcept>
 
 #include "../Lua.hpp"
 #include "LuaState.hpp"
 #include "PoolConfig.hpp"
+#include "MPMCQueue.hpp"
+#include "PoolMetrics.hpp"
+#include "LuaAllocator.hpp"
 
 namespace LuaCpp {
 	namespace Engine {
@@ -46,26 +53,221 @@ namespace LuaCpp {
 				: std::runtime_error("Pool '" + color + "' exhausted: no available states and maximum size reached") {}
 		};
 
-		class StatePool {
+		struct WaitStatistics final {
+			size_t waits = 0;
+			size_t timeouts = 0;
+			std::chrono::microseconds totalWaitTime{0};
+			std::chrono::microseconds maxWaitTime{0};
+		};
+
+		class StatePool;
+
+		/**
+		 * @brief Per-thread magazine of idle states for one pool
+		 *
+		 * @details
+		 * Each thread that releases into a pool with `threadCacheSize`
+		 * set gets its own magazine. The owning thread is the only one
+		 * that adds states to it; other threads may only take states
+		 * out (when the pool is exhausted, on drain() or when the pool
+		 * is destroyed). The magazine is flushed back to the pool when
+		 * the thread exits.
+		 */
+		struct ThreadStateCache {
+			std::mutex mutex;
+			std::atomic<StatePool*> pool{nullptr};
+			std::vector<std::unique_ptr<LuaState>> states;
+
+			void flush();
+
+			/**
+			 * @brief Returns the states to the pool without detaching
+			 * the magazine from it
+			 */
+			void returnStates();
+		};
+
+		/**
+		 * @brief Idle states released on one group of CPUs
+		 *
+		 * @details
+		 * Aligned to a cache line so that the shards of neighbouring
+		 * CPUs do not share one.
+		 */
+		struct alignas(64) StateShard {
+			std::mutex mutex;
+			std::vector<std::unique_ptr<LuaState>> states;
+		};
+
+		class StatePool : public std::enable_shared_from_this<StatePool> {
 		private:
+			friend struct ThreadStateCache;
+
+			/**
+			 * @brief A thread blocked in acquire() waiting for a state
+			 *
+			 * @details
+			 * Waiters are served strictly in arrival order. A released
+			 * state is handed directly to the oldest waiter, and a freed
+			 * slot is granted to it as permission to create a new state,
+			 * so a late caller can never overtake a thread that is
+			 * already waiting.
+			 */
+			struct Waiter {
+				std::condition_variable cv;
+				std::unique_ptr<LuaState> state;
+				bool mayCreate = false;
+			};
+
 			std::string color_;
 			PoolConfig config_;
-			std::queue<std::unique_ptr<LuaState>> available_;
-			size_t currentSize_ = 0;
-			size_t checkedOut_ = 0;
-			bool threadSafe_ = false;
+			std::deque<std::unique_ptr<LuaState>> available_;
+			/**
+			 * @brief Lock-free idle list, used instead of `available_`
+			 * when the pool is thread-safe and `lockFreeQueue` is set
+			 */
+			std::unique_ptr<MPMCQueue<LuaState*>> ring_;
+			std::deque<Waiter*> waiters_;
+			std::atomic<size_t> currentSize_{0};
+			std::atomic<size_t> checkedOut_{0};
+			std::atomic<size_t> idleCount_{0};
+			std::atomic<size_t> waiting_{0};
+			std::atomic<bool> threadSafe_{false};
+			PoolMetrics metrics_;
 			mutable std::mutex mutex_;
-			std::condition_variable cv_;
 
+			/**
+			 * @brief Identity used to find this pool's magazine in the
+			 * calling thread; unlike the address it is never reused
+			 */
+			uint64_t id_;
+			size_t cacheCapacity_;
+			std::atomic<size_t> cachedCount_{0};
+			std::vector<std::shared_ptr<ThreadStateCache>> caches_;
+			std::mutex cachesMutex_;
+
+			/**
+			 * @brief Memory shared by all states, set when
+			 * `poolMemoryLimitBytes` is configured
+			 */
+			std::shared_ptr<MemoryBudget> budget_;
+
+			/**
+			 * @brief Per-CPU idle lists in front of the shared one,
+			 * set when `shards` is configured
+			 */
+			std::vector<std::unique_ptr<StateShard>> shards_;
+			std::atomic<size_t> shardedCount_{0};
+			size_t cpuCount_;
+
+			/**
+			 * @brief Recycled states waiting to be closed by maintain()
+			 * when `asyncRecycle` is set
+			 */
+			std::vector<std::unique_ptr<LuaState>> retired_;
+			mutable std::mutex retiredMutex_;
+
+			/**
+			 * @brief One pin per checked-out state plus one for the
+			 * owner; whoever drops the last pin frees a shared pool
+			 */
+			std::atomic<size_t> pins_{1};
+
+			/**
+			 * @brief Setup inherited from the LuaContext, accessed with
+			 * `std::atomic_load`; `setupGeneration_` mirrors its
+			 * generation so the hot path can check it with a plain load
+			 */
+			std::shared_ptr<const InheritedSetup> inherited_;
+			std::atomic<uint64_t> setupGeneration_{0};
+
+			std::unique_ptr<LuaState> takeState(std::chrono::milliseconds timeout);
+			void releaseState(std::unique_ptr<LuaState> state);
+			void unpin();
 			std::unique_ptr<LuaState> createState();
-			void resetState(LuaState& state);
+			std::unique_ptr<LuaState> createCheckedOutState();
+			std::unique_ptr<LuaState> tryTakeIdle();
+			void pushIdle(std::unique_ptr<LuaState> state);
+			bool tryReserveSlot();
+			std::unique_ptr<LuaState> waitForState(std::unique_lock<std::mutex>& lock, std::chrono::milliseconds timeout);
+			void removeWaiter(Waiter* waiter);
+			void handOff(std::unique_ptr<LuaState> state);
+			void serveWaiters();
+			void pushAvailable(std::unique_ptr<LuaState> state);
+			ThreadStateCache* localCache(bool create);
+			std::unique_ptr<LuaState> takeCached();
+			std::unique_ptr<LuaState> stealCached();
+			bool cacheState(std::unique_ptr<LuaState>& state);
+			size_t localCacheCapacity() const;
+			void returnCached(std::vector<std::unique_ptr<LuaState>>& states);
+			void returnIdle(std::unique_ptr<LuaState> state);
+			void dropCaches(bool detach);
+			size_t localShard() const;
+			std::unique_ptr<LuaState> popShard(StateShard& shard);
+			std::unique_ptr<LuaState> takeSharded();
+			bool shardState(std::unique_ptr<LuaState>& state);
+			void takeAllSharded(std::vector<std::unique_ptr<LuaState>>& states);
+			void sweepIdle(const std::function<bool(LuaState&)>& take, std::vector<std::unique_ptr<LuaState>>& taken);
+			void recordWait(std::chrono::steady_clock::duration waited, bool timedOut);
+			/**
+			 * @brief Setup step run by runProtected(); it must not keep
+			 * objects with destructors on its stack
+			 */
+			typedef void (StatePool::*SetupStep)(LuaState& state, const InheritedSetup* setup);
+
+			bool runProtected(LuaState& state, SetupStep step);
+			static int protectedStep(lua_State* L);
+			void discardState(std::unique_ptr<LuaState> state);
+			void releaseSlot();
+			bool shouldRecycle(LuaState& state, std::chrono::steady_clock::time_point now);
+			bool isTooOld(LuaState& state, std::chrono::steady_clock::time_point now) const;
+			void retireState(std::unique_ptr<LuaState> state);
+			void closeRetired();
+			void initializeState(LuaState& state, const InheritedSetup* setup);
+			void refreshState(LuaState& state, const InheritedSetup* setup);
+			bool isStale(LuaState& state) const;
+			void loadInherited(LuaState& state, const InheritedSetup* setup);
+			void resetState(LuaState& state, const InheritedSetup* setup);
+			void takeSnapshot(LuaState& state);
+			void restoreSnapshot(LuaState& state);
 			void loadLibraries(LuaState& state);
 			void loadGlobals(LuaState& state);
-			void loadHooks(LuaState& state);
+			void loadHooks(LuaState& state, const InheritedSetup* setup);
 
 		public:
+			/**
+			 * @brief Upper bound for `PoolConfig::threadCacheSize`
+			 */
+			static constexpr size_t MaxThreadCacheSize = 4;
+
 			explicit StatePool(std::string color, PoolConfig config);
-			~StatePool() = default;
+			~StatePool();
+
+			/**
+			 * @brief Deleter of pools owned through `std::shared_ptr`
+			 *
+			 * @details
+			 * Frees the pool at once if no state is checked out, and
+			 * otherwise when the last checked-out state is released.
+			 */
+			static void Dispose(StatePool* pool);
+
+			/**
+			 * @brief Lets the calling thread cache up to `size` released
+			 * states of every pool, even of pools without a
+			 * `threadCacheSize`
+			 *
+			 * @details
+			 * Used by the PoolExecutor workers to keep one state per
+			 * color between their tasks. Capped at MaxThreadCacheSize.
+			 */
+			static void setThreadCacheFloor(size_t size);
+
+			/**
+			 * @brief Returns the states cached by the calling thread to
+			 * their pools
+			 */
+			static void returnThreadCaches();
 
 			StatePool(const StatePool&) = delete;
 			StatePool& operator=(const StatePool&) = delete;
@@ -73,20 +275,99 @@ namespace LuaCpp {
 			StatePool& operator=(StatePool&&) = delete;
 
 			std::unique_ptr<LuaState> acquire();
+			std::unique_ptr<LuaState> acquire(std::chrono::milliseconds timeout);
 			void release(std::unique_ptr<LuaState> state);
 
+			/**
+			 * @brief Resets a checked-out state the way release() does,
+			 * without giving it back
+			 *
+			 * @details
+			 * Lets a caller run several jobs on one state with the same
+			 * isolation as separate acquires. The stack is left as it
+			 * was. A state that can not be reset should be released, so
+			 * the pool closes it.
+			 *
+			 * @return `false` if the reset failed
+			 */
+			bool reset(LuaState& state);
+
 			void warmup(size_t n);
 			void drain();
 
+			/**
+			 * @brief Applies the idle limits of the configuration
+			 *
+			 * @details
+			 * Closes recycled states retired by release(), idle states
+			 * that have been unused for longer than `idleTimeoutMs` or
+			 * are older than `maxStateAgeMs` and, when more than
+			 * `maxIdle` states are idle, the surplus with the largest
+			 * Lua heap. Never evicts below `minIdle`, and creates states
+			 * to reach `minIdle` again. Idle states built with an older
+			 * inherited setup are updated. States parked in per-thread
+			 * caches are left alone.
+			 *
+			 * The idle states are inspected where they are; only the
+			 * states being evicted or updated are taken out, so the
+			 * others stay available to acquire() during the pass. With
+			 * the lock-free idle list, which can not be walked, the
+			 * states are taken out and put back one at a time.
+			 *
+			 * @return the number of evicted states
+			 */
+			size_t maintain();
+
 			const std::string& getColor() const;
+
+			/**
+			 * @brief Returns the process-wide unique id of the pool
+			 *
+			 * @details
+			 * Unlike the color or the address, an id is never reused by
+			 * a later pool.
+			 */
+			uint64_t getId() const;
 			const PoolConfig& getConfig() const;
 			size_t getMaxSize() const;
 			size_t getCurrentSize() const;
 			size_t availableCount() const;
 			size_t checkedOutCount() const;
+			size_t threadCachedCount() const;
+			size_t getShardCount() const;
+			size_t shardedCount() const;
+			size_t retiredCount() const;
+			size_t waiterCount() const;
+			WaitStatistics getWaitStatistics() const;
+			PoolMetricsSnapshot getMetrics() const;
+
+			/**
+			 * @brief Returns the shared memory budget of the pool
+			 *
+			 * @return the budget, `nullptr` without `poolMemoryLimitBytes`
+			 */
+			std::shared_ptr<MemoryBudget> getMemoryBudget() const;
+			std::chrono::milliseconds getExhaustionTimeout() const;
+
+			/**
+			 * @brief Sets the libraries, built-ins and hooks inherited
+			 * from a LuaContext
+			 *
+			 * @details
+			 * New states are built with the new setup at once. Idle
+			 * states built with an older generation are updated by
+			 * maintain(), so with a maintenance thread the rebuild runs
+			 * in the background; a stale state that is acquired before
+			 * that is updated by acquire().
+			 *
+			 * @param setup The setup, `nullptr` to inherit nothing
+			 */
+			void setInheritedSetup(std::shared_ptr<const InheritedSetup> setup);
+			std::shared_ptr<const InheritedSetup> getInheritedSetup() const;
 
 			void setThreadSafe(bool threadSafe);
 			bool isThreadSafe() const;
+			bool isLockFree() const;
 		};
 	}
 }
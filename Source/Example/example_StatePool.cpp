@@ -63,18 +63,18 @@ int main(int argc, char **argv) {
 	std::cout << "   Warmup pre-creates states in the pool, eliminating" << "\n";
 	std::cout << "   allocation overhead during execution." << "\n\n";
 
-	StatePool& defaultPool = ctx.getPool("default");
+	PoolHandle defaultPool = ctx.getPoolHandle("default");
 	
 	std::cout << "   Pool stats before warmup:" << "\n";
-	std::cout << "     - Current size: " << defaultPool.getCurrentSize() << "\n";
-	std::cout << "     - Available: " << defaultPool.availableCount() << "\n";
-	std::cout << "     - Max size: " << defaultPool.getMaxSize() << "\n\n";
+	std::cout << "     - Current size: " << defaultPool->getCurrentSize() << "\n";
+	std::cout << "     - Available: " << defaultPool->availableCount() << "\n";
+	std::cout << "     - Max size: " << defaultPool->getMaxSize() << "\n\n";
 
-	defaultPool.warmup(3);
+	defaultPool->warmup(3);
 	
 	std::cout << "   Pool stats after warmup(3):" << "\n";
-	std::cout << "     - Current size: " << defaultPool.getCurrentSize() << "\n";
-	std::cout << "     - Available: " << defaultPool.availableCount() << "\n\n";
+	std::cout << "     - Current size: " << defaultPool->getCurrentSize() << "\n";
+	std::cout << "     - Available: " << defaultPool->availableCount() << "\n\n";
 
 	// ========================================
 	// Example 3: Custom pool creation
@@ -86,7 +86,7 @@ int main(int argc, char **argv) {
 	mathOnlyConfig.libraries = {"base", "math"};
 	mathOnlyConfig.maxSize = 2;
 
-	StatePool& mathPool = ctx.createPool("math_only", mathOnlyConfig);
+	PoolHandle mathPool = ctx.createPoolHandle("math_only", mathOnlyConfig);
 
 	ctx.CompileString("math_test", "print('  math.sqrt(16) = ' .. math.sqrt(16))");
 
@@ -126,14 +126,14 @@ int main(int argc, char **argv) {
 	// ========================================
 	std::cout << "5. Checking pool statistics:" << "\n\n";
 
-	StatePool& pool = ctx.getPool("default");
+	PoolHandle pool = ctx.getPoolHandle("default");
 	std::cout << "   'default' pool statistics:" << "\n";
-	std::cout << "     - Color: " << pool.getColor() << "\n";
-	std::cout << "     - Max size: " << pool.getMaxSize() << "\n";
-	std::cout << "     - Current size: " << pool.getCurrentSize() << "\n";
-	std::cout << "     - Available: " << pool.availableCount() << "\n";
-	std::cout << "     - Checked out: " << pool.checkedOutCount() << "\n";
-	std::cout << "     - Thread safe: " << (pool.isThreadSafe() ? "yes" : "no") << "\n";
+	std::cout << "     - Color: " << pool->getColor() << "\n";
+	std::cout << "     - Max size: " << pool->getMaxSize() << "\n";
+	std::cout << "     - Current size: " << pool->getCurrentSize() << "\n";
+	std::cout << "     - Available: " << pool->availableCount() << "\n";
+	std::cout << "     - Checked out: " << pool->checkedOutCount() << "\n";
+	std::cout << "     - Thread safe: " << (pool->isThreadSafe() ? "yes" : "no") << "\n";
 	std::cout << "\n";
 
 	// ========================================
@@ -55,10 +55,10 @@ int main(int argc, char **argv) {
 
 	std::cout << "   Executing multiple scripts on the same state:" << "\n";
 	try {
-		auto& pool = ctx.getPool("default");
+		PoolHandle pool = ctx.getPoolHandle("default");
 		std::cout << "   Pool stats (while state is checked out):" << "\n";
-		std::cout << "     - Available: " << pool.availableCount() << "\n";
-		std::cout << "     - Checked out: " << pool.checkedOutCount() << "\n\n";
+		std::cout << "     - Available: " << pool->availableCount() << "\n";
+		std::cout << "     - Checked out: " << pool->checkedOutCount() << "\n\n";
 
 		ctx.RunWithEnvironmentPooled("init_counter", LuaEnvironment(), "default");
 		ctx.RunWithEnvironmentPooled("increment_counter", LuaEnvironment(), "default");
@@ -74,10 +74,10 @@ int main(int argc, char **argv) {
 	ctx.ReleasePooledState(std::move(state), "default");
 
 	{
-		auto& pool = ctx.getPool("default");
+		PoolHandle pool = ctx.getPoolHandle("default");
 		std::cout << "   Pool stats (after state is released):" << "\n";
-		std::cout << "     - Available: " << pool.availableCount() << "\n";
-		std::cout << "     - Checked out: " << pool.checkedOutCount() << "\n";
+		std::cout << "     - Available: " << pool->availableCount() << "\n";
+		std::cout << "     - Checked out: " << pool->checkedOutCount() << "\n";
 	}
 	std::cout << "\n";
 
@@ -94,10 +94,10 @@ int main(int argc, char **argv) {
 		std::cout << "   Entering scope..." << "\n";
 		auto pooledState = ctx.AcquirePooledStateRAII("default");
 
-		auto& pool = ctx.getPool("default");
+		PoolHandle pool = ctx.getPoolHandle("default");
 		std::cout << "   Pool stats (inside scope):" << "\n";
-		std::cout << "     - Available: " << pool.availableCount() << "\n";
-		std::cout << "     - Checked out: " << pool.checkedOutCount() << "\n";
+		std::cout << "     - Available: " << pool->availableCount() << "\n";
+		std::cout << "     - Checked out: " << pool->checkedOutCount() << "\n";
 
 		try {
 			ctx.RunPooled("raii_test");
@@ -110,10 +110,10 @@ int main(int argc, char **argv) {
 	}
 
 	{
-		auto& pool = ctx.getPool("default");
+		PoolHandle pool = ctx.getPoolHandle("default");
 		std::cout << "   Pool stats (after scope exit):" << "\n";
-		std::cout << "     - Available: " << pool.availableCount() << "\n";
-		std::cout << "     - Checked out: " << pool.checkedOutCount() << "\n";
+		std::cout << "     - Available: " << pool->availableCount() << "\n";
+		std::cout << "     - Checked out: " << pool->checkedOutCount() << "\n";
 	}
 	std::cout << "\n";
 
@@ -157,12 +157,12 @@ int main(int argc, char **argv) {
 
 	ctx.CompileString("thread_work", "print('  Thread working... result = ' .. math.sqrt(100))");
 
-	StatePool& threadPool = ctx.createPool("thread_safe", PoolConfig().SetMaxSize(3));
-	threadPool.setThreadSafe(true);
-	threadPool.warmup(3);
+	PoolHandle threadPool = ctx.createPoolHandle("thread_safe", PoolConfig().SetMaxSize(3));
+	threadPool->setThreadSafe(true);
+	threadPool->warmup(3);
 
 	std::cout << "   Spawning 3 threads using the same pool..." << "\n";
-	std::cout << "   Pool max size: " << threadPool.getMaxSize() << "\n\n";
+	std::cout << "   Pool max size: " << threadPool->getMaxSize() << "\n\n";
 
 	std::vector<std::thread> threads;
 	for (int i = 0; i < 3; i++) {
@@ -198,15 +198,15 @@ int main(int argc, char **argv) {
 	smallConfig.maxSize = 1;
 	ctx.createPool("tiny", smallConfig);
 
-	auto& tinyPool = ctx.getPool("tiny");
+	PoolHandle tinyPool = ctx.getPoolHandle("tiny");
 	std::cout << "   Created 'tiny' pool with max size = 1" << "\n";
 
 	auto tinyState = ctx.AcquirePooledState("tiny");
 	std::cout << "   Acquired 1 state (pool now empty)..." << "\n";
 	std::cout << "   Pool stats:" << "\n";
-	std::cout << "     - Available: " << tinyPool.availableCount() << "\n";
-	std::cout << "     - Checked out: " << tinyPool.checkedOutCount() << "\n";
-	std::cout << "     - Max size: " << tinyPool.getMaxSize() << "\n\n";
+	std::cout << "     - Available: " << tinyPool->availableCount() << "\n";
+	std::cout << "     - Checked out: " << tinyPool->checkedOutCount() << "\n";
+	std::cout << "     - Max size: " << tinyPool->getMaxSize() << "\n\n";
 
 	std::cout << "   Attempting to acquire another state..." << "\n";
 	try {
@@ -220,7 +220,7 @@ int main(int argc, char **argv) {
 
 	std::cout << "\n   Releasing state back to pool..." << "\n";
 	ctx.ReleasePooledState(std::move(tinyState), "tiny");
-	std::cout << "   Now available: " << tinyPool.availableCount() << "\n";
+	std::cout << "   Now available: " << tinyPool->availableCount() << "\n";
 	std::cout << "\n";
 
 	// ========================================
@@ -229,18 +229,18 @@ int main(int argc, char **argv) {
 	std::cout << "6. Draining a pool:" << "\n";
 	std::cout << "   Use drain() to remove all available states from the pool." << "\n\n";
 
-	StatePool& drainPool = ctx.createPool("drain_test", PoolConfig().SetMaxSize(5));
-	drainPool.warmup(4);
+	PoolHandle drainPool = ctx.createPoolHandle("drain_test", PoolConfig().SetMaxSize(5));
+	drainPool->warmup(4);
 
 	std::cout << "   Pool after warmup(4):" << "\n";
-	std::cout << "     - Current size: " << drainPool.getCurrentSize() << "\n";
-	std::cout << "     - Available: " << drainPool.availableCount() << "\n";
+	std::cout << "     - Current size: " << drainPool->getCurrentSize() << "\n";
+	std::cout << "     - Available: " << drainPool->availableCount() << "\n";
 
-	drainPool.drain();
+	drainPool->drain();
 
 	std::cout << "\n   Pool after drain():" << "\n";
-	std::cout << "     - Current size: " << drainPool.getCurrentSize() << "\n";
-	std::cout << "     - Available: " << drainPool.availableCount() << "\n";
+	std::cout << "     - Current size: " << drainPool->getCurrentSize() << "\n";
+	std::cout << "     - Available: " << drainPool->availableCount() << "\n";
 	std::cout << "\n";
 
 	std::cout << "=== Example complete ===" << "\n";
@@ -25,14 +25,55 @@
 #include <stdexcept>
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <set>
 
 #include "LuaContext.hpp"
+#include "Registry/LuaCompiler.hpp"
 #include "LuaVersion.hpp"
 
 using namespace LuaCpp;
 using namespace LuaCpp::Engine;
 using namespace LuaCpp::Registry;
 
+namespace {
+	/**
+	 * @brief Arguments of pushEnvironment(); plain pointers only, as a
+	 * Lua error longjmps out of it
+	 */
+	struct EnvironmentPush {
+		LuaState *state;
+		const LuaEnvironment *env;
+	};
+
+	int pushEnvironment(lua_State *L) {
+		const EnvironmentPush *push = (const EnvironmentPush *) lua_touserdata(L, 1);
+		lua_pop(L, 1);
+		for (const auto &var : *push->env) {
+			var.second->PushValue(*push->state);
+			lua_setglobal(L, var.first.c_str());
+		}
+		return 0;
+	}
+
+	/**
+	 * @brief Sets the variables of the environment as globals in a
+	 * protected call
+	 *
+	 * @details
+	 * Leaves the error on the stack if it fails. The variables are
+	 * bound to their names with `PopGlobal(state, name)` once the
+	 * snippet ran.
+	 */
+	int setEnvironment(LuaState &state, const LuaEnvironment &env) {
+		EnvironmentPush push{&state, &env};
+		lua_pushcfunction(state, pushEnvironment);
+		lua_pushlightuserdata(state, &push);
+		return lua_pcall(state, 1, 0, 0);
+	}
+}
 
 std::unique_ptr<LuaState> LuaContext::newState(std::optional<Engine::StateParams> params) {
 	return newState(globalEnvironment, params);
@@ -80,14 +121,20 @@ std::unique_ptr<LuaState> LuaContext::newStateFor(const std::string &name, std::
 
 std::unique_ptr<LuaState> LuaContext::newStateFor(const std::string &name, const LuaEnvironment &env, std::optional<Engine::StateParams> params) {
 	if (registry.Exists(name)) {
-		std::unique_ptr<LuaCodeSnippet> cs = registry.getByName(name);
+		std::shared_ptr<const LuaCodeSnippet> cs = registry.getByName(name);
 		std::unique_ptr<LuaState> L = newState(env, params);
-		cs->UploadCode(*L);
+		if (cs->UploadCode(*L) != LUA_OK) {
+			throw std::runtime_error("Error: The code snippet can not be loaded: " + std::string(lua_tostring(*L, -1)));
+		}
 		return L;	
 	}	
 	throw std::runtime_error("Error: The code snipped not found ...");
 }
 
+void LuaContext::AddCompiledBuffer(const std::string &name, const char *data, size_t size, std::shared_ptr<const void> owner, bool replace) {
+	registry.AddSnippet(name, LuaCodeSnippet::FromBuffer(name, data, size, std::move(owner)), replace);
+}
+
 void LuaContext::CompileString(const std::string &name, const std::string &code) {
 	registry.CompileAndAddString(name, code);
 }
@@ -104,6 +151,18 @@ void LuaContext::CompileFile(const std::string &name, const std::string &fname,
 	registry.CompileAndAddFile(name,fname, recompile);
 }
 
+size_t LuaContext::MountBundle(const std::string &path, bool replace) {
+	return registry.MountBundle(path, replace);
+}
+
+size_t LuaContext::UnmountBundle(const std::string &path) {
+	return registry.UnmountBundle(path);
+}
+
+void LuaContext::setBytecodeCache(std::shared_ptr<BytecodeCache> cache) {
+	registry.setBytecodeCache(std::move(cache));
+}
+
 void LuaContext::CompileFolder(const std::string &path) {
 	CompileFolder(path, "", false);
 }
@@ -113,21 +172,89 @@ void LuaContext::CompileFolder(const std::string &path, const std::string &prefi
 }
 
 void LuaContext::CompileFolder(const std::string &path, const std::string &prefix, bool recompile) {
-	for (const auto &entry : std::filesystem::directory_iterator(path)) {
-		if (entry.is_regular_file()){
-			std::filesystem::path path = entry.path();
-			if (path.extension() == ".lua") {
-				try {
-					if (prefix == "") {
-						CompileFile(path.stem().native() ,path, recompile);
-					} else {
-						CompileFile(prefix+"."+path.stem().native() ,path, recompile);
-					}
-				} catch (std::logic_error &e) {
-				}
+	CompileFolder(path, CompileFolderOptions().SetPrefix(prefix).SetRecompile(recompile));
+}
+
+CompileReport LuaContext::CompileFolder(const std::string &path, const CompileFolderOptions &options) {
+	namespace fs = std::filesystem;
+
+	std::vector<fs::path> files;
+	if (options.recursive) {
+		for (const auto &entry : fs::recursive_directory_iterator(path)) {
+			if (entry.is_regular_file() && entry.path().extension() == ".lua") {
+				files.push_back(entry.path());
+			}
+		}
+	} else {
+		for (const auto &entry : fs::directory_iterator(path)) {
+			if (entry.is_regular_file() && entry.path().extension() == ".lua") {
+				files.push_back(entry.path());
 			}
 		}
 	}
+	std::sort(files.begin(), files.end());
+
+	// Map the files to snippet names; sub-folders become dotted parts
+	CompileReport report;
+	std::vector<std::pair<fs::path, std::string>> sources;
+	std::set<std::string> names;
+	for (const auto &file : files) {
+		std::string name = options.prefix;
+		for (const auto &part : file.lexically_relative(path).parent_path()) {
+			name += (name.empty() ? "" : ".") + part.string();
+		}
+		name += (name.empty() ? "" : ".") + file.stem().string();
+
+		if (!names.insert(name).second) {
+			report.errors.push_back(CompileError{file.string(), name, "Error: Duplicate snippet name: " + name});
+		} else if (!options.recompile && registry.Exists(name)) {
+			report.skipped++;
+		} else {
+			sources.emplace_back(file, name);
+		}
+	}
+
+	// Compile into the staging area, each thread with its own compiler
+	std::vector<std::unique_ptr<LuaCodeSnippet>> staged(sources.size());
+	std::vector<std::string> failures(sources.size());
+	std::atomic<size_t> next{0};
+	std::shared_ptr<BytecodeCache> cache = registry.getBytecodeCache();
+	auto compile = [&sources, &staged, &failures, &next, &cache]() {
+		LuaCompiler compiler(cache);
+		for (size_t i = next++; i < sources.size(); i = next++) {
+			try {
+				staged[i] = compiler.CompileFile(sources[i].second, sources[i].first.string());
+			} catch (std::exception &e) {
+				failures[i] = e.what();
+			}
+		}
+	};
+
+	size_t parallelism = options.parallelism > 0 ? options.parallelism : std::thread::hardware_concurrency();
+	parallelism = std::max<size_t>(std::min(parallelism, sources.size()), 1);
+	std::vector<std::thread> helpers;
+	for (size_t i = 1; i < parallelism; i++) {
+		helpers.emplace_back(compile);
+	}
+	compile();
+	for (auto &helper : helpers) {
+		helper.join();
+	}
+
+	SnippetBatch snippets;
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (staged[i]) {
+			snippets.emplace_back(sources[i].second, std::move(staged[i]));
+		} else {
+			report.errors.push_back(CompileError{sources[i].first.string(), sources[i].second, failures[i]});
+		}
+	}
+
+	// Names registered by somebody else in the meantime count as skipped
+	size_t count = snippets.size();
+	report.compiled = registry.AddSnippets(std::move(snippets), options.recompile);
+	report.skipped += count - report.compiled;
+	return report;
 }
 
 void LuaContext::CompileStringAndRun(const std::string &code) {
@@ -182,6 +309,39 @@ void LuaContext::RunWithEnvironment(const std::string &name, const LuaEnvironmen
 
 }
 
+void LuaContext::RunWithEnvironment(const std::string &name, const LuaEnvironment &env, Deadline deadline) {
+	std::unique_ptr<LuaState> L = newStateFor(name);
+
+	for(const auto &var : env) {
+		var.second->PushGlobal(*L, var.first);
+	}
+
+	int res = callChunk(*L, deadline);
+	if (res != LUA_OK ) {
+		L->PrintStack(std::cout);
+		throw std::runtime_error(lua_tostring(*L,1));
+	}
+
+	for(const auto &var : env) {
+		var.second->PopGlobal(*L);
+	}
+}
+
+int LuaContext::callChunk(LuaState &L, std::optional<Deadline> deadline) {
+	if (!deadline) {
+		return lua_pcall(L, 0, LUA_MULTRET, 0);
+	}
+
+	DeadlineGuard guard(L, *deadline);
+	int res = lua_pcall(L, 0, LUA_MULTRET, 0);
+	if (guard.disarm() && res != LUA_OK) {
+		std::string err = lua_isstring(L, -1) ? lua_tostring(L, -1) : LuaWatchdog::TimeoutMessage;
+		lua_pop(L, 1);
+		throw LuaTimeoutException(err);
+	}
+	return res;
+}
+
 std::shared_ptr<Registry::LuaLibrary> LuaContext::getStdLibrary(const std::string &libName)
 {
 	std::shared_ptr<LuaLibrary> foundLibrary = nullptr;
@@ -289,6 +449,7 @@ void LuaContext::setBuiltInFnc(const std::string &fncName, lua_CFunction cfuncti
 		std::unique_ptr<LuaCFunction> func = std::make_unique<LuaCFunction>(cfunction);
 		func->setName(fncName);
 		builtInFunctions.insert(std::make_pair(fncName, std::move(*func)));
+		updatePoolSetup();
 	}
 }
 
@@ -304,6 +465,7 @@ void LuaContext::AddLibrary(const std::shared_ptr<Registry::LuaLibrary> &library
 			throw std::invalid_argument("Library cannot be null");
 		}
 		this->libraries[library->getName()] = library;	
+		updatePoolSetup();
 }
 
 void LuaContext::AddGlobalVariable(const std::string &name, const std::shared_ptr<Engine::LuaType> var) {
@@ -324,6 +486,7 @@ std::shared_ptr<Engine::LuaType> LuaContext::getGlobalVariable(const std::string
 void LuaContext::addHook(lua_Hook hookFunc, const std::string &hookType, const int count)
 {
 	hooks.push_back(std::tuple<std::string, int, lua_Hook>(hookType, count, hookFunc));
+	updatePoolSetup();
 }
 
 void LuaContext::registerHooks(LuaCpp::Engine::LuaState &L)
@@ -364,14 +527,43 @@ void LuaContext::registerHooks(LuaCpp::Engine::LuaState &L)
 PoolManager& LuaContext::getPoolManager() {
 	if (!poolManager_) {
 		poolManager_ = std::make_unique<PoolManager>();
+		if (!libraries.empty() || !builtInFunctions.empty() || !hooks.empty()) {
+			updatePoolSetup();
+		}
 	}
 	return *poolManager_;
 }
 
+void LuaContext::updatePoolSetup() {
+	// Built from scratch when the pool manager is created
+	if (!poolManager_) {
+		return;
+	}
+
+	auto setup = std::make_shared<InheritedSetup>();
+	setup->generation = ++poolSetupGeneration_;
+	for (const auto& lib : libraries) {
+		setup->customLibraries.push_back(lib.second);
+	}
+	for (auto& builtInFunction : builtInFunctions) {
+		if (builtInFunction.second.getCFunction() == nullptr) {
+			throw std::runtime_error("Attempted to register a null C function: " + builtInFunction.first);
+		}
+		setup->builtInFunctions[builtInFunction.first] = builtInFunction.second.getCFunction();
+	}
+	setup->hooks = hooks;
+
+	poolManager_->setInheritedSetup(std::move(setup));
+}
+
 StatePool& LuaContext::getPool(const std::string& color) {
 	return getPoolManager().getPool(color);
 }
 
+PoolHandle LuaContext::getPoolHandle(const std::string& color) {
+	return getPoolManager().getHandle(color);
+}
+
 bool LuaContext::hasPool(const std::string& color) {
 	if (!poolManager_) {
 		return color == "default" || color == "sandboxed" || color == "minimal" || color == "io";
@@ -383,48 +575,286 @@ StatePool& LuaContext::createPool(const std::string& color, const PoolConfig& co
 	return getPoolManager().createPool(color, config);
 }
 
+PoolHandle LuaContext::createPoolHandle(const std::string& color, const PoolConfig& config) {
+	return getPoolManager().createHandle(color, config);
+}
+
 void LuaContext::RunPooled(const std::string& name, const std::string& color) {
-	RunWithEnvironmentPooled(name, globalEnvironment, color);
+	RunWithEnvironmentPooled(name, globalEnvironment, getPoolHandle(color));
+}
+
+void LuaContext::RunPooled(const std::string& name, const PoolHandle& pool) {
+	RunWithEnvironmentPooled(name, globalEnvironment, pool);
 }
 
 void LuaContext::RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const std::string& color) {
+	RunWithEnvironmentPooled(name, env, getPoolHandle(color));
+}
+
+void LuaContext::RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const PoolHandle& handle) {
+	runPooled(name, env, handle, std::nullopt);
+}
+
+void LuaContext::RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const std::string& color, Deadline deadline) {
+	RunWithEnvironmentPooled(name, env, getPoolHandle(color), deadline);
+}
+
+void LuaContext::RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const PoolHandle& handle, Deadline deadline) {
+	runPooled(name, env, handle, deadline);
+}
+
+void LuaContext::runPooled(const std::string& name, const LuaEnvironment& env, const PoolHandle& handle, std::optional<Deadline> deadline) {
 	if (!registry.Exists(name)) {
 		throw std::runtime_error("Error: The code snippet not found: " + name);
 	}
 
-	auto state = AcquirePooledState(color);
-	
-	std::unique_ptr<LuaCodeSnippet> cs = registry.getByName(name);
-	cs->UploadCode(*state);
+	StatePool& pool = *handle;
+	auto state = pool.acquire(pool.getExhaustionTimeout());
 
-	for (const auto& var : env) {
-		var.second->PushGlobal(*state, var.first);
+	try {
+		runInState(*state, name, env, deadline);
+	} catch (...) {
+		pool.release(std::move(state));
+		throw;
+	}
+
+	pool.release(std::move(state));
+}
+
+void LuaContext::runInState(LuaState& state, const std::string& name, const LuaEnvironment& env, std::optional<Deadline> deadline, bool writeBack) {
+	if (registry.PushCachedChunk(state, name) != LUA_OK) {
+		std::string err = lua_isstring(state, -1) ? lua_tostring(state, -1) : "unknown error";
+		lua_pop(state, 1);
+		throw std::runtime_error("Error: The code snippet can not be loaded: " + err);
 	}
 
-	int res = lua_pcall(*state, 0, LUA_MULTRET, 0);
+	if (setEnvironment(state, env) != LUA_OK) {
+		std::string err = lua_isstring(state, -1) ? lua_tostring(state, -1) : "unknown error";
+		lua_pop(state, 2);
+		throw std::runtime_error("Error: The environment can not be set: " + err);
+	}
+
+	int res = callChunk(state, deadline);
 	if (res != LUA_OK) {
-		state->PrintStack(std::cout);
-		std::string err = lua_tostring(*state, 1);
-		ReleasePooledState(std::move(state), color);
+		state.PrintStack(std::cout);
+		std::string err = lua_tostring(state, 1);
 		throw std::runtime_error(err);
 	}
 
+	if (!writeBack) {
+		return;
+	}
 	for (const auto& var : env) {
-		var.second->PopGlobal(*state);
+		var.second->PopGlobal(state, var.first);
 	}
-
-	ReleasePooledState(std::move(state), color);
 }
 
 std::unique_ptr<LuaState> LuaContext::AcquirePooledState(const std::string& color) {
-	return getPool(color).acquire();
+	return getPoolHandle(color)->acquire();
+}
+
+std::unique_ptr<LuaState> LuaContext::AcquirePooledState(const std::string& color, std::chrono::milliseconds timeout) {
+	return getPoolHandle(color)->acquire(timeout);
+}
+
+std::unique_ptr<LuaState> LuaContext::AcquirePooledState(const PoolHandle& pool) {
+	return pool->acquire();
+}
+
+std::unique_ptr<LuaState> LuaContext::AcquirePooledState(const PoolHandle& pool, std::chrono::milliseconds timeout) {
+	return pool->acquire(timeout);
 }
 
 void LuaContext::ReleasePooledState(std::unique_ptr<LuaState> state, const std::string& color) {
-	getPool(color).release(std::move(state));
+	getPoolHandle(color)->release(std::move(state));
+}
+
+void LuaContext::ReleasePooledState(std::unique_ptr<LuaState> state, const PoolHandle& pool) {
+	pool->release(std::move(state));
 }
 
 PooledState LuaContext::AcquirePooledStateRAII(const std::string& color) {
-	StatePool& pool = getPool(color);
-	return PooledState(pool.acquire(), &pool);
-}
\ No newline at end of file
+	return AcquirePooledStateRAII(getPoolHandle(color));
+}
+
+PooledState LuaContext::AcquirePooledStateRAII(const std::string& color, std::chrono::milliseconds timeout) {
+	return AcquirePooledStateRAII(getPoolHandle(color), timeout);
+}
+
+PooledState LuaContext::AcquirePooledStateRAII(const PoolHandle& pool) {
+	return PooledState(pool->acquire(), pool.get());
+}
+
+PooledState LuaContext::AcquirePooledStateRAII(const PoolHandle& pool, std::chrono::milliseconds timeout) {
+	return PooledState(pool->acquire(timeout), pool.get());
+}
+
+PoolExecutor& LuaContext::getExecutor() {
+	return getPoolManager().getExecutor();
+}
+
+void LuaContext::configureExecutor(const ExecutorConfig& config) {
+	getPoolManager().configureExecutor(config);
+}
+
+std::future<void> LuaContext::RunPooledAsync(const std::string& name, const std::string& color) {
+	if (!registry.Exists(name)) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+
+	// Concurrent runs share the global objects, so they are only read
+	return getPoolManager().submit(color, [this, name, env = globalEnvironment](LuaState& state) {
+		runInState(state, name, env, std::nullopt, false);
+	});
+}
+
+std::future<void> LuaContext::RunPooledAsync(const std::string& name, const LuaEnvironment& env, const std::string& color) {
+	if (!registry.Exists(name)) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+
+	return getPoolManager().submit(color, [this, name, env](LuaState& state) {
+		runInState(state, name, env);
+	});
+}
+
+void LuaContext::RunPooledAsync(const std::string& name, const LuaEnvironment& env, const std::string& color, std::function<void(std::exception_ptr)> done) {
+	if (!registry.Exists(name)) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+
+	getPoolManager().submit(color, [this, name, env](LuaState& state) {
+		runInState(state, name, env);
+	}, std::move(done));
+}
+
+BatchResult LuaContext::RunBatchPooled(const std::string& name, const std::vector<LuaEnvironment>& envs, const std::string& color, size_t parallelism) {
+	return RunBatchPooled(name, envs, getPoolHandle(color), parallelism);
+}
+
+BatchResult LuaContext::RunBatchPooled(const std::string& name, const std::vector<LuaEnvironment>& envs, const PoolHandle& handle, size_t parallelism) {
+	if (!registry.Exists(name)) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+
+	BatchResult result;
+	result.items.resize(envs.size());
+	if (envs.empty()) {
+		return result;
+	}
+
+	size_t slices = std::max<size_t>(1, std::min(parallelism, envs.size()));
+	if (slices > 1 && !getPoolManager().isThreadSafe()) {
+		throw std::runtime_error("Error: A parallel batch needs a thread-safe pool manager: " + name);
+	}
+
+	StatePool& pool = *handle;
+	auto state = pool.acquire(pool.getExhaustionTimeout());
+
+	// Slice i covers [bounds[i], bounds[i + 1])
+	std::vector<size_t> bounds(slices + 1);
+	for (size_t i = 0; i <= slices; i++) {
+		bounds[i] = envs.size() * i / slices;
+	}
+
+	std::vector<char> done(slices, 0);
+	std::vector<std::exception_ptr> errors(slices);
+	std::vector<std::thread> helpers;
+	try {
+		for (size_t i = 1; i < slices; i++) {
+			helpers.emplace_back([&, i]() {
+				std::unique_ptr<LuaState> own;
+				try {
+					own = pool.acquire(std::chrono::milliseconds(0));
+				} catch (const PoolExhaustedException&) {
+					return;
+				} catch (...) {
+					errors[i] = std::current_exception();
+					return;
+				}
+				try {
+					runBatchInState(pool, *own, name, envs, bounds[i], bounds[i + 1], result);
+					done[i] = 1;
+				} catch (...) {
+					errors[i] = std::current_exception();
+				}
+				pool.release(std::move(own));
+			});
+		}
+
+		runBatchInState(pool, *state, name, envs, bounds[0], bounds[1], result);
+		for (auto& helper : helpers) {
+			helper.join();
+		}
+		helpers.clear();
+
+		for (size_t i = 1; i < slices; i++) {
+			if (errors[i]) {
+				std::rethrow_exception(errors[i]);
+			}
+			if (!done[i]) {
+				runBatchInState(pool, *state, name, envs, bounds[i], bounds[i + 1], result);
+			}
+		}
+	} catch (...) {
+		for (auto& helper : helpers) {
+			helper.join();
+		}
+		pool.release(std::move(state));
+		throw;
+	}
+	pool.release(std::move(state));
+
+	for (const auto& item : result.items) {
+		if (!item.success) {
+			result.failed++;
+		}
+	}
+	return result;
+}
+
+void LuaContext::runBatchInState(StatePool& pool, LuaState& state, const std::string& name, const std::vector<LuaEnvironment>& envs, size_t first, size_t last, BatchResult& result) {
+	if (registry.PushCachedChunk(state, name) != LUA_OK) {
+		std::string err = lua_isstring(state, -1) ? lua_tostring(state, -1) : "unknown error";
+		lua_pop(state, 1);
+		throw std::runtime_error("Error: The code snippet can not be loaded: " + err);
+	}
+	int chunk = lua_gettop(state);
+
+	for (size_t i = first; i < last; i++) {
+		BatchItemResult& item = result.items[i];
+		// The same isolation as between two pooled runs
+		if (!pool.reset(state)) {
+			item.success = false;
+			item.error = "Error: The state can not be reset: " + name;
+			continue;
+		}
+
+		lua_pushvalue(state, chunk);
+		if (setEnvironment(state, envs[i]) != LUA_OK || lua_pcall(state, 0, LUA_MULTRET, 0) != LUA_OK) {
+			item.success = false;
+			item.error = lua_isstring(state, -1) ? lua_tostring(state, -1) : "unknown error";
+		} else {
+			try {
+				for (const auto& var : envs[i]) {
+					var.second->PopGlobal(state, var.first);
+				}
+			} catch (const std::exception& e) {
+				item.success = false;
+				item.error = e.what();
+			}
+		}
+		lua_settop(state, chunk);
+	}
+	lua_settop(state, chunk - 1);
+}
+
+LuaScheduler::TaskId LuaContext::SpawnTask(LuaScheduler& scheduler, const std::string& name) {
+	LuaState& state = scheduler.getState();
+	if (registry.PushCachedChunk(state, name) != LUA_OK) {
+		std::string err = lua_isstring(state, -1) ? lua_tostring(state, -1) : "unknown error";
+		lua_pop(state, 1);
+		throw std::runtime_error("Error: The code snippet can not be loaded: " + err);
+	}
+	return scheduler.spawn(0);
+}
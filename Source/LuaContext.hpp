@@ -27,6 +27,7 @@
 
 #include <memory>
 #include <optional>
+#include <chrono>
 
 #include "Registry/LuaRegistry.hpp"
 #include "Registry/LuaLibrary.hpp"
@@ -34,6 +35,10 @@
 #include "Engine/LuaType.hpp"
 #include "Engine/PoolManager.hpp"
 #include "Engine/PooledState.hpp"
+#include "Engine/PoolHandle.hpp"
+#include "Engine/PoolExecutor.hpp"
+#include "Engine/LuaScheduler.hpp"
+#include "Engine/LuaWatchdog.hpp"
 
 namespace LuaCpp {
 	/**
@@ -47,6 +52,77 @@ namespace LuaCpp {
 
 	typedef std::map<std::string, std::shared_ptr<Engine::LuaType>> LuaEnvironment;
 
+	/**
+	 * @brief Outcome of one environment of a batch run
+	 */
+	struct BatchItemResult final {
+		bool success = true;
+		std::string error;
+	};
+
+	/**
+	 * @brief Outcome of LuaContext::RunBatchPooled()
+	 *
+	 * @details
+	 * `items` is in the order of the environments. The values a
+	 * successful run assigns to the environment's globals are written
+	 * back into the environment objects, as with
+	 * LuaContext::RunWithEnvironmentPooled().
+	 */
+	struct BatchResult final {
+		std::vector<BatchItemResult> items;
+		size_t failed = 0;
+
+		bool ok() const {
+			return failed == 0;
+		}
+	};
+
+	/**
+	 * @brief Options of LuaContext::CompileFolder()
+	 *
+	 * @details
+	 * `parallelism` is the number of threads compiling the files,
+	 * `0` uses one per hardware thread.
+	 */
+	struct CompileFolderOptions final {
+		std::string prefix;
+		bool recursive = false;
+		bool recompile = false;
+		size_t parallelism = 0;
+
+		CompileFolderOptions& SetPrefix(const std::string& value) { prefix = value; return *this; }
+		CompileFolderOptions& SetRecursive(bool value) { recursive = value; return *this; }
+		CompileFolderOptions& SetRecompile(bool value) { recompile = value; return *this; }
+		CompileFolderOptions& SetParallelism(size_t value) { parallelism = value; return *this; }
+	};
+
+	/**
+	 * @brief A file LuaContext::CompileFolder() could not add
+	 */
+	struct CompileError final {
+		std::string file;
+		std::string name;
+		std::string message;
+	};
+
+	/**
+	 * @brief Outcome of LuaContext::CompileFolder()
+	 *
+	 * @details
+	 * `compiled` counts the snippets added to the registry, `skipped`
+	 * the files whose name was already registered.
+	 */
+	struct CompileReport final {
+		size_t compiled = 0;
+		size_t skipped = 0;
+		std::vector<CompileError> errors;
+
+		bool ok() const {
+			return errors.empty();
+		}
+	};
+
 	struct StateProxy final {
 		explicit StateProxy(std::unique_ptr<Engine::LuaState>&& state) noexcept
 			: state_(std::move(state)) {}
@@ -105,6 +181,52 @@ namespace LuaCpp {
 		 */
 		mutable std::unique_ptr<Engine::PoolManager> poolManager_;
 
+		/**
+		 * @brief Generation of the last setup handed to the pools
+		 */
+		uint64_t poolSetupGeneration_ = 0;
+
+		/**
+		 * @brief Hands the libraries, built-ins and hooks to the pools
+		 *
+		 * @details
+		 * Called whenever one of them changes; the pools update their
+		 * states in the background.
+		 */
+		void updatePoolSetup();
+
+		/**
+		 * @brief Runs a snippet on a state that is already checked out
+		 *
+		 * @details
+		 * With `writeBack` unset the globals are only pushed; their
+		 * values are not read back into the environment after the run.
+		 */
+		void runInState(Engine::LuaState &state, const std::string &name, const LuaEnvironment &env, std::optional<Engine::Deadline> deadline = std::nullopt, bool writeBack = true);
+
+		/**
+		 * @brief Calls the chunk on top of the stack, watched by the
+		 * shared LuaWatchdog when a deadline is given
+		 *
+		 * @details
+		 * Throws LuaTimeoutException if the deadline stopped the run.
+		 *
+		 * @return the status of `lua_pcall`
+		 */
+		static int callChunk(Engine::LuaState &state, std::optional<Engine::Deadline> deadline);
+
+		/**
+		 * @brief Runs a snippet on a state of the pool, with an optional deadline
+		 */
+		void runPooled(const std::string &name, const LuaEnvironment &env, const Engine::PoolHandle &pool, std::optional<Engine::Deadline> deadline);
+
+		/**
+		 * @brief Runs the environments `[first, last)` of a batch on a
+		 * state of the pool that is already checked out, loading the
+		 * chunk once and resetting the state before every item
+		 */
+		void runBatchInState(Engine::StatePool &pool, Engine::LuaState &state, const std::string &name, const std::vector<LuaEnvironment> &envs, size_t first, size_t last, BatchResult &result);
+
 	public:
 
 		/**
@@ -252,6 +374,65 @@ namespace LuaCpp {
 		void CompileFile(const std::string &name, const std::string &fname, bool recompile);
 
 
+		/**
+		 * @brief Adds compiled Lua code from a buffer to the registry
+		 *
+		 * @details
+		 * The code is not copied: the snippet refers to the buffer,
+		 * which must hold a chunk produced by `lua_dump` (e.g. a memory
+		 * mapped file or a shared buffer), and keeps `owner` alive. If
+		 * the buffer outlives the context, `owner` can be empty.
+		 *
+		 * @param name Name under which the snippet is registered in the registry
+		 * @param data Start of the compiled code
+		 * @param size Size of the compiled code
+		 * @param owner Keeps the buffer alive as long as the snippet is used
+		 * @param replace if set to true, the new code will replace the old in the registry
+		 */
+		void AddCompiledBuffer(const std::string &name, const char *data, size_t size, std::shared_ptr<const void> owner = nullptr, bool replace = false);
+
+		/**
+		 * @brief Mounts a bundle of compiled snippets
+		 *
+		 * @details
+		 * All snippets of the bundle (see Registry::SnippetBundle) are
+		 * added to the registry in one step and are loaded straight from
+		 * the memory mapped file. Bundles are produced with the
+		 * `luacpp_bundle` tool.
+		 *
+		 * @see Registry::LuaRegistry::MountBundle()
+		 *
+		 * @param path Path of the bundle
+		 * @param replace if set to `true` existing snippets are replaced
+		 *
+		 * @return number of snippets added
+		 */
+		size_t MountBundle(const std::string &path, bool replace = false);
+
+		/**
+		 * @brief Removes the snippets of a mounted bundle in one step
+		 *
+		 * @see Registry::LuaRegistry::UnmountBundle()
+		 *
+		 * @param path Path the bundle was mounted from
+		 *
+		 * @return number of snippets removed
+		 */
+		size_t UnmountBundle(const std::string &path);
+
+		/**
+		 * @brief Sets the on-disk cache of compiled code
+		 *
+		 * @details
+		 * CompileFile() and CompileFolder() take the code of files whose
+		 * content did not change from the cache instead of compiling it
+		 * again, and store newly compiled files in it. `nullptr` disables
+		 * the cache.
+		 *
+		 * @param cache The cache, e.g. `std::make_shared<BytecodeCache>("/var/cache/app")`
+		 */
+		void setBytecodeCache(std::shared_ptr<Registry::BytecodeCache> cache);
+
 		/**
 		 * @brief Compiles all of the `.lua` files from the folder and adds them to the registry
 		 *
@@ -352,6 +533,34 @@ namespace LuaCpp {
 		 * @param recompile If true, the file will be added to registry even if it already exits under the name.
 		 */
 		void CompileFolder(const std::string &path, const std::string &prefix, bool recompile);
+
+		/**
+		 * @brief Compiles the `.lua` files of a folder in parallel and adds them to the registry in one step
+		 *
+		 * @details
+		 * Works like CompileFolder(path, prefix, recompile) with the
+		 * following differences:
+		 *
+		 * - With `recursive` set, the sub-folders are scanned as well and
+		 *   their names become part of the snippet name. With the prefix
+		 *   `local`, the file `folder/file5.lua` from the example above is
+		 *   registered as `local.folder.file5`.
+		 * - The files are compiled by `parallelism` threads into a staging
+		 *   area. The compiled snippets are added to the registry together,
+		 *   so readers see either none or all of them.
+		 * - Files that fail to compile are listed in the returned report
+		 *   instead of being dropped silently. Two files mapping to the
+		 *   same name (e.g. `a.b.lua` and `a/b.lua`) are reported as well.
+		 *
+		 * Throws `std::filesystem::filesystem_error` if the folder can not
+		 * be read.
+		 *
+		 * @param path Path to the folder containing the `.lua` files
+		 * @param options Prefix, recursion, recompile and parallelism
+		 *
+		 * @return number of compiled and skipped files and the errors
+		 */
+		CompileReport CompileFolder(const std::string &path, const CompileFolderOptions &options);
 		
 		/**
 		 * @bried Compiles a code snippet and runs
@@ -408,6 +617,22 @@ namespace LuaCpp {
 		 */
 		void RunWithEnvironment(const std::string &name, const LuaEnvironment &env, std::optional<Engine::StateParams> params = std::nullopt);
 
+		/**
+		 * @brief Run a code snippet with a given `lua` global table and
+		 * stop it at a deadline
+		 *
+		 * @details
+		 * The run is watched by the shared LuaWatchdog, which only
+		 * touches the state if the deadline passes; the script then gets
+		 * an error at its next instruction.
+		 *
+		 * @param name Name under which the snippet is registered
+		 * @param env Environment variables for the execution
+		 * @param deadline Point in time at which the run is stopped
+		 * @throws Engine::LuaTimeoutException if the deadline passed
+		 */
+		void RunWithEnvironment(const std::string &name, const LuaEnvironment &env, Engine::Deadline deadline);
+
 		/**
 		* @brief Get a LUA standard library
 		*
@@ -510,6 +735,17 @@ namespace LuaCpp {
 
 		void registerHooks(LuaCpp::Engine::LuaState &L);
 
+		/**
+		 * @brief Returns the registry holding the compiled snippets
+		 *
+		 * @details
+		 * The registry is thread-safe; its snapshot and version can be
+		 * read while other threads compile or run snippets.
+		 */
+		const Registry::LuaRegistry& getRegistry() const {
+			return registry;
+		}
+
 		// =====================
 		// Pooling Methods
 		// =====================
@@ -531,11 +767,29 @@ namespace LuaCpp {
 		 * @details
 		 * Convenience method to get a pool by color name.
 		 *
+		 * @deprecated Nothing keeps the pool behind the reference
+		 * alive, so it dangles once another thread destroys the pool;
+		 * use getPoolHandle().
+		 *
 		 * @param color The pool color name
 		 * @return Reference to the StatePool
 		 */
 		Engine::StatePool& getPool(const std::string& color = "default");
 
+		/**
+		 * @brief Get a handle to a pool by color
+		 *
+		 * @details
+		 * Resolves the color once; the handle overloads of the pooled
+		 * methods then skip the color lookup and the manager lock.
+		 * The handle shares the ownership of the pool, so it stays
+		 * usable after the pool is destroyed.
+		 *
+		 * @param color The pool color name
+		 * @return Handle to the StatePool
+		 */
+		Engine::PoolHandle getPoolHandle(const std::string& color = "default");
+
 		/**
 		 * @brief Check if a pool exists
 		 *
@@ -551,24 +805,50 @@ namespace LuaCpp {
 		 * Creates a new pool with the specified configuration.
 		 * Throws if the pool already exists.
 		 *
+		 * @deprecated The reference dangles once another thread
+		 * destroys the pool; use createPoolHandle().
+		 *
 		 * @param color The pool color name
 		 * @param config The pool configuration
 		 * @return Reference to the created StatePool
 		 */
 		Engine::StatePool& createPool(const std::string& color, const Engine::PoolConfig& config);
 
+		/**
+		 * @brief Create a custom pool and get a handle to it
+		 *
+		 * @details
+		 * Creates a new pool with the specified configuration.
+		 * Throws if the pool already exists.
+		 *
+		 * @param color The pool color name
+		 * @param config The pool configuration
+		 * @return Handle to the created StatePool
+		 */
+		Engine::PoolHandle createPoolHandle(const std::string& color, const Engine::PoolConfig& config);
+
 		/**
 		 * @brief Run a snippet using a pooled state
 		 *
 		 * @details
 		 * Acquires a state from the specified pool, executes the snippet,
-		 * and returns the state to the pool automatically.
+		 * and returns the state to the pool automatically. If the pool is
+		 * exhausted, the call waits up to the pool's `exhaustionTimeoutMs`
+		 * for a state to be released before throwing PoolExhaustedException.
 		 *
 		 * @param name Name of the snippet to execute
 		 * @param color The pool color (default: "default")
 		 */
 		void RunPooled(const std::string& name, const std::string& color = "default");
 
+		/**
+		 * @brief Run a snippet using a state from the pool of a handle
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param pool Handle of the pool
+		 */
+		void RunPooled(const std::string& name, const Engine::PoolHandle& pool);
+
 		/**
 		 * @brief Run a snippet with environment using a pooled state
 		 *
@@ -576,12 +856,50 @@ namespace LuaCpp {
 		 * Acquires a state from the specified pool, executes the snippet
 		 * with the provided environment, and returns the state to the pool.
 		 *
+		 * The loaded closure of the snippet is cached in the pooled state,
+		 * so later runs on the same state skip `lua_load`. Recompiling the
+		 * snippet invalidates the cached closure.
+		 *
 		 * @param name Name of the snippet to execute
 		 * @param env Environment variables for the execution
 		 * @param color The pool color (default: "default")
 		 */
 		void RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const std::string& color = "default");
 
+		/**
+		 * @brief Run a snippet with environment using a state from the
+		 * pool of a handle
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param env Environment variables for the execution
+		 * @param pool Handle of the pool
+		 */
+		void RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const Engine::PoolHandle& pool);
+
+		/**
+		 * @brief Run a snippet with environment using a pooled state and
+		 * stop it at a deadline
+		 *
+		 * @details
+		 * A stopped run returns its state to the pool like any other
+		 * failed run.
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param env Environment variables for the execution
+		 * @param color The pool color
+		 * @param deadline Point in time at which the run is stopped
+		 * @throws Engine::LuaTimeoutException if the deadline passed
+		 */
+		void RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const std::string& color, Engine::Deadline deadline);
+
+		/**
+		 * @brief Run a snippet with environment using a state from the
+		 * pool of a handle and stop it at a deadline
+		 *
+		 * @throws Engine::LuaTimeoutException if the deadline passed
+		 */
+		void RunWithEnvironmentPooled(const std::string& name, const LuaEnvironment& env, const Engine::PoolHandle& pool, Engine::Deadline deadline);
+
 		/**
 		 * @brief Acquire a state from the pool for manual use
 		 *
@@ -594,6 +912,39 @@ namespace LuaCpp {
 		 */
 		std::unique_ptr<Engine::LuaState> AcquirePooledState(const std::string& color = "default");
 
+		/**
+		 * @brief Acquire a state from the pool, waiting up to a timeout
+		 *
+		 * @details
+		 * Same as AcquirePooledState(color), but if the pool is exhausted
+		 * the call blocks until a state is released or the timeout expires,
+		 * instead of using the pool's configured `exhaustionTimeoutMs`.
+		 * Waiting requires the pool to be thread-safe.
+		 *
+		 * @param color The pool color
+		 * @param timeout Maximum time to wait for a state
+		 * @return Unique pointer to the LuaState
+		 */
+		std::unique_ptr<Engine::LuaState> AcquirePooledState(const std::string& color, std::chrono::milliseconds timeout);
+
+		/**
+		 * @brief Acquire a state from the pool of a handle
+		 *
+		 * @param pool Handle of the pool
+		 * @return Unique pointer to the LuaState
+		 */
+		std::unique_ptr<Engine::LuaState> AcquirePooledState(const Engine::PoolHandle& pool);
+
+		/**
+		 * @brief Acquire a state from the pool of a handle, waiting up
+		 * to a timeout
+		 *
+		 * @param pool Handle of the pool
+		 * @param timeout Maximum time to wait for a state
+		 * @return Unique pointer to the LuaState
+		 */
+		std::unique_ptr<Engine::LuaState> AcquirePooledState(const Engine::PoolHandle& pool, std::chrono::milliseconds timeout);
+
 		/**
 		 * @brief Release a state back to the pool
 		 *
@@ -605,6 +956,14 @@ namespace LuaCpp {
 		 */
 		void ReleasePooledState(std::unique_ptr<Engine::LuaState> state, const std::string& color = "default");
 
+		/**
+		 * @brief Release a state back to the pool of a handle
+		 *
+		 * @param state The state to release
+		 * @param pool Handle of the pool
+		 */
+		void ReleasePooledState(std::unique_ptr<Engine::LuaState> state, const Engine::PoolHandle& pool);
+
 		/**
 		 * @brief Acquire a pooled state with RAII semantics
 		 *
@@ -616,6 +975,155 @@ namespace LuaCpp {
 		 * @return PooledState wrapper
 		 */
 		Engine::PooledState AcquirePooledStateRAII(const std::string& color = "default");
+
+		/**
+		 * @brief Acquire a pooled state with RAII semantics, waiting up to a timeout
+		 *
+		 * @param color The pool color
+		 * @param timeout Maximum time to wait for a state
+		 * @return PooledState wrapper
+		 */
+		Engine::PooledState AcquirePooledStateRAII(const std::string& color, std::chrono::milliseconds timeout);
+
+		/**
+		 * @brief Acquire a state from the pool of a handle with RAII semantics
+		 *
+		 * @param pool Handle of the pool
+		 * @return PooledState wrapper
+		 */
+		Engine::PooledState AcquirePooledStateRAII(const Engine::PoolHandle& pool);
+
+		/**
+		 * @brief Acquire a state from the pool of a handle with RAII
+		 * semantics, waiting up to a timeout
+		 *
+		 * @param pool Handle of the pool
+		 * @param timeout Maximum time to wait for a state
+		 * @return PooledState wrapper
+		 */
+		Engine::PooledState AcquirePooledStateRAII(const Engine::PoolHandle& pool, std::chrono::milliseconds timeout);
+
+		/**
+		 * @brief Get the executor of the asynchronous pooled runs
+		 *
+		 * @details
+		 * The executor belongs to the pool manager and is shared by all
+		 * colors. It is created on first use with the default
+		 * ExecutorConfig (one worker per CPU). The pools are used from
+		 * the worker threads, so the pool manager is switched to
+		 * thread-safe mode.
+		 *
+		 * @return Reference to the PoolExecutor
+		 */
+		Engine::PoolExecutor& getExecutor();
+
+		/**
+		 * @brief Replace the executor with one using the given configuration
+		 *
+		 * @details
+		 * The tasks queued on the previous executor are run before it
+		 * is stopped.
+		 *
+		 * @param config Number of workers, queue capacity and submit timeout
+		 */
+		void configureExecutor(const Engine::ExecutorConfig &config);
+
+		/**
+		 * @brief Run a snippet on a pooled state from a worker thread
+		 *
+		 * @details
+		 * Queues the run on the executor and returns at once. If the
+		 * queue is full the call throws ExecutorQueueFullException
+		 * (after the executor's `submitTimeoutMs`). The global
+		 * variables of the context are pushed into the state, but the
+		 * values the run leaves behind are not written back into them,
+		 * since runs of several workers would update the same objects.
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param color The pool color (default: "default")
+		 * @return future that completes with the run or with its error
+		 */
+		std::future<void> RunPooledAsync(const std::string &name, const std::string &color = "default");
+
+		/**
+		 * @brief Run a snippet with environment on a pooled state from
+		 * a worker thread
+		 *
+		 * @details
+		 * The environment objects are updated by the worker, so they
+		 * must not be used by another run at the same time.
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param env Environment variables for the execution
+		 * @param color The pool color (default: "default")
+		 * @return future that completes with the run or with its error
+		 */
+		std::future<void> RunPooledAsync(const std::string &name, const LuaEnvironment &env, const std::string &color = "default");
+
+		/**
+		 * @brief Run a snippet with environment on a pooled state from
+		 * a worker thread and call `done` when it finished
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param env Environment variables for the execution
+		 * @param color The pool color
+		 * @param done Called on the worker thread with `nullptr` or
+		 * the error of the run; must not throw
+		 */
+		void RunPooledAsync(const std::string &name, const LuaEnvironment &env, const std::string &color, std::function<void(std::exception_ptr)> done);
+
+		/**
+		 * @brief Run a snippet once for every environment on pooled
+		 * states
+		 *
+		 * @details
+		 * Acquires one state and pushes the chunk once, then runs it
+		 * for each environment in turn. An error in one item is
+		 * recorded in the result and the batch continues with the next
+		 * item. The state is reset between the items as it would be
+		 * between two pooled runs, so each item sees what
+		 * RunWithEnvironmentPooled() would show it under the pool's
+		 * `ResetMode`.
+		 *
+		 * With `parallelism` above one the batch is split into that
+		 * many contiguous slices and the extra slices run on their own
+		 * states in helper threads, which requires the pool manager to
+		 * be in thread-safe mode. A slice whose helper cannot get a state
+		 * without waiting is run by the calling thread afterwards. The
+		 * environments of different slices must not share objects.
+		 *
+		 * @param name Name of the snippet to execute
+		 * @param envs One environment per run
+		 * @param color The pool color (default: "default")
+		 * @param parallelism Number of states to spread the batch over
+		 * @return per-item outcome of the batch
+		 * @throws std::runtime_error if `parallelism` is above one and
+		 * the pool manager is not thread-safe
+		 */
+		BatchResult RunBatchPooled(const std::string &name, const std::vector<LuaEnvironment> &envs, const std::string &color = "default", size_t parallelism = 1);
+
+		/**
+		 * @brief Run a snippet once for every environment on states of
+		 * the handle's pool
+		 *
+		 * @see RunBatchPooled(const std::string&, const std::vector<LuaEnvironment>&, const std::string&, size_t)
+		 */
+		BatchResult RunBatchPooled(const std::string &name, const std::vector<LuaEnvironment> &envs, const Engine::PoolHandle &pool, size_t parallelism = 1);
+
+		/**
+		 * @brief Start a snippet as a task of a scheduler
+		 *
+		 * @details
+		 * The scheduler's state must have been created by this
+		 * context (newState() or a pool), so that the snippet's
+		 * libraries and built-ins are available. The task runs at the
+		 * scheduler's next runOnce().
+		 *
+		 * @param scheduler Scheduler to run the snippet on
+		 * @param name Name of the snippet
+		 * @return id of the new task
+		 */
+		Engine::LuaScheduler::TaskId SpawnTask(Engine::LuaScheduler &scheduler, const std::string &name);
 	};
 }
 
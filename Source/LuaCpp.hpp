@@ -38,8 +38,13 @@
 #include "Engine/LuaTNumber.hpp"
 #include "Engine/LuaTTable.hpp"
 #include "Engine/LuaTUserData.hpp"
+#include "Engine/LuaAllocator.hpp"
+#include "Engine/LuaScheduler.hpp"
+#include "Engine/LuaWatchdog.hpp"
 
 #include "Registry/LuaCompiler.hpp"
+#include "Registry/BytecodeCache.hpp"
+#include "Registry/SnippetBundle.hpp"
 #include "Registry/LuaRegistry.hpp"
 #include "Registry/LuaCodeSnippet.hpp"
 #include "Registry/LuaLibrary.hpp"
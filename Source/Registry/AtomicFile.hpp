@@ -0,0 +1,53 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_ATOMICFILE_HPP
+#define LUACPP_ATOMICFILE_HPP
+
+#include <string>
+#include <ostream>
+#include <functional>
+
+namespace LuaCpp {
+	namespace Registry {
+
+		/**
+		 * @brief Replaces the file at the path with the bytes the
+		 * writer puts into the stream
+		 *
+		 * @details
+		 * The writer fills a temporary file next to the path, which is
+		 * then renamed into place, so readers of other threads and
+		 * processes see either the old file or the complete new one.
+		 * The temporary file is removed if writing or renaming fails.
+		 *
+		 * @param path Path of the file to replace
+		 * @param write Writes the content of the file
+		 * @return `true` if the file was replaced
+		 */
+		bool WriteFileAtomically(const std::string &path, const std::function<void(std::ostream &)> &write);
+	}
+}
+
+#endif // LUACPP_ATOMICFILE_HPP
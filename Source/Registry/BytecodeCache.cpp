@@ -0,0 +1,181 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include "BytecodeCache.hpp"
+#include "AtomicFile.hpp"
+
+using namespace LuaCpp::Registry;
+
+namespace {
+	const char cacheMagic[8] = {'L', 'U', 'A', 'C', 'P', 'P', 'B', 'C'};
+	const uint32_t cacheFormat = 2;
+
+	/**
+	 * @brief Header in front of the chunk name, the source and the
+	 * compiled code of an entry
+	 */
+	struct CacheHeader {
+		char magic[8];
+		uint32_t format;
+		uint32_t luaVersion;
+		uint64_t key;
+		uint32_t options;
+		uint32_t nameSize;
+		uint64_t sourceSize;
+		uint64_t codeSize;
+		uint64_t checksum;
+	};
+
+	/**
+	 * @brief 64-bit FNV-1a, used for both the key and the checksum
+	 *
+	 * @details
+	 * Only picks the file of an entry; Load() compares the chunk name
+	 * and the source stored in the entry, so a colliding key is a miss.
+	 */
+	uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const unsigned char *bytes = (const unsigned char *) data;
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+}
+
+BytecodeCache::BytecodeCache(const std::string &directory)
+	: directory(directory), hits(0), misses(0), rejected(0)
+{
+	std::filesystem::create_directories(directory);
+}
+
+uint64_t BytecodeCache::Key(const std::string &chunkname, const std::string &source, int options) {
+	// Bytecode is only portable between builds with the same version
+	// and number types
+	const uint64_t build[] = {
+		(uint64_t) LUA_VERSION_NUM,
+		(uint64_t) sizeof(lua_Integer),
+		(uint64_t) sizeof(lua_Number),
+		(uint64_t) options,
+		(uint64_t) chunkname.size(),
+	};
+	uint64_t hash = fnv1a(build, sizeof(build));
+	hash = fnv1a(chunkname.data(), chunkname.size(), hash);
+	return fnv1a(source.data(), source.size(), hash);
+}
+
+std::string BytecodeCache::pathOf(uint64_t key) const {
+	char file[32];
+	std::snprintf(file, sizeof(file), "%016llx.luac", (unsigned long long) key);
+	return (std::filesystem::path(directory) / file).string();
+}
+
+std::unique_ptr<LuaCodeSnippet> BytecodeCache::Load(const std::string &chunkname, const std::string &source, int options) {
+	uint64_t key = Key(chunkname, source, options);
+	std::ifstream in(pathOf(key), std::ios::binary);
+	if (!in) {
+		misses++;
+		return nullptr;
+	}
+	auto entry = std::make_shared<std::vector<char>>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+	CacheHeader header;
+	size_t prefix = sizeof(header) + chunkname.size() + source.size();
+	bool valid = entry->size() >= prefix;
+	if (valid) {
+		std::memcpy(&header, entry->data(), sizeof(header));
+		const char *stored = entry->data() + sizeof(header);
+		const char *code = entry->data() + prefix;
+		size_t size = entry->size() - prefix;
+		size_t signature = sizeof(LUA_SIGNATURE) - 1;
+		valid = std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0
+			&& header.format == cacheFormat
+			&& header.luaVersion == LUA_VERSION_NUM
+			&& header.key == key
+			&& header.options == (uint32_t) options
+			&& header.nameSize == chunkname.size()
+			&& header.sourceSize == source.size()
+			&& header.codeSize == size
+			&& std::memcmp(stored, chunkname.data(), chunkname.size()) == 0
+			&& std::memcmp(stored + chunkname.size(), source.data(), source.size()) == 0
+			&& size >= signature
+			&& std::memcmp(code, LUA_SIGNATURE, signature) == 0
+			&& header.checksum == fnv1a(code, size);
+	}
+	if (!valid) {
+		rejected++;
+		misses++;
+		return nullptr;
+	}
+
+	hits++;
+	const char *code = entry->data() + prefix;
+	size_t size = entry->size() - prefix;
+	return LuaCodeSnippet::FromBuffer(chunkname, code, size, std::move(entry));
+}
+
+bool BytecodeCache::Store(const std::string &chunkname, const std::string &source, int options, const LuaCodeSnippet &snippet) {
+	CacheHeader header;
+	std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.format = cacheFormat;
+	header.luaVersion = LUA_VERSION_NUM;
+	header.key = Key(chunkname, source, options);
+	header.options = (uint32_t) options;
+	header.nameSize = (uint32_t) chunkname.size();
+	header.sourceSize = source.size();
+	header.codeSize = snippet.getSize();
+	header.checksum = fnv1a(snippet.getBuffer(), snippet.getSize());
+
+	std::string path = pathOf(header.key);
+	// Readers see either the old entry or the complete new one
+	return WriteFileAtomically(path, [&](std::ostream &out) {
+		out.write((const char *) &header, sizeof(header));
+		out.write(chunkname.data(), chunkname.size());
+		out.write(source.data(), source.size());
+		out.write(snippet.getBuffer(), snippet.getSize());
+	});
+}
+
+const std::string &BytecodeCache::getDirectory() const {
+	return directory;
+}
+
+uint64_t BytecodeCache::getHits() const {
+	return hits.load();
+}
+
+uint64_t BytecodeCache::getMisses() const {
+	return misses.load();
+}
+
+uint64_t BytecodeCache::getRejected() const {
+	return rejected.load();
+}
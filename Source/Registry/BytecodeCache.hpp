@@ -0,0 +1,159 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_BYTECODECACHE_HPP
+#define LUACPP_BYTECODECACHE_HPP
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "LuaCodeSnippet.hpp"
+
+namespace LuaCpp {
+	namespace Registry {
+
+		/**
+		 * @brief On-disk cache of compiled Lua code
+		 *
+		 * @details
+		 * Keeps the code compiled by the LuaCompiler in a directory, so
+		 * a restarted process does not have to parse unchanged files
+		 * again. An entry is stored in a file named after the key of the
+		 * source, which is a hash of the chunk name, the source bytes,
+		 * `LUA_VERSION_NUM`, the sizes of the Lua numbers and the compile
+		 * options. A changed file therefore maps to a new entry; stale
+		 * entries are never read, but are not removed either.
+		 *
+		 * Every entry starts with a header repeating the key and a
+		 * checksum of the compiled code, followed by the chunk name and
+		 * the source the code was compiled from. Load() compares both
+		 * with the ones asked for, so two sources with the same key
+		 * never share their code. Entries that do not match are treated
+		 * as misses and overwritten by the next Store().
+		 *
+		 * The cache can be shared by threads and by processes; entries
+		 * are written to a temporary file and renamed into place.
+		 */
+		class BytecodeCache {
+		    private:
+			/**
+			 * @brief Directory holding the entries
+			 */
+			std::string directory;
+
+			std::atomic<uint64_t> hits;
+			std::atomic<uint64_t> misses;
+			std::atomic<uint64_t> rejected;
+
+			/**
+			 * @brief Path of the entry with the key
+			 */
+			std::string pathOf(uint64_t key) const;
+
+		    public:
+			/**
+			 * @brief Creates a cache over the directory
+			 *
+			 * @details
+			 * The directory is created if it does not exist. Throws
+			 * `std::filesystem::filesystem_error` if that fails.
+			 *
+			 * @param directory Directory holding the entries
+			 */
+			explicit BytecodeCache(const std::string &directory);
+
+			~BytecodeCache() {}
+
+			/**
+			 * @brief Computes the key of a source
+			 *
+			 * @param chunkname Chunk name the code is compiled with
+			 * @param source Source bytes
+			 * @param options Compile options (the `strip` flag of `lua_dump`)
+			 *
+			 * @return the key of the entry
+			 */
+			static uint64_t Key(const std::string &chunkname, const std::string &source, int options);
+
+			/**
+			 * @brief Loads the compiled code of a source
+			 *
+			 * @details
+			 * The snippet refers to the buffer read from the entry, so the
+			 * code is not copied again. Returns `nullptr` if there is no
+			 * valid entry for the source.
+			 *
+			 * @param chunkname Chunk name the code is compiled with
+			 * @param source Source bytes
+			 * @param options Compile options (the `strip` flag of `lua_dump`)
+			 *
+			 * @return the compiled code, or `nullptr`
+			 */
+			std::unique_ptr<LuaCodeSnippet> Load(const std::string &chunkname, const std::string &source, int options);
+
+			/**
+			 * @brief Stores the compiled code of a source
+			 *
+			 * @details
+			 * Failures to write the entry are not reported as errors, the
+			 * cache is only an optimization.
+			 *
+			 * @param chunkname Chunk name the code is compiled with
+			 * @param source Source bytes
+			 * @param options Compile options (the `strip` flag of `lua_dump`)
+			 * @param snippet The compiled code
+			 *
+			 * @return `true` if the entry was written
+			 */
+			bool Store(const std::string &chunkname, const std::string &source, int options, const LuaCodeSnippet &snippet);
+
+			/**
+			 * @brief Returns the directory holding the entries
+			 */
+			const std::string &getDirectory() const;
+
+			/**
+			 * @brief Number of Load() calls that found a valid entry
+			 */
+			uint64_t getHits() const;
+
+			/**
+			 * @brief Number of Load() calls that found no valid entry
+			 */
+			uint64_t getMisses() const;
+
+			/**
+			 * @brief Number of entries rejected by the header, source or checksum check
+			 *
+			 * @details
+			 * Rejected entries are also counted as misses.
+			 */
+			uint64_t getRejected() const;
+		};
+	}
+}
+
+#endif // LUACPP_BYTECODECACHE_HPP
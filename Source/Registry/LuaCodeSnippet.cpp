@@ -27,11 +27,23 @@
 using namespace LuaCpp::Registry;
 using namespace LuaCpp::Engine;
 
-LuaCodeSnippet::LuaCodeSnippet() : code() {
+LuaCodeSnippet::LuaCodeSnippet() : code(), external(nullptr), externalSize(0), owner(), generation(0) {
 	code.clear();
 }
 
+std::unique_ptr<LuaCodeSnippet> LuaCodeSnippet::FromBuffer(const std::string &name, const char *data, size_t size, std::shared_ptr<const void> owner) {
+	std::unique_ptr<LuaCodeSnippet> snippet = std::make_unique<LuaCodeSnippet>();
+	snippet->name = name;
+	snippet->external = data;
+	snippet->externalSize = size;
+	snippet->owner = std::move(owner);
+	return snippet;
+}
+
 int LuaCodeSnippet::WriteCode(unsigned char* buff, size_t size) {
+	if (external != nullptr) {
+		return 1;
+	}
 	unsigned char *end = (unsigned char *)buff+size;
 	try {
 		code.insert(code.end(),buff,end);
@@ -41,31 +53,38 @@ int LuaCodeSnippet::WriteCode(unsigned char* buff, size_t size) {
 	}
 }	
 
-int LuaCodeSnippet::getSize() {
-	return code.size();
+int LuaCodeSnippet::getSize() const {
+	return external != nullptr ? externalSize : code.size();
 }
 
 void LuaCodeSnippet::setName(std::string _name) {
 	name = std::move(_name);
 }
 
-std::string LuaCodeSnippet::getName() {
+std::string LuaCodeSnippet::getName() const {
 	return name;
 }
 
-const char *LuaCodeSnippet::getBuffer() {
-	return (const char *)&code[0];
+uint64_t LuaCodeSnippet::getGeneration() const {
+	return generation;
 }
 
-void LuaCodeSnippet::UploadCode(LuaState &L) {
-	lua_load(L, code_reader, this, (const char *)name.c_str(), NULL);
+void LuaCodeSnippet::setGeneration(uint64_t _generation) {
+	generation = _generation;
 }
 
-int code_writer (lua_State* L, const void* p, size_t size, void* u) {
-	return ((LuaCodeSnippet *) u)->WriteCode((unsigned char*)p, size);
+const char *LuaCodeSnippet::getBuffer() const {
+	return external != nullptr ? external : (const char *)code.data();
 }
 
-const char * code_reader (lua_State *L, void *data, size_t *size) {
-	*size = ((LuaCodeSnippet *)data)->getSize();
-	return ((LuaCodeSnippet *)data)->getBuffer();
+int LuaCodeSnippet::UploadCode(LuaState &L) const {
+	return LoadBuffer(L, getBuffer(), getSize(), name);
+}
+
+int LuaCodeSnippet::LoadBuffer(LuaState &L, const char *data, size_t size, const std::string &name) {
+	return luaL_loadbufferx(L, data, size, name.c_str(), "b");
+}
+
+int code_writer (lua_State* L, const void* p, size_t size, void* u) {
+	return ((LuaCodeSnippet *) u)->WriteCode((unsigned char*)p, size);
 }
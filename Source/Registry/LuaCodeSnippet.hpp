@@ -26,6 +26,8 @@
 #define LUACPP_LUACODESNIPPET_HPP
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdint>
 
 #include "../Lua.hpp"
 #include "../Engine/LuaState.hpp"
@@ -47,22 +49,6 @@ extern "C" {
 	 * @return 0 in case of sucess, non 0 in case of error.
 	 */
 	int code_writer (lua_State* L, const void* p, size_t size, void* u);
-
-	/**
-	 * @brief `C` helper function for reading the binary code from the snippet
-	 *
-	 * @details
-	 * `C` helper function that will read the code from the LuaCodeSnippet buffer
-	 * and will upload it to the virtual machine. The function implements the
-	 * `lua_Reader` interface.
-	 *
-	 * @param L Lua State (instance of a Lua virtual machine)
-	 * @param data Pointer to the LuaCodeSnippet
-	 * @param size Size of the buffer (returning)
-	 *
-	 * @return A pointer to a buffer cotainig the code snippet. 
-	 */
-	const char * code_reader (lua_State *L, void *data, size_t *size);
 }
 
 namespace LuaCpp {
@@ -106,6 +92,28 @@ namespace LuaCpp {
 				 */
 				std::vector<unsigned char> code;
 
+				/**
+				 * @brief Code kept outside of the snippet
+				 *
+				 * @details
+				 * Set by FromBuffer() for code that lives in an external
+				 * buffer (e.g. a memory mapped file); `owner` keeps that
+				 * buffer alive. When set, `code` stays empty.
+				 */
+				const char *external;
+				size_t externalSize;
+				std::shared_ptr<const void> owner;
+
+				/**
+				 * @brief Generation of the compiled code
+				 *
+				 * @details
+				 * Assigned by the LuaRegistry when the snippet is added
+				 * and unique for every compilation, so a recompiled
+				 * snippet never shares a generation with its old code.
+				 */
+				uint64_t generation;
+
 			public:
 				/**
 				 * @brief Default constructure that initializes the buffer
@@ -142,12 +150,49 @@ namespace LuaCpp {
 				 * @brief Uploads the code to the instace
 				 *
 				 * @details
-				 * Low level function that will upload the code to Lua virtual machine identified by the `lua_State`
-				 * with the use of the `C` helper functions.
+				 * Low level function that will upload the code to Lua virtual machine identified by the `lua_State`.
+				 * The buffer is handed to `luaL_loadbufferx` in binary mode in a single call, without copying it.
+				 * On success the loaded chunk is pushed on the stack, otherwise the error message.
+				 *
+				 * @param L Lua state (instance of Lua virtual machine)
+				 *
+				 * @return `LUA_OK`, or the error status of the load
+				 */
+				int UploadCode(Engine::LuaState &L) const;
+
+				/**
+				 * @brief Loads binary code from a buffer
+				 *
+				 * @details
+				 * Loads the compiled code in `[data, data + size)` with
+				 * `luaL_loadbufferx` in binary mode; text chunks are
+				 * rejected. The buffer is only read during the call.
 				 *
 				 * @param L Lua state (instance of Lua virtual machine)
+				 * @param data Start of the compiled code
+				 * @param size Size of the compiled code
+				 * @param name Chunk name used in error messages
+				 *
+				 * @return `LUA_OK`, or the error status of the load
 				 */
-				void UploadCode(Engine::LuaState &L);
+				static int LoadBuffer(Engine::LuaState &L, const char *data, size_t size, const std::string &name);
+
+				/**
+				 * @brief Creates a snippet for code in an external buffer
+				 *
+				 * @details
+				 * The snippet refers to the buffer instead of copying it;
+				 * `owner` is kept alive as long as the snippet, so it can
+				 * own a memory mapping or a shared buffer. Nothing can be
+				 * written to such a snippet.
+				 *
+				 * @param name Snippet name
+				 * @param data Start of the compiled code
+				 * @param size Size of the compiled code
+				 * @param owner Keeps the buffer alive, may be empty for
+				 * buffers that outlive the snippet
+				 */
+				static std::unique_ptr<LuaCodeSnippet> FromBuffer(const std::string &name, const char *data, size_t size, std::shared_ptr<const void> owner);
 
 				/**
 				 * @brief Returns the pointer to the continious memory block containing the binary code
@@ -156,7 +201,7 @@ namespace LuaCpp {
 				 * Returns a pointer to the continious memory block thet holds the binary representation
 				 * of the Lua code.
 				 */
-				const char *getBuffer();
+				const char *getBuffer() const;
 
 				/**
 				 * @brief Returns the total size of the code buffer
@@ -167,7 +212,7 @@ namespace LuaCpp {
 				 * @return
 				 * Size of the code buffer
 				 */
-				int getSize();
+				int getSize() const;
 
 				/**
 				 * @brief Returns the name of the code snippet
@@ -177,7 +222,7 @@ namespace LuaCpp {
 				 *
 				 * @return Snippet Name
 				 */
-				std::string getName();
+				std::string getName() const;
 
 				/**
 				 * @brief Sets the snippet name
@@ -188,6 +233,20 @@ namespace LuaCpp {
 				 * @param name Snippet name
 				 */
 				void setName(std::string name);
+
+				/**
+				 * @brief Returns the generation of the compiled code
+				 *
+				 * @return Generation, 0 if the snippet is not in a registry
+				 */
+				uint64_t getGeneration() const;
+
+				/**
+				 * @brief Sets the generation of the compiled code
+				 *
+				 * @param generation Generation assigned by the registry
+				 */
+				void setGeneration(uint64_t generation);
 		};
 	}
 }
@@ -23,6 +23,8 @@
    */
 #include <memory>
 #include <stdexcept>
+#include <fstream>
+#include <iterator>
 
 #include "LuaCompiler.hpp"
 #include "../Engine/LuaState.hpp"
@@ -30,6 +32,13 @@
 using namespace LuaCpp::Registry;
 using namespace LuaCpp::Engine;
 
+namespace {
+	/**
+	 * @brief `strip` flag passed to `lua_dump`, part of the cache key
+	 */
+	const int dumpStrip = 0;
+}
+
 void _checkErrorAndThrow(LuaState &L, int error) {
 	if (error != LUA_OK) {
 		switch (error) {
@@ -50,14 +59,22 @@ void _checkErrorAndThrow(LuaState &L, int error) {
 	}
 }
 
+LuaState &LuaCompiler::getState() {
+	if (!state) {
+		state = std::make_unique<LuaState>();
+	}
+	lua_settop(*state, 0);
+	return *state;
+}
+
 std::unique_ptr<LuaCodeSnippet> LuaCompiler::CompileString(std::string name, std::string code) {
 	std::unique_ptr<LuaCodeSnippet> cb_ptr = std::make_unique<LuaCodeSnippet>();
 
-	LuaState L;
+	LuaState &L = getState();
 	int res = luaL_loadstring(L.getState(), code.c_str());
 	_checkErrorAndThrow(L, res);
 
-	res = lua_dump(L.getState(), code_writer, (void*) cb_ptr.get(), 0);
+	res = lua_dump(L.getState(), code_writer, (void*) cb_ptr.get(), dumpStrip);
 	_checkErrorAndThrow(L, res);
 
 	cb_ptr->setName(name);
@@ -65,16 +82,52 @@ std::unique_ptr<LuaCodeSnippet> LuaCompiler::CompileString(std::string name, std
 }
 
 std::unique_ptr<LuaCodeSnippet> LuaCompiler::CompileFile(std::string name, std::string fname) {
+	if (cache) {
+		std::ifstream in(fname, std::ios::binary);
+		if (in) {
+			std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			return compileCached(name, "@" + fname, source);
+		}
+	}
+
 	std::unique_ptr<LuaCodeSnippet> cb_ptr = std::make_unique<LuaCodeSnippet>();
 
-	LuaState L;
+	LuaState &L = getState();
 	int res = luaL_loadfile(L, fname.c_str());
 	_checkErrorAndThrow(L, res);
 	
-	res = lua_dump(L, code_writer, (void*) cb_ptr.get(), 0);
+	res = lua_dump(L, code_writer, (void*) cb_ptr.get(), dumpStrip);
 	_checkErrorAndThrow(L, res);
 
 	cb_ptr->setName(name);
 	return cb_ptr;
 }
 
+
+std::unique_ptr<LuaCodeSnippet> LuaCompiler::compileCached(const std::string &name, const std::string &chunkname, const std::string &source) {
+	std::unique_ptr<LuaCodeSnippet> cb_ptr = cache->Load(chunkname, source, dumpStrip);
+	if (cb_ptr) {
+		cb_ptr->setName(name);
+		return cb_ptr;
+	}
+
+	// Skip the BOM and a `#` first line as luaL_loadfile does, keeping
+	// the line break so the line numbers stay the same
+	size_t start = source.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+	if (start < source.size() && source[start] == '#') {
+		size_t eol = source.find('\n', start);
+		start = eol == std::string::npos ? source.size() : eol;
+	}
+
+	cb_ptr = std::make_unique<LuaCodeSnippet>();
+	LuaState &L = getState();
+	int res = luaL_loadbufferx(L, source.data() + start, source.size() - start, chunkname.c_str(), nullptr);
+	_checkErrorAndThrow(L, res);
+
+	res = lua_dump(L, code_writer, (void*) cb_ptr.get(), dumpStrip);
+	_checkErrorAndThrow(L, res);
+
+	cache->Store(chunkname, source, dumpStrip, *cb_ptr);
+	cb_ptr->setName(name);
+	return cb_ptr;
+}
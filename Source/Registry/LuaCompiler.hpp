@@ -28,6 +28,8 @@
 #include <memory>
 
 #include "LuaCodeSnippet.hpp"
+#include "BytecodeCache.hpp"
+#include "../Engine/LuaState.hpp"
 
 namespace LuaCpp {
 	namespace Registry {
@@ -41,14 +43,51 @@ namespace LuaCpp {
 		 *
 		 * By compiling the code and storing it as a binary buffer, the
 		 * LuaCpp is improving the performance of the re-execution of the same code.
+		 *
+		 * The compiler creates one Lua state on the first compilation and
+		 * reuses it for the following ones, so a compiler instance must
+		 * not be used by two threads at the same time.
 		 */
 		class LuaCompiler {
+		    private:
+			/**
+			 * @brief State used to load the code, created on first use
+			 */
+			std::unique_ptr<Engine::LuaState> state;
+
+			/**
+			 * @brief On-disk cache used by CompileFile(), if any
+			 */
+			std::shared_ptr<BytecodeCache> cache;
+
+			/**
+			 * @brief Returns the state with an empty stack
+			 */
+			Engine::LuaState &getState();
+
+			/**
+			 * @brief Takes the code of a source from the cache, or
+			 * compiles and stores it
+			 */
+			std::unique_ptr<LuaCodeSnippet> compileCached(const std::string &name, const std::string &chunkname, const std::string &source);
 		    public:
 			/**
 			 * @brief Default constructor
 			 */
 			explicit LuaCompiler() {}
 
+			/**
+			 * @brief Creates a compiler using an on-disk cache
+			 *
+			 * @details
+			 * CompileFile() looks the file up in the cache before
+			 * compiling it and stores the compiled code on a miss.
+			 * `nullptr` disables the cache.
+			 *
+			 * @param cache The cache shared by the compilers
+			 */
+			explicit LuaCompiler(std::shared_ptr<BytecodeCache> cache) : cache(std::move(cache)) {}
+
 			/** 
 			 * @brief Default destructor
 			 */
@@ -73,6 +112,10 @@ namespace LuaCpp {
 			 * @details
 			 * Loads the file from the disk and compiles it in a lua binary code
 			 *
+			 * With a BytecodeCache the file is read once, and the code is
+			 * taken from the cache if the cache holds an entry for the same
+			 * content; otherwise the read content is compiled and stored.
+			 *
 			 * @param name Name of the generated LuaCodeSnippet
 			 * @param fname Name of the file 
 			 *
@@ -23,12 +23,148 @@
    */
 
 #include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
 
 #include "LuaRegistry.hpp"
 #include "LuaCompiler.hpp"
 
 
 using namespace LuaCpp::Registry;
+using namespace LuaCpp::Engine;
+
+namespace {
+	/**
+	 * @brief Source of snippet generations, shared by all registries
+	 */
+	std::atomic<uint64_t> nextGeneration{1};
+
+	/**
+	 * @brief Registry key of the chunk cache of a state
+	 *
+	 * @details
+	 * The cache table maps a generation (integer key) to the loaded
+	 * closure and a snippet name (string key) to the generation that
+	 * is currently cached for it. Key 0, which no generation uses,
+	 * holds the registry version the cache was last swept for.
+	 */
+	const char chunkCacheKey = 0;
+
+	/**
+	 * @brief Arguments of loadChunk()
+	 *
+	 * @details
+	 * Only plain pointers: a Lua error longjmps out of loadChunk(), past
+	 * anything it has on its stack.
+	 */
+	struct ChunkLoad {
+		const RegistrySnapshot *snapshot;
+		const char *name;
+		const char *chunkname;
+		const char *code;
+		size_t size;
+		lua_Integer generation;
+		int status;
+	};
+
+	/**
+	 * @brief Whether the generation is still the code registered
+	 * under the name
+	 *
+	 * @details
+	 * Called from sweepChunks(). It makes no Lua calls and keeps its
+	 * exceptions, so nothing unwinds through the Lua frames.
+	 */
+	bool isCurrent(const RegistrySnapshot *snapshot, const char *name, size_t size, lua_Integer generation) noexcept {
+		try {
+			auto it = snapshot->snippets.find(std::string(name, size));
+			return it != snapshot->snippets.end() && (lua_Integer) it->second->getGeneration() == generation;
+		} catch (...) {
+			// Keep the entry; the next sweep looks at it again
+			return true;
+		}
+	}
+
+	/**
+	 * @brief Drops the closures of snippets that were removed or
+	 * replaced since the registry version the cache was last swept for
+	 */
+	void sweepChunks(lua_State *L, int cache, const RegistrySnapshot *snapshot) {
+		lua_Integer version = (lua_Integer) snapshot->version;
+		lua_rawgeti(L, cache, 0);
+		bool swept = lua_tointeger(L, -1) == version;
+		lua_pop(L, 1);
+		if (swept) {
+			return;
+		}
+
+		// Clearing existing fields is allowed while traversing
+		lua_pushnil(L);
+		while (lua_next(L, cache) != 0) {
+			if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TNUMBER) {
+				size_t size = 0;
+				const char *name = lua_tolstring(L, -2, &size);
+				lua_Integer generation = lua_tointeger(L, -1);
+				if (!isCurrent(snapshot, name, size, generation)) {
+					lua_pushnil(L);
+					lua_rawseti(L, cache, generation);
+					lua_pushvalue(L, -2);
+					lua_pushnil(L);
+					lua_rawset(L, cache);
+				}
+			}
+			lua_pop(L, 1);
+		}
+
+		lua_pushinteger(L, version);
+		lua_rawseti(L, cache, 0);
+	}
+
+	/**
+	 * @brief Returns the cached closure of a snippet, loading and
+	 * caching it on a miss; returns the load error if it does not load
+	 */
+	int loadChunk(lua_State *L) {
+		ChunkLoad *load = (ChunkLoad *) lua_touserdata(L, 1);
+		lua_pop(L, 1);
+
+		if (lua_rawgetp(L, LUA_REGISTRYINDEX, &chunkCacheKey) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, &chunkCacheKey);
+		}
+		int cache = lua_gettop(L);
+		sweepChunks(L, cache, load->snapshot);
+
+		if (lua_rawgeti(L, cache, load->generation) == LUA_TFUNCTION) {
+			return 1;
+		}
+		lua_pop(L, 1);
+
+		load->status = luaL_loadbufferx(L, load->code, load->size, load->chunkname, "b");
+		if (load->status != LUA_OK) {
+			return 1;
+		}
+
+		// Drop the closure of the previous generation of this snippet
+		lua_pushstring(L, load->name);
+		if (lua_rawget(L, cache) == LUA_TNUMBER) {
+			lua_pushnil(L);
+			lua_rawseti(L, cache, lua_tointeger(L, -2));
+		}
+		lua_pop(L, 1);
+
+		lua_pushstring(L, load->name);
+		lua_pushinteger(L, load->generation);
+		lua_rawset(L, cache);
+
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, cache, load->generation);
+		return 1;
+	}
+}
 
 void LuaRegistry::CompileAndAddString(const std::string &name, const std::string &code) {
 	CompileAndAddString(name, code, false);
@@ -38,9 +174,9 @@ void LuaRegistry::CompileAndAddString(const std::string &name, const std::string
 
 	if ( !Exists(name) or recompile ) { 
 		LuaCompiler cmp;
-		std::unique_ptr<LuaCodeSnippet> snp = cmp.CompileString(name, code);
-
-		registry[name] = std::move(*snp);
+		SnippetBatch snippets;
+		snippets.emplace_back(name, cmp.CompileString(name, code));
+		add(std::move(snippets), recompile);
 	}
 }
 
@@ -51,13 +187,153 @@ void LuaRegistry::CompileAndAddFile(const std::string &name, const std::string &
 void LuaRegistry::CompileAndAddFile(const std::string &name, const std::string &fname, bool recompile) {
 
 	if ( !Exists(name) or recompile ) { 
-		LuaCompiler cmp;
-		std::unique_ptr<LuaCodeSnippet> snp = cmp.CompileFile(name, fname);
+		LuaCompiler cmp(getBytecodeCache());
+		SnippetBatch snippets;
+		snippets.emplace_back(name, cmp.CompileFile(name, fname));
+		add(std::move(snippets), recompile);
+	}
+}
+
+void LuaRegistry::checkSignature(const std::string &name, const LuaCodeSnippet &snippet) {
+	size_t signature = sizeof(LUA_SIGNATURE) - 1;
+	if ((size_t) snippet.getSize() < signature || std::memcmp(snippet.getBuffer(), LUA_SIGNATURE, signature) != 0) {
+		throw std::runtime_error("Error: The snippet is not compiled Lua code: " + name);
+	}
+}
+
+void LuaRegistry::AddSnippet(const std::string &name, std::unique_ptr<LuaCodeSnippet> snippet, bool replace) {
+	checkSignature(name, *snippet);
+	if ( !Exists(name) or replace ) {
+		SnippetBatch snippets;
+		snippets.emplace_back(name, std::move(snippet));
+		add(std::move(snippets), replace);
+	}
+}
+
+size_t LuaRegistry::AddSnippets(SnippetBatch snippets, bool replace) {
+	for (const auto &entry : snippets) {
+		checkSignature(entry.first, *entry.second);
+	}
+	return add(std::move(snippets), replace);
+}
+
+size_t LuaRegistry::add(SnippetBatch snippets, bool replace) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<const RegistrySnapshot> current = std::atomic_load(&registry);
+	auto next = std::make_shared<RegistrySnapshot>(*current);
 
-		registry[name] = std::move(*snp);
+	size_t added = insert(*next, snippets, replace);
+	if (added > 0) {
+		publish(*current, std::move(next));
 	}
+	return added;
 }
 
-std::unique_ptr<LuaCodeSnippet> LuaRegistry::getByName(const std::string &name) {
-	return std::make_unique<LuaCodeSnippet>(registry[name]);
-}
\ No newline at end of file
+size_t LuaRegistry::insert(RegistrySnapshot &next, SnippetBatch &snippets, bool replace) {
+	size_t added = 0;
+	for (auto &entry : snippets) {
+		if (!replace && next.snippets.find(entry.first) != next.snippets.end()) {
+			continue;
+		}
+		entry.second->setGeneration(nextGeneration.fetch_add(1));
+		next.snippets[entry.first] = std::move(entry.second);
+		added++;
+	}
+	return added;
+}
+
+void LuaRegistry::publish(const RegistrySnapshot &current, std::shared_ptr<RegistrySnapshot> next) {
+	next->version = current.version + 1;
+	std::atomic_store(&registry, std::shared_ptr<const RegistrySnapshot>(std::move(next)));
+}
+
+size_t LuaRegistry::MountBundle(const std::string &path, bool replace) {
+	std::shared_ptr<const SnippetBundle> bundle = SnippetBundle::Open(path);
+	SnippetBatch snippets;
+	for (size_t i = 0; i < bundle->getCount(); i++) {
+		snippets.emplace_back(bundle->getName(i), bundle->getSnippet(i));
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<const RegistrySnapshot> current = std::atomic_load(&registry);
+	if (current->bundles.find(path) != current->bundles.end()) {
+		throw std::runtime_error("Error: The bundle is already mounted: " + path);
+	}
+	auto next = std::make_shared<RegistrySnapshot>(*current);
+	size_t added = insert(*next, snippets, replace);
+	next->bundles[path] = bundle;
+	publish(*current, std::move(next));
+	return added;
+}
+
+size_t LuaRegistry::UnmountBundle(const std::string &path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<const RegistrySnapshot> current = std::atomic_load(&registry);
+	auto it = current->bundles.find(path);
+	if (it == current->bundles.end()) {
+		throw std::runtime_error("Error: The bundle is not mounted: " + path);
+	}
+	const SnippetBundle &bundle = *it->second;
+
+	auto next = std::make_shared<RegistrySnapshot>(*current);
+	size_t removed = 0;
+	for (auto snippet = next->snippets.begin(); snippet != next->snippets.end(); ) {
+		if (bundle.Owns(*snippet->second)) {
+			snippet = next->snippets.erase(snippet);
+			removed++;
+		} else {
+			++snippet;
+		}
+	}
+	next->bundles.erase(path);
+	publish(*current, std::move(next));
+	return removed;
+}
+
+void LuaRegistry::setBytecodeCache(std::shared_ptr<BytecodeCache> cache) {
+	std::atomic_store(&this->cache, std::move(cache));
+}
+
+std::shared_ptr<BytecodeCache> LuaRegistry::getBytecodeCache() const {
+	return std::atomic_load(&cache);
+}
+
+std::shared_ptr<const RegistrySnapshot> LuaRegistry::getSnapshot() const {
+	return std::atomic_load(&registry);
+}
+
+uint64_t LuaRegistry::getVersion() const {
+	return getSnapshot()->version;
+}
+
+bool LuaRegistry::Exists(const std::string &name) const {
+	std::shared_ptr<const RegistrySnapshot> snapshot = getSnapshot();
+	return snapshot->snippets.find(name) != snapshot->snippets.end();
+}
+
+std::shared_ptr<const LuaCodeSnippet> LuaRegistry::getByName(const std::string &name) const {
+	std::shared_ptr<const RegistrySnapshot> snapshot = getSnapshot();
+	auto it = snapshot->snippets.find(name);
+	if (it == snapshot->snippets.end()) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+	return it->second;
+}
+
+int LuaRegistry::PushCachedChunk(LuaState &L, const std::string &name) {
+	// Keeps the snippet alive even if it gets replaced while loading
+	std::shared_ptr<const RegistrySnapshot> snapshot = getSnapshot();
+	auto it = snapshot->snippets.find(name);
+	if (it == snapshot->snippets.end()) {
+		throw std::runtime_error("Error: The code snippet not found: " + name);
+	}
+	const std::shared_ptr<const LuaCodeSnippet> &current = it->second;
+	std::string chunkname = current->getName();
+	ChunkLoad load{snapshot.get(), name.c_str(), chunkname.c_str(), current->getBuffer(), (size_t) current->getSize(), (lua_Integer) current->getGeneration(), LUA_OK};
+
+	// The cache tables can fail to allocate under a memory limit
+	lua_pushcfunction(L, loadChunk);
+	lua_pushlightuserdata(L, &load);
+	int status = lua_pcall(L, 1, 1, 0);
+	return status != LUA_OK ? status : load.status;
+}
@@ -28,35 +28,139 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <cstdint>
 
 #include "../Lua.hpp"
 #include "LuaCodeSnippet.hpp"
+#include "BytecodeCache.hpp"
+#include "SnippetBundle.hpp"
 
 namespace LuaCpp {
 	namespace Registry {
 		
+		typedef std::map<std::string, std::shared_ptr<const LuaCodeSnippet>> SnippetTable;
+
+		/**
+		 * @brief Compiled snippets and the names to register them under
+		 */
+		typedef std::vector<std::pair<std::string, std::unique_ptr<LuaCodeSnippet>>> SnippetBatch;
+
+		/**
+		 * @brief Immutable view of the registry
+		 *
+		 * @details
+		 * `version` grows by one with every change of the registry.
+		 * `bundles` holds the mounted bundles by path.
+		 */
+		struct RegistrySnapshot final {
+			uint64_t version = 0;
+			SnippetTable snippets;
+			std::map<std::string, std::shared_ptr<const SnippetBundle>> bundles;
+		};
+
 		/**
 		 * @brief Registry containing the code snippets and customer libraries
 		 *
 		 * @details
 		 * The registry belongs to the LuaContext and holds the references to the
 		 * custom `C/C++` libraries and the code snippets. 
+		 *
+		 * The registry is thread-safe. Lookups work on an immutable
+		 * snapshot without locking, so snippets can be recompiled while
+		 * other threads run pooled states. A run that already looked up
+		 * a snippet finishes with the old code; the next lookup sees the
+		 * new generation.
 		 */
 		class LuaRegistry {
 		   private:
 			/**
-			 * @brief Map containing the code snippets
+			 * @brief Current snapshot of the code snippets
 			 *
 			 * @details
-			 * Map containing the code snippets. The key of the map is the 
-			 * name of the snippet under which it's registered in the 
-			 * registry.
+			 * The key of the map is the name of the snippet under which
+			 * it's registered in the registry. The snapshot is published
+			 * like the pool table of the PoolManager: readers load it
+			 * with `std::atomic_load` and never lock, writers compile
+			 * the code first, then copy the snapshot, change the copy and
+			 * store it back under `mutex`. The snippets are immutable
+			 * once registered; recompiling replaces the pointer, so a
+			 * snippet handed out by getByName() stays valid and unchanged.
+			 */
+			std::shared_ptr<const RegistrySnapshot> registry;
+			std::mutex mutex;
+
+			/**
+			 * @brief On-disk cache used when compiling files, if any
+			 */
+			std::shared_ptr<BytecodeCache> cache;
+
+			/**
+			 * @brief Assigns generations to compiled snippets and
+			 * publishes one snapshot containing all of them
+			 *
+			 * @details
+			 * Unless `replace` is set, a snippet is dropped if its
+			 * name got registered in the meantime.
+			 *
+			 * @return number of snippets added
+			 */
+			size_t add(SnippetBatch snippets, bool replace);
+
+			/**
+			 * @brief Moves the snippets into the copy of the snapshot
+			 *
+			 * @return number of snippets added
+			 */
+			static size_t insert(RegistrySnapshot &next, SnippetBatch &snippets, bool replace);
+
+			/**
+			 * @brief Publishes the changed copy of the snapshot with
+			 * the next version; called with `mutex` held
 			 */
-			std::map<std::string, LuaCodeSnippet> registry;
+			void publish(const RegistrySnapshot &current, std::shared_ptr<RegistrySnapshot> next);
+
+			/**
+			 * @brief Throws if the snippet does not hold compiled Lua code
+			 */
+			static void checkSignature(const std::string &name, const LuaCodeSnippet &snippet);
 		   public:
-			LuaRegistry() : registry() {};
+			LuaRegistry() : registry(std::make_shared<RegistrySnapshot>()) {};
 			~LuaRegistry() {} ; 
 
+			/**
+			 * @brief Returns the current snapshot of the registry
+			 *
+			 * @details
+			 * Lock free; the snapshot does not change, later changes of
+			 * the registry publish a new one.
+			 */
+			std::shared_ptr<const RegistrySnapshot> getSnapshot() const;
+
+			/**
+			 * @brief Returns the version of the current snapshot
+			 */
+			uint64_t getVersion() const;
+
+			/**
+			 * @brief Sets the on-disk cache used when compiling files
+			 *
+			 * @details
+			 * CompileAndAddFile() hands the cache to the LuaCompiler, so
+			 * unchanged files are loaded from the cache instead of being
+			 * compiled. `nullptr` disables the cache.
+			 *
+			 * @param cache The cache, or `nullptr`
+			 */
+			void setBytecodeCache(std::shared_ptr<BytecodeCache> cache);
+
+			/**
+			 * @brief Returns the on-disk cache, or `nullptr`
+			 */
+			std::shared_ptr<BytecodeCache> getBytecodeCache() const;
+
 			/**
 			 * @brief Compiles a string and adds it to the registry
 			 *
@@ -129,6 +233,84 @@ namespace LuaCpp {
 			 */
 			void CompileAndAddFile(const std::string &name, const std::string &fname, bool recompile);
 
+			/**
+			 * @brief Adds an already compiled snippet to the registry
+			 *
+			 * @details
+			 * Used for code that was compiled elsewhere, e.g. a snippet
+			 * created by LuaCodeSnippet::FromBuffer() over a memory
+			 * mapped file. Throws `std::runtime_error` if the buffer does
+			 * not hold a compiled Lua chunk.
+			 *
+			 * If the `replace` is set to false and a snippet with the
+			 * name already exists, the new snippet is ignored.
+			 *
+			 * @param name Name under which the code will be registered
+			 * @param snippet The compiled code
+			 * @param replace if set to `true` an existing snippet is replaced
+			 */
+			void AddSnippet(const std::string &name, std::unique_ptr<LuaCodeSnippet> snippet, bool replace);
+
+			/**
+			 * @brief Adds several compiled snippets in one step
+			 *
+			 * @details
+			 * All snippets become visible together in a single new
+			 * snapshot, so readers see either none or all of them.
+			 * Throws `std::runtime_error`, without adding anything, if
+			 * one of the buffers does not hold a compiled Lua chunk.
+			 *
+			 * If the `replace` is set to false, snippets whose name
+			 * already exists are ignored.
+			 *
+			 * @param snippets The compiled code and the names
+			 * @param replace if set to `true` existing snippets are replaced
+			 *
+			 * @return number of snippets added
+			 */
+			size_t AddSnippets(SnippetBatch snippets, bool replace);
+
+			/**
+			 * @brief Adds all snippets of a bundle file in one step
+			 *
+			 * @details
+			 * Maps the bundle with SnippetBundle::Open() and adds its
+			 * snippets without copying the code; they are loaded straight
+			 * from the mapping. The snippets and the bundle become visible
+			 * together in a single new snapshot. Throws
+			 * `std::runtime_error` if the bundle is invalid or the path is
+			 * already mounted.
+			 *
+			 * If the `replace` is set to false, snippets whose name
+			 * already exists are ignored.
+			 *
+			 * To upgrade a bundle, mount the new file with `replace` set
+			 * and unmount the old one; the names stay resolvable all the
+			 * time.
+			 *
+			 * @param path Path of the bundle
+			 * @param replace if set to `true` existing snippets are replaced
+			 *
+			 * @return number of snippets added
+			 */
+			size_t MountBundle(const std::string &path, bool replace);
+
+			/**
+			 * @brief Removes the snippets of a mounted bundle in one step
+			 *
+			 * @details
+			 * Removes the names whose snippet still comes from the bundle;
+			 * names replaced since the mount are kept. Runs that already
+			 * hold a snippet of the bundle keep the mapping alive until
+			 * they finish. Throws `std::runtime_error` if the path is not
+			 * mounted.
+			 *
+			 * @param path Path the bundle was mounted from
+			 *
+			 * @return number of snippets removed
+			 */
+			size_t UnmountBundle(const std::string &path);
+
 			/**
 			 * @brief Checks if the snippet exists in the registry
 			 *
@@ -139,20 +321,49 @@ namespace LuaCpp {
 			 *
 			 * @return `true` if the name exists in the registry
 			 */
-			bool inline Exists(const std::string &name) {
-				return !(registry.find( name ) == registry.end());
-			}
+			bool Exists(const std::string &name) const;
 			/**
 			 * @brief Returns the code snipet associated with the name
 			 *
 			 * @details
-			 * Returns the snippet associated with the name
+			 * Returns the snippet associated with the name without copying
+			 * the code; the registry and all callers share the same
+			 * immutable snippet. Throws `std::runtime_error` if no snippet
+			 * is registered under the name.
+			 *
+			 * @param name Name of the snippet
+			 *
+			 * @return shared_ptr to the LuaCodeSnippet associatd with the name
+			 */
+			std::shared_ptr<const LuaCodeSnippet> getByName(const std::string &name) const;
+
+			/**
+			 * @brief Pushes the loaded code of a snippet, reusing the closure cached in the state
+			 *
+			 * @details
+			 * Long lived states (e.g. pooled states) keep a cache of the
+			 * closures loaded from the registry in `LUA_REGISTRYINDEX`,
+			 * keyed by the generation of the snippet. On a hit the cached
+			 * closure is pushed with a single `lua_rawgeti`; on a miss the
+			 * code is uploaded with `UploadCode` and cached, replacing
+			 * the closure of an older generation of the same snippet.
+			 * The first call after the registry changed also drops the
+			 * closures of snippets that were removed or replaced since,
+			 * e.g. by UnmountBundle(), so the cache only holds current
+			 * code.
+			 *
+			 * If the code can not be loaded, the error is pushed instead
+			 * of the closure and nothing is cached. The loading runs in a
+			 * protected call, so running out of memory is reported the
+			 * same way instead of unwinding the caller.
 			 *
+			 * @param L Lua state (instance of Lua virtual machine)
 			 * @param name Name of the snippet
 			 *
-			 * @return unique_ptr to the LuaCodeSnippet associatd with the name
+			 * @return `LUA_OK` if the closure was pushed, otherwise the
+			 * status of the failed load with the error on the stack
 			 */
-			std::unique_ptr<LuaCodeSnippet> getByName(const std::string &name);
+			int PushCachedChunk(Engine::LuaState &L, const std::string &name);
 		};
 	}
 }
@@ -0,0 +1,235 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SnippetBundle.hpp"
+#include "AtomicFile.hpp"
+
+using namespace LuaCpp::Registry;
+
+namespace {
+	const char bundleMagic[8] = {'L', 'U', 'A', 'C', 'P', 'P', 'B', 'N'};
+	const uint32_t bundleFormat = 1;
+	const size_t codeAlignment = 16;
+
+	struct BundleHeader {
+		char magic[8];
+		uint32_t format;
+		uint32_t luaVersion;
+		uint64_t count;
+		uint64_t indexOffset;
+		uint64_t namesOffset;
+		uint64_t namesSize;
+		uint64_t fileSize;
+		uint64_t reserved;
+	};
+
+	struct BundleEntry {
+		uint64_t nameOffset;
+		uint64_t nameSize;
+		uint64_t codeOffset;
+		uint64_t codeSize;
+	};
+
+	size_t align(size_t offset) {
+		return (offset + codeAlignment - 1) / codeAlignment * codeAlignment;
+	}
+}
+
+SnippetBundle::SnippetBundle(const std::string &path, const char *data, size_t size)
+	: path(path), data(data), size(size), count(0), index(nullptr)
+{
+}
+
+SnippetBundle::~SnippetBundle() {
+	if (data != nullptr) {
+		munmap((void *) data, size);
+	}
+}
+
+std::shared_ptr<const SnippetBundle> SnippetBundle::Open(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Error: Can not open the bundle: " + path + ": " + std::strerror(errno));
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(BundleHeader)) {
+		close(fd);
+		throw std::runtime_error("Error: Invalid snippet bundle: " + path);
+	}
+
+	void *mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int error = errno;
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		throw std::runtime_error("Error: Can not map the bundle: " + path + ": " + std::strerror(error));
+	}
+
+	std::shared_ptr<SnippetBundle> bundle(new SnippetBundle(path, (const char *) mapping, (size_t) info.st_size));
+	bundle->validate();
+	return bundle;
+}
+
+void SnippetBundle::validate() {
+	BundleHeader header;
+	std::memcpy(&header, data, sizeof(header));
+
+	bool valid = std::memcmp(header.magic, bundleMagic, sizeof(bundleMagic)) == 0
+		&& header.format == bundleFormat
+		&& header.luaVersion == LUA_VERSION_NUM
+		&& header.fileSize == size
+		&& header.indexOffset % alignof(BundleEntry) == 0
+		&& header.indexOffset >= sizeof(header)
+		&& header.indexOffset <= size
+		&& header.count <= (size - header.indexOffset) / sizeof(BundleEntry)
+		&& header.namesOffset >= header.indexOffset + header.count * sizeof(BundleEntry)
+		&& header.namesOffset <= size
+		&& header.namesSize <= size - header.namesOffset;
+	if (!valid) {
+		throw std::runtime_error("Error: Invalid snippet bundle: " + path);
+	}
+	count = header.count;
+	index = data + header.indexOffset;
+
+	// Only the index is read here; the code pages are touched when loaded
+	// Offsets are compared before they are subtracted, so a corrupt
+	// entry can not wrap around
+	size_t signature = sizeof(LUA_SIGNATURE) - 1;
+	uint64_t namesEnd = header.namesOffset + header.namesSize;
+	std::string_view previous;
+	for (size_t i = 0; i < count; i++) {
+		const BundleEntry &entry = ((const BundleEntry *) index)[i];
+		valid = entry.nameOffset >= header.namesOffset
+			&& entry.nameOffset <= namesEnd
+			&& entry.nameSize <= namesEnd - entry.nameOffset
+			&& entry.codeOffset % codeAlignment == 0
+			&& entry.codeOffset >= namesEnd
+			&& entry.codeOffset <= size
+			&& entry.codeSize <= size - entry.codeOffset
+			&& entry.codeSize >= signature;
+		std::string_view name(data + entry.nameOffset, valid ? entry.nameSize : 0);
+		if (!valid || (i > 0 && !(previous < name))) {
+			throw std::runtime_error("Error: Invalid snippet bundle: " + path);
+		}
+		previous = name;
+	}
+}
+
+void SnippetBundle::Write(const std::string &path, const std::map<std::string, std::shared_ptr<const LuaCodeSnippet>> &snippets) {
+	BundleHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, bundleMagic, sizeof(bundleMagic));
+	header.format = bundleFormat;
+	header.luaVersion = LUA_VERSION_NUM;
+	header.count = snippets.size();
+	header.indexOffset = sizeof(header);
+	header.namesOffset = header.indexOffset + snippets.size() * sizeof(BundleEntry);
+
+	// The map is sorted by name, which is the order of the index
+	std::vector<BundleEntry> entries;
+	std::string names;
+	for (const auto &snippet : snippets) {
+		BundleEntry entry;
+		entry.nameOffset = header.namesOffset + names.size();
+		entry.nameSize = snippet.first.size();
+		entry.codeSize = snippet.second->getSize();
+		entries.push_back(entry);
+		names += snippet.first;
+	}
+	header.namesSize = names.size();
+
+	size_t offset = align(header.namesOffset + header.namesSize);
+	for (auto &entry : entries) {
+		entry.codeOffset = offset;
+		offset = align(offset + entry.codeSize);
+	}
+	header.fileSize = offset;
+
+	bool written = WriteFileAtomically(path, [&](std::ostream &out) {
+		out.write((const char *) &header, sizeof(header));
+		out.write((const char *) entries.data(), entries.size() * sizeof(BundleEntry));
+		out.write(names.data(), names.size());
+
+		const char padding[codeAlignment] = {0};
+		size_t end = header.namesOffset + header.namesSize;
+		size_t position = 0;
+		for (const auto &snippet : snippets) {
+			const BundleEntry &entry = entries[position++];
+			out.write(padding, entry.codeOffset - end);
+			out.write(snippet.second->getBuffer(), entry.codeSize);
+			end = entry.codeOffset + entry.codeSize;
+		}
+		out.write(padding, header.fileSize - end);
+	});
+	if (!written) {
+		throw std::runtime_error("Error: Can not write the bundle: " + path);
+	}
+}
+
+const std::string &SnippetBundle::getPath() const {
+	return path;
+}
+
+size_t SnippetBundle::getCount() const {
+	return count;
+}
+
+std::string SnippetBundle::getName(size_t position) const {
+	const BundleEntry &entry = ((const BundleEntry *) index)[position];
+	return std::string(data + entry.nameOffset, entry.nameSize);
+}
+
+std::unique_ptr<LuaCodeSnippet> SnippetBundle::getSnippet(size_t position) const {
+	const BundleEntry &entry = ((const BundleEntry *) index)[position];
+	return LuaCodeSnippet::FromBuffer(getName(position), data + entry.codeOffset, entry.codeSize, shared_from_this());
+}
+
+std::unique_ptr<LuaCodeSnippet> SnippetBundle::Find(const std::string &name) const {
+	const BundleEntry *first = (const BundleEntry *) index;
+	const BundleEntry *last = first + count;
+	const BundleEntry *it = std::lower_bound(first, last, std::string_view(name), [this](const BundleEntry &entry, std::string_view key) {
+		return std::string_view(data + entry.nameOffset, entry.nameSize) < key;
+	});
+	if (it == last || std::string_view(data + it->nameOffset, it->nameSize) != name) {
+		return nullptr;
+	}
+	return getSnippet(it - first);
+}
+
+bool SnippetBundle::Owns(const LuaCodeSnippet &snippet) const {
+	std::less<const char *> before;
+	const char *code = snippet.getBuffer();
+	return !before(code, data) && before(code, data + size);
+}
@@ -0,0 +1,156 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef LUACPP_SNIPPETBUNDLE_HPP
+#define LUACPP_SNIPPETBUNDLE_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <cstdint>
+
+#include "LuaCodeSnippet.hpp"
+
+namespace LuaCpp {
+	namespace Registry {
+
+		/**
+		 * @brief File holding many compiled snippets, mapped into memory
+		 *
+		 * @details
+		 * A bundle starts with a header, followed by an index of the
+		 * snippets sorted by name, the names and the compiled code of
+		 * the snippets, each aligned to 16 bytes:
+		 * ```
+		 *   header | index (name, code offset and size) | names | code | code | ...
+		 * ```
+		 * Open() maps the file read-only with `mmap` and checks the
+		 * header and the index; the code is only read when a snippet is
+		 * loaded. Snippets taken from the bundle refer to the mapping
+		 * and keep the bundle alive, so several processes mounting the
+		 * same bundle share its pages in the page cache.
+		 *
+		 * Bundles are written by Write() or by the `luacpp_bundle` tool
+		 * and are only valid for the Lua version they were written with.
+		 */
+		class SnippetBundle : public std::enable_shared_from_this<SnippetBundle> {
+		    private:
+			std::string path;
+
+			/**
+			 * @brief The mapping of the file
+			 */
+			const char *data;
+			size_t size;
+
+			/**
+			 * @brief Number of snippets and the start of the index
+			 */
+			size_t count;
+			const char *index;
+
+			SnippetBundle(const std::string &path, const char *data, size_t size);
+
+			/**
+			 * @brief Checks the header and the index, throws `std::runtime_error` if invalid
+			 */
+			void validate();
+
+		    public:
+			SnippetBundle(const SnippetBundle &) = delete;
+			SnippetBundle &operator=(const SnippetBundle &) = delete;
+
+			/**
+			 * @brief Unmaps the file
+			 */
+			~SnippetBundle();
+
+			/**
+			 * @brief Maps a bundle file into memory
+			 *
+			 * @details
+			 * Throws `std::runtime_error` if the file can not be mapped
+			 * or is not a valid bundle for this Lua version.
+			 *
+			 * @param path Path of the bundle
+			 *
+			 * @return the mapped bundle
+			 */
+			static std::shared_ptr<const SnippetBundle> Open(const std::string &path);
+
+			/**
+			 * @brief Writes the snippets to a bundle file
+			 *
+			 * @details
+			 * The file is written to a temporary file next to `path` and
+			 * renamed into place, so a process mapping the old bundle is
+			 * not affected. Throws `std::runtime_error` if the file can
+			 * not be written.
+			 *
+			 * @param path Path of the bundle
+			 * @param snippets The snippets by name, e.g. the snippets of a
+			 * LuaRegistry snapshot
+			 */
+			static void Write(const std::string &path, const std::map<std::string, std::shared_ptr<const LuaCodeSnippet>> &snippets);
+
+			/**
+			 * @brief Returns the path the bundle was opened from
+			 */
+			const std::string &getPath() const;
+
+			/**
+			 * @brief Returns the number of snippets in the bundle
+			 */
+			size_t getCount() const;
+
+			/**
+			 * @brief Returns the name of the snippet at the position of the index
+			 */
+			std::string getName(size_t position) const;
+
+			/**
+			 * @brief Returns the snippet at the position of the index
+			 *
+			 * @details
+			 * The snippet refers to the mapped code without copying it
+			 * and keeps the bundle alive.
+			 */
+			std::unique_ptr<LuaCodeSnippet> getSnippet(size_t position) const;
+
+			/**
+			 * @brief Looks a snippet up by name
+			 *
+			 * @return the snippet, or `nullptr` if the bundle does not hold the name
+			 */
+			std::unique_ptr<LuaCodeSnippet> Find(const std::string &name) const;
+
+			/**
+			 * @brief Checks if the code of the snippet lives in this bundle
+			 */
+			bool Owns(const LuaCodeSnippet &snippet) const;
+		};
+	}
+}
+
+#endif // LUACPP_SNIPPETBUNDLE_HPP
@@ -0,0 +1,110 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/*
+ * Bundle tool.
+ *
+ * Compiles a folder of `.lua` files recursively and writes the snippets
+ * to a bundle that can be mounted with LuaContext::MountBundle().
+ * The sub-folders become part of the snippet names, as with
+ * LuaContext::CompileFolder().
+ *
+ * Usage: luacpp_bundle [-p prefix] [-c cache_dir] [-j threads] <folder> <bundle>
+ */
+
+#include "../LuaCpp.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace LuaCpp;
+using namespace LuaCpp::Registry;
+
+static void usage(const char *program) {
+	std::cerr << "Usage: " << program << " [-p prefix] [-c cache_dir] [-j threads] <folder> <bundle>" << "\n";
+}
+
+int main(int argc, char **argv) {
+	CompileFolderOptions options = CompileFolderOptions().SetRecursive(true);
+	std::string cache;
+	std::string folder;
+	std::string bundle;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if ((arg == "-p" || arg == "-c" || arg == "-j") && i + 1 < argc) {
+			std::string value = argv[++i];
+			if (arg == "-p") {
+				options.SetPrefix(value);
+			} else if (arg == "-c") {
+				cache = value;
+			} else {
+				char *end = nullptr;
+				errno = 0;
+				unsigned long threads = std::strtoul(value.c_str(), &end, 10);
+				if (value.empty() || value[0] == '-' || *end != '\0' || errno == ERANGE) {
+					usage(argv[0]);
+					return 2;
+				}
+				options.SetParallelism(threads);
+			}
+		} else if (folder.empty()) {
+			folder = arg;
+		} else if (bundle.empty()) {
+			bundle = arg;
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (folder.empty() || bundle.empty()) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	try {
+		LuaContext ctx;
+		if (!cache.empty()) {
+			ctx.setBytecodeCache(std::make_shared<BytecodeCache>(cache));
+		}
+
+		CompileReport report = ctx.CompileFolder(folder, options);
+		for (const auto &error : report.errors) {
+			std::cerr << error.file << ": " << error.message << "\n";
+		}
+		if (!report.ok()) {
+			std::cerr << report.errors.size() << " file(s) failed, no bundle written" << "\n";
+			return 1;
+		}
+
+		SnippetBundle::Write(bundle, ctx.getRegistry().getSnapshot()->snippets);
+		std::cout << report.compiled << " snippet(s) written to " << bundle << "\n";
+	} catch (std::exception &e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+using namespace LuaCpp::Registry;
+
+class TestBytecodeCache : public ::testing::Test {
+protected:
+	virtual void SetUp() {
+		std::filesystem::remove_all("TestBytecodeCache_cache");
+		std::filesystem::remove_all("TestBytecodeCache_src");
+		std::filesystem::create_directories("TestBytecodeCache_src");
+		Write("TestBytecodeCache_src/answer.lua", "#!/usr/bin/env lua\nanswer = 42\nerror('line three')");
+	}
+
+	virtual void TearDown() {
+		std::filesystem::remove_all("TestBytecodeCache_cache");
+		std::filesystem::remove_all("TestBytecodeCache_src");
+	}
+
+	static void Write(const std::string &file, const std::string &content) {
+		std::ofstream(file, std::ofstream::out | std::ofstream::trunc) << content;
+	}
+
+	static std::vector<std::filesystem::path> Entries() {
+		std::vector<std::filesystem::path> entries;
+		for (const auto &entry : std::filesystem::directory_iterator("TestBytecodeCache_cache")) {
+			entries.push_back(entry.path());
+		}
+		return entries;
+	}
+
+	// Runs the snippet and returns the error it raised
+	static std::string RunError(LuaContext &ctx, const std::string &name) {
+		try {
+			ctx.Run(name);
+		} catch (std::runtime_error &e) {
+			return e.what();
+		}
+		return "";
+	}
+};
+
+TEST_F(TestBytecodeCache, CompileFileReusesTheCache) {
+	auto cold = std::make_shared<BytecodeCache>("TestBytecodeCache_cache");
+	LuaContext first;
+	first.setBytecodeCache(cold);
+	first.CompileFile("answer", "TestBytecodeCache_src/answer.lua");
+	EXPECT_EQ(0u, cold->getHits());
+	EXPECT_EQ(1u, cold->getMisses());
+	ASSERT_EQ(1u, Entries().size());
+
+	// A new process would start with a new cache over the same directory
+	auto warm = std::make_shared<BytecodeCache>("TestBytecodeCache_cache");
+	LuaContext second;
+	second.setBytecodeCache(warm);
+	second.CompileFile("answer", "TestBytecodeCache_src/answer.lua");
+	EXPECT_EQ(1u, warm->getHits());
+	EXPECT_EQ(0u, warm->getMisses());
+
+	// The `#` line is skipped without shifting the line numbers
+	std::string error = RunError(second, "answer");
+	EXPECT_NE(std::string::npos, error.find("answer.lua:3:")) << error;
+	EXPECT_EQ(RunError(first, "answer"), error);
+
+	LuaContext uncached;
+	uncached.CompileFile("answer", "TestBytecodeCache_src/answer.lua");
+	EXPECT_EQ(RunError(uncached, "answer"), error);
+}
+
+TEST_F(TestBytecodeCache, ChangedSourceMisses) {
+	auto cache = std::make_shared<BytecodeCache>("TestBytecodeCache_cache");
+	LuaContext ctx;
+	ctx.setBytecodeCache(cache);
+	ctx.CompileFile("answer", "TestBytecodeCache_src/answer.lua");
+
+	Write("TestBytecodeCache_src/answer.lua", "answer = 43");
+	ctx.CompileFile("answer", "TestBytecodeCache_src/answer.lua", true);
+	EXPECT_EQ(0u, cache->getHits());
+	EXPECT_EQ(2u, cache->getMisses());
+	EXPECT_EQ(2u, Entries().size());
+
+	std::unique_ptr<LuaState> L = ctx.newStateFor("answer");
+	ASSERT_EQ(LUA_OK, lua_pcall(*L, 0, 0, 0));
+	lua_getglobal(*L, "answer");
+	EXPECT_EQ(43, lua_tointeger(*L, -1));
+}
+
+TEST_F(TestBytecodeCache, CorruptEntryIsRejected) {
+	auto cache = std::make_shared<BytecodeCache>("TestBytecodeCache_cache");
+	LuaContext ctx;
+	ctx.setBytecodeCache(cache);
+	ctx.CompileFile("answer", "TestBytecodeCache_src/answer.lua");
+	ASSERT_EQ(1u, Entries().size());
+
+	// Flip the last byte of the compiled code
+	std::filesystem::path entry = Entries()[0];
+	std::fstream file(entry, std::ios::in | std::ios::out | std::ios::binary);
+	file.seekg(-1, std::ios::end);
+	char last = (char) file.get();
+	file.seekp(-1, std::ios::end);
+	file.put((char) ~last);
+	file.close();
+
+	ctx.CompileFile("answer", "TestBytecodeCache_src/answer.lua", true);
+	EXPECT_EQ(1u, cache->getRejected());
+	EXPECT_EQ(0u, cache->getHits());
+	EXPECT_NE(std::string::npos, RunError(ctx, "answer").find("line three"));
+
+	// The entry was written again
+	ctx.CompileFile("answer", "TestBytecodeCache_src/answer.lua", true);
+	EXPECT_EQ(1u, cache->getHits());
+	EXPECT_EQ(1u, Entries().size());
+}
+
+TEST_F(TestBytecodeCache, KeyCoversChunkNameAndOptions) {
+	uint64_t key = BytecodeCache::Key("@a.lua", "return 1", 0);
+	EXPECT_EQ(key, BytecodeCache::Key("@a.lua", "return 1", 0));
+	EXPECT_NE(key, BytecodeCache::Key("@b.lua", "return 1", 0));
+	EXPECT_NE(key, BytecodeCache::Key("@a.lua", "return 2", 0));
+	EXPECT_NE(key, BytecodeCache::Key("@a.lua", "return 1", 1));
+}
+
+TEST_F(TestBytecodeCache, CollidingKeyIsRejected) {
+	BytecodeCache cache("TestBytecodeCache_cache");
+	LuaCompiler compiler;
+	std::unique_ptr<LuaCodeSnippet> snippet = compiler.CompileString("first", "return 1");
+	ASSERT_TRUE(cache.Store("@a.lua", "return 1", 0, *snippet));
+	ASSERT_EQ(1u, Entries().size());
+
+	// Move the entry to the file and key of another source of the same size
+	uint64_t other = BytecodeCache::Key("@a.lua", "return 2", 0);
+	char file[32];
+	std::snprintf(file, sizeof(file), "%016llx.luac", (unsigned long long) other);
+	std::filesystem::path collision = std::filesystem::path("TestBytecodeCache_cache") / file;
+	std::filesystem::rename(Entries()[0], collision);
+	std::fstream entry(collision, std::ios::in | std::ios::out | std::ios::binary);
+	entry.seekp(16);
+	entry.write((const char *) &other, sizeof(other));
+	entry.close();
+
+	EXPECT_EQ(nullptr, cache.Load("@a.lua", "return 2", 0));
+	EXPECT_EQ(1u, cache.getRejected());
+	EXPECT_EQ(0u, cache.getHits());
+}
+
+TEST_F(TestBytecodeCache, CompileFolderUsesTheCache) {
+	Write("TestBytecodeCache_src/first.lua", "x = 1");
+	Write("TestBytecodeCache_src/second.lua", "x = 2");
+	Write("TestBytecodeCache_src/broken.lua", "while {}[1]");
+
+	auto cache = std::make_shared<BytecodeCache>("TestBytecodeCache_cache");
+	LuaContext ctx;
+	ctx.setBytecodeCache(cache);
+	CompileReport report = ctx.CompileFolder("TestBytecodeCache_src", CompileFolderOptions().SetParallelism(2));
+	EXPECT_EQ(3u, report.compiled);
+	EXPECT_EQ(1u, report.errors.size());
+	EXPECT_EQ(4u, cache->getMisses());
+	EXPECT_EQ(3u, Entries().size());
+
+	report = ctx.CompileFolder("TestBytecodeCache_src", CompileFolderOptions().SetRecompile(true).SetParallelism(2));
+	EXPECT_EQ(3u, report.compiled);
+	EXPECT_EQ(3u, cache->getHits());
+}
@@ -0,0 +1,285 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+class TestLuaAllocator : public ::testing::Test {
+protected:
+	void SetUp() override {
+	}
+
+	void TearDown() override {
+	}
+
+	int RunCode(lua_State* L, const char* code) {
+		int res = luaL_loadstring(L, code);
+		if (res == LUA_OK) {
+			res = lua_pcall(L, 0, LUA_MULTRET, 0);
+		}
+		return res;
+	}
+};
+
+TEST_F(TestLuaAllocator, SlabAllocatorReusesFreedBlocks) {
+	SlabAllocator allocator;
+
+	void* a = allocator.allocate(24);
+	void* b = allocator.allocate(24);
+	EXPECT_NE(nullptr, a);
+	EXPECT_NE(a, b);
+	EXPECT_EQ(1u, allocator.slabCount());
+	EXPECT_EQ(64u, allocator.smallBytesInUse());
+
+	allocator.deallocate(a, 24);
+	EXPECT_EQ(32u, allocator.smallBytesInUse());
+	EXPECT_EQ(a, allocator.allocate(20));
+
+	allocator.deallocate(a, 20);
+	allocator.deallocate(b, 24);
+	EXPECT_EQ(0u, allocator.smallBytesInUse());
+}
+
+TEST_F(TestLuaAllocator, SlabAllocatorReallocatesAcrossClasses) {
+	SlabAllocator allocator;
+
+	char* p = static_cast<char*>(allocator.reallocate(nullptr, 0, 10));
+	for (int i = 0; i < 10; i++) {
+		p[i] = static_cast<char>(i);
+	}
+
+	// Same size class keeps the block
+	EXPECT_EQ(p, allocator.reallocate(p, 10, 16));
+
+	char* q = static_cast<char*>(allocator.reallocate(p, 16, 100));
+	char* r = static_cast<char*>(allocator.reallocate(q, 100, 1000));
+	for (int i = 0; i < 10; i++) {
+		EXPECT_EQ(static_cast<char>(i), r[i]);
+	}
+	EXPECT_EQ(0u, allocator.smallBytesInUse());
+
+	EXPECT_EQ(nullptr, allocator.reallocate(r, 1000, 0));
+}
+
+TEST_F(TestLuaAllocator, SlabAllocatorShrinksWithoutFreeSlabs) {
+	SlabAllocator allocator(2);
+
+	void* a = allocator.allocate(24);
+	char* small = static_cast<char*>(allocator.allocate(100));
+	char* large = static_cast<char*>(allocator.allocate(200));
+	ASSERT_NE(nullptr, small);
+	small[0] = 'x';
+	large[0] = 'y';
+	EXPECT_EQ(2u, allocator.slabCount());
+	EXPECT_EQ(144u, allocator.smallBytesInUse());
+
+	// No slab left for a new size class: growing fails...
+	EXPECT_EQ(nullptr, allocator.reallocate(a, 24, 60));
+
+	// ...but shrinking keeps the block instead
+	EXPECT_EQ(small, allocator.reallocate(small, 100, 40));
+	EXPECT_EQ(large, allocator.reallocate(large, 200, 10));
+	EXPECT_EQ('x', small[0]);
+	EXPECT_EQ('y', large[0]);
+	EXPECT_EQ(96u, allocator.smallBytesInUse());
+
+	allocator.deallocate(large, 10);
+	allocator.deallocate(small, 40);
+	allocator.deallocate(a, 24);
+	EXPECT_EQ(0u, allocator.smallBytesInUse());
+}
+
+TEST_F(TestLuaAllocator, SlabAllocatorAlignsBlocks) {
+	SlabAllocator allocator;
+	std::vector<void*> blocks;
+	for (size_t size = 1; size <= SlabAllocator::MaxSmallSize; size += 7) {
+		void* block = allocator.allocate(size);
+		EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(block) % alignof(std::max_align_t));
+		blocks.push_back(block);
+	}
+}
+
+TEST_F(TestLuaAllocator, StateWithSlabAllocatorRunsScripts) {
+	StateParams params = SlabAllocator::CreateParams();
+	SlabAllocator* allocator = static_cast<SlabAllocator*>(params.userData);
+
+	LuaState state(params);
+	luaL_openlibs(state);
+	ASSERT_EQ(0, luaL_dostring(state,
+		"local t = {}\n"
+		"for i = 1, 10000 do t[i] = { name = 'item' .. i } end\n"
+		"result = #t"));
+
+	lua_getglobal(state, "result");
+	EXPECT_EQ(10000, lua_tointeger(state, -1));
+	lua_pop(state, 1);
+	EXPECT_GT(allocator->smallBytesInUse(), 0u);
+	EXPECT_GT(allocator->slabCount(), 1u);
+}
+
+TEST_F(TestLuaAllocator, PoolUsesAllocatorFactory) {
+	size_t created = 0;
+	PoolConfig config;
+	config.maxSize = 2;
+	config.allocatorFactory = [&created]() {
+		created++;
+		return SlabAllocator::CreateParams();
+	};
+
+	StatePool pool("test", config);
+	auto state1 = pool.acquire();
+	auto state2 = pool.acquire();
+	EXPECT_EQ(2u, created);
+
+	void* ud = nullptr;
+	EXPECT_EQ(&SlabAllocator::Alloc, lua_getallocf(*state1, &ud));
+	EXPECT_NE(nullptr, ud);
+
+	ASSERT_EQ(0, luaL_dostring(*state1, "x = string.rep('a', 10)"));
+	pool.release(std::move(state1));
+	pool.release(std::move(state2));
+
+	auto again = pool.acquire();
+	EXPECT_EQ(2u, created);
+	pool.release(std::move(again));
+}
+
+TEST_F(TestLuaAllocator, NewStateWithSlabAllocator) {
+	LuaContext ctx;
+	std::unique_ptr<LuaState> L = ctx.newState(SlabAllocator::CreateParams());
+
+	ASSERT_EQ(0, luaL_dostring(*L, "result = _luacppversion ~= nil"));
+	lua_getglobal(*L, "result");
+	EXPECT_TRUE(lua_toboolean(*L, -1));
+	lua_pop(*L, 1);
+}
+
+TEST_F(TestLuaAllocator, MemoryLimitFailsAllocationsWithErrMem) {
+	StateParams params;
+	params.memoryLimitBytes = 256 * 1024;
+
+	LuaState state(params);
+	luaL_openlibs(state);
+
+	EXPECT_EQ(LUA_ERRMEM, RunCode(state, "big = string.rep('x', 1024 * 1024)"));
+	lua_settop(state, 0);
+
+	// The state stays usable after hitting the limit
+	ASSERT_EQ(0, luaL_dostring(state, "small = string.rep('x', 1024)"));
+	lua_getglobal(state, "small");
+	EXPECT_EQ(1024u, lua_rawlen(state, -1));
+	lua_pop(state, 1);
+}
+
+TEST_F(TestLuaAllocator, MemoryBudgetIsSharedAndReleased) {
+	auto budget = std::make_shared<MemoryBudget>(0);
+
+	StateParams params;
+	params.memoryBudget = budget;
+	{
+		LuaState state1(params);
+		luaL_openlibs(state1);
+		size_t one = budget->used();
+		EXPECT_GT(one, 0u);
+
+		LuaState state2(params);
+		luaL_openlibs(state2);
+		EXPECT_GT(budget->used(), one);
+	}
+	EXPECT_EQ(0u, budget->used());
+
+	MemoryBudget limited(100);
+	EXPECT_TRUE(limited.tryReserve(60));
+	EXPECT_FALSE(limited.tryReserve(60));
+	limited.release(60);
+	EXPECT_TRUE(limited.tryReserve(100));
+}
+
+TEST_F(TestLuaAllocator, AccountingWrapsCustomAllocator) {
+	StateParams params = SlabAllocator::CreateParams();
+	SlabAllocator* slab = static_cast<SlabAllocator*>(params.userData);
+	params.memoryLimitBytes = 256 * 1024;
+
+	LuaState state(params);
+	luaL_openlibs(state);
+	EXPECT_GT(slab->smallBytesInUse(), 0u);
+	EXPECT_EQ(LUA_ERRMEM, RunCode(state, "big = string.rep('x', 1024 * 1024)"));
+}
+
+TEST_F(TestLuaAllocator, PoolStatesHaveMemoryLimit) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.memoryLimitBytes = 256 * 1024;
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	EXPECT_EQ(LUA_ERRMEM, RunCode(*state, "big = string.rep('x', 1024 * 1024)"));
+	pool.release(std::move(state));
+
+	state = pool.acquire();
+	EXPECT_EQ(0, luaL_dostring(*state, "small = string.rep('x', 1024)"));
+	pool.release(std::move(state));
+}
+
+TEST_F(TestLuaAllocator, PoolMemoryBudgetLimitsAllStates) {
+	PoolConfig config;
+	config.maxSize = 10;
+
+	size_t perState = 0;
+	{
+		StatePool probe("probe", PoolConfig().SetPoolMemoryLimitBytes(SIZE_MAX));
+		probe.warmup(1);
+		perState = probe.getMetrics().memoryInUse;
+	}
+	ASSERT_GT(perState, 0u);
+
+	config.poolMemoryLimitBytes = perState * 2 + perState / 2;
+	StatePool pool("test", config);
+	auto state1 = pool.acquire();
+	auto state2 = pool.acquire();
+	EXPECT_THROW(pool.acquire(), std::runtime_error);
+	EXPECT_EQ(2u, pool.getCurrentSize());
+	EXPECT_LE(pool.getMetrics().memoryInUse, config.poolMemoryLimitBytes);
+
+	pool.release(std::move(state1));
+	pool.release(std::move(state2));
+	pool.drain();
+	EXPECT_EQ(0u, pool.getMemoryBudget()->used());
+}
+
+TEST_F(TestLuaAllocator, NewStateWithMemoryLimit) {
+	LuaContext ctx;
+	ctx.CompileString("big", "big = string.rep('x', 1024 * 1024)");
+
+	StateParams params;
+	params.memoryLimitBytes = 256 * 1024;
+	EXPECT_THROW(ctx.RunWithEnvironment("big", LuaEnvironment(), params), std::runtime_error);
+}
@@ -137,6 +137,64 @@ namespace LuaCpp {
 
 	}
 
-}
+	TEST_F(TestLuaCompiler, TestRegistrySharesSnippets) {
+		LuaRegistry registry;
+		registry.CompileAndAddString("shared", "x = 1");
+
+		std::shared_ptr<const LuaCodeSnippet> first = registry.getByName("shared");
+		std::shared_ptr<const LuaCodeSnippet> second = registry.getByName("shared");
+		EXPECT_EQ(first.get(), second.get());
+		EXPECT_EQ(first->getBuffer(), second->getBuffer());
+
+		// Recompiling replaces the snippet; the old one stays intact
+		registry.CompileAndAddString("shared", "x = 2", true);
+		std::shared_ptr<const LuaCodeSnippet> recompiled = registry.getByName("shared");
+		EXPECT_NE(first.get(), recompiled.get());
+		EXPECT_LT(first->getGeneration(), recompiled->getGeneration());
+		EXPECT_GT(first->getSize(), 0);
+
+		// A missing name is reported, not default-inserted
+		EXPECT_THROW(registry.getByName("missing"), std::runtime_error);
+		EXPECT_FALSE(registry.Exists("missing"));
+	}
+
+	TEST_F(TestLuaCompiler, TestLoadBufferIsBinaryOnly) {
+		LuaCompiler compiler;
+		std::unique_ptr<LuaCodeSnippet> snippet = compiler.CompileString("answer", "return 42");
 
+		LuaState L;
+		ASSERT_EQ(LUA_OK, snippet->UploadCode(L));
+		ASSERT_EQ(LUA_OK, lua_pcall(L, 0, 1, 0));
+		EXPECT_EQ(42, lua_tointeger(L, -1));
+		lua_settop(L, 0);
+
+		// Source text is refused by the binary-only load
+		std::string text = "return 42";
+		EXPECT_NE(LUA_OK, LuaCodeSnippet::LoadBuffer(L, text.data(), text.size(), "text"));
+		lua_settop(L, 0);
+
+		// A truncated chunk fails with a status instead of crashing
+		EXPECT_NE(LUA_OK, LuaCodeSnippet::LoadBuffer(L, snippet->getBuffer(), snippet->getSize() / 2, "truncated"));
+	}
 
+	TEST_F(TestLuaCompiler, TestAddCompiledBuffer) {
+		LuaCompiler compiler;
+		std::unique_ptr<LuaCodeSnippet> compiled = compiler.CompileString("external", "result = 'from buffer'");
+		auto buffer = std::make_shared<std::vector<char>>(compiled->getBuffer(), compiled->getBuffer() + compiled->getSize());
+
+		LuaContext ctx;
+		ctx.AddCompiledBuffer("external", buffer->data(), buffer->size(), buffer);
+		std::weak_ptr<std::vector<char>> watch = buffer;
+		buffer.reset();
+		EXPECT_FALSE(watch.expired());
+
+		std::unique_ptr<LuaState> L = ctx.newStateFor("external");
+		ASSERT_EQ(LUA_OK, lua_pcall(*L, 0, 0, 0));
+		lua_getglobal(*L, "result");
+		EXPECT_STREQ("from buffer", lua_tostring(*L, -1));
+
+		std::string text = "result = 1";
+		EXPECT_THROW(ctx.AddCompiledBuffer("text", text.data(), text.size()), std::runtime_error);
+	}
+
+}
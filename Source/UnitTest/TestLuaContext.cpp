@@ -23,6 +23,7 @@
    */
 
 #include <fstream>
+#include <filesystem>
 
 #include "../LuaCpp.hpp"
 #include "gtest/gtest.h"
@@ -182,6 +183,43 @@ namespace LuaCpp {
 		EXPECT_THROW(ctx.newStateFor("TestLuaContext_4_se"), std::runtime_error);
 	}
 
+	TEST_F(TestLuaContext, CompileFolderRecursive) {
+		std::filesystem::create_directories("TestLuaContext_tree/sub/deep");
+		std::ofstream("TestLuaContext_tree/a.lua") << "x = 'a'";
+		std::ofstream("TestLuaContext_tree/sub/b.lua") << "x = 'b'";
+		std::ofstream("TestLuaContext_tree/sub/deep/c.lua") << "x = 'c'";
+		std::ofstream("TestLuaContext_tree/sub/bad.lua") << "while {}[1]";
+		std::ofstream("TestLuaContext_tree/sub.b.lua") << "x = 'duplicate'";
+
+		LuaContext ctx;
+		ctx.CompileString("tree.a", "x = 'old'");
+		uint64_t version = ctx.getRegistry().getVersion();
+
+		CompileReport report = ctx.CompileFolder("TestLuaContext_tree", CompileFolderOptions().SetPrefix("tree").SetRecursive(true).SetParallelism(4));
+		EXPECT_FALSE(report.ok());
+		EXPECT_EQ(2u, report.compiled);
+		EXPECT_EQ(1u, report.skipped);
+		ASSERT_EQ(2u, report.errors.size());
+		EXPECT_EQ("tree.sub.b", report.errors[0].name);
+		EXPECT_EQ("tree.sub.bad", report.errors[1].name);
+		EXPECT_FALSE(report.errors[1].message.empty());
+
+		// The staged snippets are committed in a single step
+		EXPECT_EQ(version + 1, ctx.getRegistry().getVersion());
+		EXPECT_NO_THROW(ctx.newStateFor("tree.sub.b"));
+		EXPECT_NO_THROW(ctx.newStateFor("tree.sub.deep.c"));
+		EXPECT_FALSE(ctx.getRegistry().Exists("tree.sub.bad"));
+
+		// Without recursion `sub.b.lua` is the only file named `tree.sub.b`
+		report = ctx.CompileFolder("TestLuaContext_tree", CompileFolderOptions().SetPrefix("tree").SetRecompile(true));
+		EXPECT_TRUE(report.ok());
+		EXPECT_EQ(2u, report.compiled);
+		EXPECT_EQ(0u, report.skipped);
+
+		std::filesystem::remove_all("TestLuaContext_tree");
+		EXPECT_THROW(ctx.CompileFolder("TestLuaContext_tree", CompileFolderOptions()), std::filesystem::filesystem_error);
+	}
+
 
 
 	TEST_F(TestLuaContext, HelloWorldFromLuaString) {
@@ -22,11 +22,37 @@
    SOFTWARE.
    */
 
+#include <thread>
+#include <future>
+#include <filesystem>
+#include <map>
+
 #include "../LuaCpp.hpp"
 #include "gtest/gtest.h"
 
 using namespace LuaCpp;
 using namespace LuaCpp::Engine;
+using namespace LuaCpp::Registry;
+
+extern "C" {
+	static int answer(lua_State *L) {
+		lua_pushinteger(L, 42);
+		return 1;
+	}
+
+	static int twice(lua_State *L) {
+		lua_pushinteger(L, 2 * luaL_checkinteger(L, 1));
+		return 1;
+	}
+
+	static int hookCalls = 0;
+
+	static void countingHook(lua_State *L, lua_Debug *ar) {
+		(void)L;
+		(void)ar;
+		hookCalls++;
+	}
+}
 
 class TestLuaContextPooling : public ::testing::Test {
 protected:
@@ -279,6 +305,49 @@ TEST_F(TestLuaContextPooling, RunWithEnvironmentPooledRuntimeError) {
 	EXPECT_THROW(ctx.RunWithEnvironmentPooled("error_env", env), std::runtime_error);
 }
 
+TEST_F(TestLuaContextPooling, FailingEnvironmentIsReported) {
+	LuaContext ctx;
+	ctx.createPoolHandle("locked", PoolConfig().SetMaxSize(1));
+
+	// A light reset keeps the metatable, so the next run can not set globals
+	ctx.CompileString("lock", "setmetatable(_G, {__newindex = function() error('locked') end})");
+	ctx.CompileString("read", "result = value");
+	ctx.RunPooled("lock", "locked");
+
+	LuaEnvironment env;
+	env["value"] = std::make_shared<LuaTNumber>(1);
+	try {
+		ctx.RunWithEnvironmentPooled("read", env, "locked");
+		FAIL() << "The environment was set";
+	} catch (std::runtime_error& e) {
+		EXPECT_NE(std::string::npos, std::string(e.what()).find("locked")) << e.what();
+	}
+
+	// The state went back to the pool
+	EXPECT_EQ(0u, ctx.getPoolHandle("locked")->checkedOutCount());
+}
+
+TEST_F(TestLuaContextPooling, UnloadableSnippetIsReported) {
+	// Passes the signature check of the bundle, but does not load
+	std::string code = std::string(LUA_SIGNATURE) + "truncated";
+	std::map<std::string, std::shared_ptr<const LuaCodeSnippet>> snippets;
+	snippets["broken"] = LuaCodeSnippet::FromBuffer("broken", code.data(), code.size(), nullptr);
+	SnippetBundle::Write("TestLuaContextPooling.bundle", snippets);
+
+	LuaContext ctx;
+	ctx.MountBundle("TestLuaContextPooling.bundle");
+	std::filesystem::remove("TestLuaContextPooling.bundle");
+
+	try {
+		ctx.RunPooled("broken");
+		FAIL() << "The snippet ran";
+	} catch (std::runtime_error& e) {
+		EXPECT_NE(std::string::npos, std::string(e.what()).find("can not be loaded")) << e.what();
+	}
+	EXPECT_THROW(ctx.RunBatchPooled("broken", std::vector<LuaEnvironment>(2)), std::runtime_error);
+	EXPECT_EQ(0u, ctx.getPoolHandle()->checkedOutCount());
+}
+
 TEST_F(TestLuaContextPooling, MultiplePoolColors) {
 	LuaContext ctx;
 
@@ -302,3 +371,340 @@ TEST_F(TestLuaContextPooling, CustomPoolUsage) {
 	ctx.CompileString("math_op", "result = math.sqrt(100)");
 	EXPECT_NO_THROW(ctx.RunPooled("math_op", "math_only"));
 }
+
+TEST_F(TestLuaContextPooling, RunPooledWaitsForExhaustedPool) {
+	LuaContext ctx;
+
+	PoolConfig config;
+	config.maxSize = 1;
+	config.exhaustionTimeoutMs = 5000;
+
+	StatePool& pool = ctx.createPool("single", config);
+	pool.setThreadSafe(true);
+
+	ctx.CompileString("noop", "local x = 1");
+
+	auto held = ctx.AcquirePooledState("single");
+	std::thread releaser([&ctx, &pool, &held]() {
+		while (pool.waiterCount() == 0) {
+			std::this_thread::yield();
+		}
+		ctx.ReleasePooledState(std::move(held), "single");
+	});
+
+	EXPECT_NO_THROW(ctx.RunPooled("noop", "single"));
+	releaser.join();
+
+	EXPECT_EQ(1u, pool.getWaitStatistics().waits);
+	EXPECT_EQ(0u, pool.checkedOutCount());
+}
+
+TEST_F(TestLuaContextPooling, AcquirePooledStateWithTimeout) {
+	LuaContext ctx;
+
+	PoolConfig config;
+	config.maxSize = 1;
+
+	StatePool& pool = ctx.createPool("single", config);
+	pool.setThreadSafe(true);
+
+	auto held = ctx.AcquirePooledState("single");
+	EXPECT_THROW(ctx.AcquirePooledState("single", std::chrono::milliseconds(10)), PoolExhaustedException);
+	EXPECT_THROW(ctx.AcquirePooledStateRAII("single", std::chrono::milliseconds(10)), PoolExhaustedException);
+	EXPECT_EQ(2u, pool.getWaitStatistics().timeouts);
+
+	ctx.ReleasePooledState(std::move(held), "single");
+}
+
+TEST_F(TestLuaContextPooling, RunPooledReusesLoadedChunk) {
+	LuaContext ctx;
+	ctx.createPool("single", PoolConfig().SetMaxSize(1));
+
+	ctx.CompileString("probe",
+		"seen = seen or {}\n"
+		"local f = debug.getinfo(1, 'f').func\n"
+		"seen[f] = (seen[f] or 0) + 1");
+	ctx.RunPooled("probe", "single");
+	ctx.RunPooled("probe", "single");
+	ctx.RunPooled("probe", "single");
+
+	auto state = ctx.AcquirePooledState("single");
+	ASSERT_EQ(0, luaL_dostring(*state,
+		"local closures, runs = 0, 0\n"
+		"for _, n in pairs(seen) do closures = closures + 1; runs = runs + n end\n"
+		"return closures, runs"));
+	EXPECT_EQ(1, lua_tointeger(*state, -2));
+	EXPECT_EQ(3, lua_tointeger(*state, -1));
+	ctx.ReleasePooledState(std::move(state), "single");
+}
+
+TEST_F(TestLuaContextPooling, RecompileInvalidatesCachedChunk) {
+	LuaContext ctx;
+	ctx.createPool("single", PoolConfig().SetMaxSize(1));
+
+	ctx.CompileString("set", "value = 1");
+	ctx.RunPooled("set", "single");
+	ctx.CompileString("set", "value = 2", true);
+	ctx.RunPooled("set", "single");
+
+	auto state = ctx.AcquirePooledState("single");
+	lua_getglobal(*state, "value");
+	EXPECT_EQ(2, lua_tointeger(*state, -1));
+	lua_pop(*state, 1);
+	ctx.ReleasePooledState(std::move(state), "single");
+}
+
+TEST_F(TestLuaContextPooling, PoolHandleOverloads) {
+	LuaContext ctx;
+	PoolHandle handle = ctx.createPool("handled", PoolConfig().SetMaxSize(1));
+	EXPECT_TRUE(handle == ctx.getPoolHandle("handled"));
+	EXPECT_EQ(&ctx.getPool("handled"), handle.get());
+
+	ctx.CompileString("count", "counter = (counter or 0) + 1");
+	ctx.RunPooled("count", handle);
+	ctx.RunWithEnvironmentPooled("count", LuaEnvironment(), handle);
+
+	auto state = ctx.AcquirePooledState(handle);
+	lua_getglobal(*state, "counter");
+	EXPECT_EQ(2, lua_tointeger(*state, -1));
+	EXPECT_THROW(ctx.AcquirePooledState(handle, std::chrono::milliseconds(0)), PoolExhaustedException);
+	ctx.ReleasePooledState(std::move(state), handle);
+
+	{
+		PooledState pooled = ctx.AcquirePooledStateRAII(handle);
+		EXPECT_EQ(1u, handle->checkedOutCount());
+	}
+	EXPECT_EQ(0u, handle->checkedOutCount());
+}
+
+TEST_F(TestLuaContextPooling, PoolHandleIdentifiesRecreatedPool) {
+	LuaContext ctx;
+	PoolHandle first = ctx.createPool("tenant", PoolConfig());
+	ctx.getPoolManager().destroyPool("tenant");
+	PoolHandle second = ctx.createPool("tenant", PoolConfig());
+
+	EXPECT_TRUE(first != second);
+	EXPECT_FALSE(PoolHandle());
+	EXPECT_THROW(*PoolHandle(), std::runtime_error);
+}
+
+TEST_F(TestLuaContextPooling, PooledStatesInheritContextSetup) {
+	LuaContext ctx;
+	auto lib = std::make_shared<Registry::LuaLibrary>("deep");
+	lib->AddCFunction("answer", answer);
+	ctx.AddLibrary(lib);
+	ctx.setBuiltInFnc("twice", twice);
+
+	ctx.CompileString("use", "result = twice(deep.answer())");
+	ctx.RunPooled("use");
+
+	auto state = ctx.AcquirePooledState();
+	lua_getglobal(*state, "result");
+	EXPECT_EQ(84, lua_tointeger(*state, -1));
+	lua_getglobal(*state, "_luacppversion");
+	EXPECT_STREQ(LuaCpp::Version, lua_tostring(*state, -1));
+	ctx.ReleasePooledState(std::move(state));
+}
+
+TEST_F(TestLuaContextPooling, PoolsPickUpLibrariesAddedLater) {
+	LuaContext ctx;
+	StatePool& pool = ctx.createPool("late", PoolConfig().SetMaxSize(2).SetResetMode(ResetMode::Snapshot));
+	pool.warmup(2);
+
+	auto lib = std::make_shared<Registry::LuaLibrary>("deep");
+	lib->AddCFunction("answer", answer);
+	ctx.AddLibrary(lib);
+
+	// One state is updated in the background, the other on acquire
+	auto first = pool.acquire();
+	EXPECT_EQ(1u, pool.getMetrics().rebuilds);
+	EXPECT_EQ(0u, pool.maintain());
+	EXPECT_EQ(2u, pool.getMetrics().rebuilds);
+	pool.release(std::move(first));
+
+	ctx.CompileString("use", "result = deep.answer()");
+	for (int i = 0; i < 3; i++) {
+		EXPECT_NO_THROW(ctx.RunPooled("use", "late"));
+	}
+	EXPECT_EQ(2u, pool.getMetrics().creates);
+	EXPECT_EQ(2u, pool.getMetrics().rebuilds);
+}
+
+TEST_F(TestLuaContextPooling, PooledHooksSurviveRelease) {
+	LuaContext ctx;
+	ctx.addHook(countingHook, "call", 0);
+	ctx.createPool("hooked", PoolConfig().SetMaxSize(1));
+	ctx.CompileString("call", "local function f() end f()");
+
+	hookCalls = 0;
+	ctx.RunPooled("call", "hooked");
+	int firstRun = hookCalls;
+	EXPECT_GT(firstRun, 0);
+
+	ctx.RunPooled("call", "hooked");
+	EXPECT_EQ(2 * firstRun, hookCalls);
+}
+
+TEST_F(TestLuaContextPooling, RunPooledAsync) {
+	LuaContext ctx;
+	ctx.configureExecutor(ExecutorConfig().SetWorkers(2));
+	ctx.CompileString("inc", "counter = counter + 1");
+
+	auto counter = std::make_shared<LuaTNumber>(1);
+	LuaEnvironment env;
+	env["counter"] = counter;
+	ctx.RunPooledAsync("inc", env).get();
+	EXPECT_EQ(2, counter->getValue());
+
+	std::promise<std::exception_ptr> reported;
+	ctx.CompileString("fail", "error('async failure')");
+	ctx.RunPooledAsync("fail", LuaEnvironment(), "default", [&reported](std::exception_ptr error) {
+		reported.set_value(error);
+	});
+	EXPECT_TRUE(reported.get_future().get() != nullptr);
+
+	EXPECT_THROW(ctx.RunPooledAsync("missing"), std::runtime_error);
+	EXPECT_TRUE(ctx.getPoolManager().isThreadSafe());
+	EXPECT_EQ(2u, ctx.getExecutor().getMetrics().completed);
+}
+
+TEST_F(TestLuaContextPooling, RunPooledAsyncOnlyReadsGlobals) {
+	LuaContext ctx;
+	ctx.configureExecutor(ExecutorConfig().SetWorkers(4));
+	ctx.createPool("async", PoolConfig().SetMaxSize(4).SetExhaustionTimeoutMs(1000));
+	ctx.CompileString("bump", "if counter ~= 1 then error('unexpected counter') end counter = counter + 1");
+
+	auto counter = std::make_shared<LuaTNumber>(1);
+	ctx.AddGlobalVariable("counter", counter);
+
+	// The runs share the global object; none of them writes to it
+	std::vector<std::future<void>> runs;
+	for (int i = 0; i < 50; i++) {
+		runs.push_back(ctx.RunPooledAsync("bump", "async"));
+	}
+	for (auto& run : runs) {
+		EXPECT_NO_THROW(run.get());
+	}
+	EXPECT_EQ(1, counter->getValue());
+}
+
+TEST_F(TestLuaContextPooling, RunBatchPooled) {
+	LuaContext ctx;
+	ctx.CompileString("square", "if x < 0 then error('negative') end y = x * x");
+
+	std::vector<LuaEnvironment> envs(5);
+	for (size_t i = 0; i < envs.size(); i++) {
+		envs[i]["x"] = std::make_shared<LuaTNumber>(i == 2 ? -1 : (double) i);
+		envs[i]["y"] = std::make_shared<LuaTNumber>(0);
+	}
+
+	BatchResult result = ctx.RunBatchPooled("square", envs);
+	ASSERT_EQ(5u, result.items.size());
+	EXPECT_FALSE(result.ok());
+	EXPECT_EQ(1u, result.failed);
+	EXPECT_FALSE(result.items[2].success);
+	EXPECT_NE(std::string::npos, result.items[2].error.find("negative"));
+	EXPECT_EQ(16, std::static_pointer_cast<LuaTNumber>(envs[4]["y"])->getValue());
+
+	PoolMetricsSnapshot metrics = ctx.getPool("default").getMetrics();
+	EXPECT_EQ(1u, metrics.acquires);
+	EXPECT_EQ(1u, metrics.releases);
+	EXPECT_EQ(0u, ctx.getPool("default").checkedOutCount());
+
+	EXPECT_THROW(ctx.RunBatchPooled("missing", envs), std::runtime_error);
+	EXPECT_TRUE(ctx.RunBatchPooled("square", std::vector<LuaEnvironment>()).ok());
+}
+
+TEST_F(TestLuaContextPooling, BatchItemsAreIsolated) {
+	LuaContext ctx;
+	ctx.createPool("isolated", PoolConfig().SetMaxSize(1).SetResetMode(ResetMode::Snapshot));
+	ctx.CompileString("leak", "if leaked then error('leaked from an earlier item') end leaked = true y = x");
+
+	std::vector<LuaEnvironment> envs(5);
+	for (size_t i = 0; i < envs.size(); i++) {
+		envs[i]["x"] = std::make_shared<LuaTNumber>((double) i);
+		envs[i]["y"] = std::make_shared<LuaTNumber>(-1);
+	}
+
+	BatchResult result = ctx.RunBatchPooled("leak", envs, "isolated");
+	EXPECT_TRUE(result.ok());
+	for (size_t i = 0; i < envs.size(); i++) {
+		EXPECT_TRUE(result.items[i].success) << result.items[i].error;
+		EXPECT_EQ((double) i, std::static_pointer_cast<LuaTNumber>(envs[i]["y"])->getValue());
+	}
+}
+
+TEST_F(TestLuaContextPooling, BatchWriteBackErrorFailsOnlyItsItem) {
+	LuaContext ctx;
+	ctx.CompileString("retype", "if x == 1 then x = 'text' else x = x * 10 end");
+
+	std::vector<LuaEnvironment> envs(3);
+	for (size_t i = 0; i < envs.size(); i++) {
+		envs[i]["x"] = std::make_shared<LuaTNumber>((double) i);
+	}
+
+	BatchResult result = ctx.RunBatchPooled("retype", envs);
+	EXPECT_EQ(1u, result.failed);
+	EXPECT_TRUE(result.items[0].success);
+	EXPECT_FALSE(result.items[1].success);
+	EXPECT_NE(std::string::npos, result.items[1].error.find("LUA_TNUMBER"));
+	EXPECT_TRUE(result.items[2].success);
+	EXPECT_EQ(20, std::static_pointer_cast<LuaTNumber>(envs[2]["x"])->getValue());
+}
+
+TEST_F(TestLuaContextPooling, RunBatchPooledInParallel) {
+	LuaContext ctx;
+	ctx.createPool("batch", PoolConfig().SetMaxSize(2));
+	ctx.CompileString("double", "y = x * 2");
+
+	std::vector<LuaEnvironment> envs(100);
+	for (size_t i = 0; i < envs.size(); i++) {
+		envs[i]["x"] = std::make_shared<LuaTNumber>((double) i);
+		envs[i]["y"] = std::make_shared<LuaTNumber>(0);
+	}
+
+	// A parallel batch does not switch the manager on its own
+	EXPECT_THROW(ctx.RunBatchPooled("double", envs, "batch", 4), std::runtime_error);
+	EXPECT_FALSE(ctx.getPoolManager().isThreadSafe());
+	ctx.getPoolManager().setThreadSafe(true);
+
+	// Four slices on a pool of two states: the slices that find the
+	// pool exhausted are run by the calling thread
+	BatchResult result = ctx.RunBatchPooled("double", envs, "batch", 4);
+	EXPECT_TRUE(result.ok());
+	for (size_t i = 0; i < envs.size(); i++) {
+		EXPECT_EQ(2.0 * i, std::static_pointer_cast<LuaTNumber>(envs[i]["y"])->getValue());
+	}
+	EXPECT_EQ(0u, ctx.getPool("batch").checkedOutCount());
+}
+
+TEST_F(TestLuaContextPooling, RecompileWhileRunningPooled) {
+	LuaContext ctx;
+	ctx.configureExecutor(ExecutorConfig().SetWorkers(4));
+	ctx.CompileString("version", "y = 0");
+	uint64_t version = ctx.getRegistry().getVersion();
+
+	std::vector<LuaEnvironment> envs(200);
+	std::vector<std::future<void>> runs;
+	for (size_t i = 0; i < envs.size(); i++) {
+		envs[i]["y"] = std::make_shared<LuaTNumber>(-1);
+		runs.push_back(ctx.RunPooledAsync("version", envs[i]));
+		if (i % 4 == 0) {
+			ctx.CompileString("version", "y = " + std::to_string(i / 4 + 1), true);
+		}
+	}
+
+	// Every run sees one complete generation of the snippet
+	for (size_t i = 0; i < runs.size(); i++) {
+		EXPECT_NO_THROW(runs[i].get());
+		double y = std::static_pointer_cast<LuaTNumber>(envs[i]["y"])->getValue();
+		EXPECT_GE(y, 0);
+		EXPECT_LE(y, 50);
+	}
+	EXPECT_EQ(version + 50, ctx.getRegistry().getVersion());
+
+	LuaEnvironment env;
+	env["y"] = std::make_shared<LuaTNumber>(-1);
+	ctx.RunWithEnvironmentPooled("version", env);
+	EXPECT_EQ(50, std::static_pointer_cast<LuaTNumber>(env["y"])->getValue());
+}
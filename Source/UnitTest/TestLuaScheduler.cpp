@@ -0,0 +1,189 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <chrono>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+class TestLuaScheduler : public ::testing::Test {
+protected:
+	LuaContext ctx;
+	std::unique_ptr<LuaState> L;
+
+	void SetUp() override {
+		L = ctx.newState();
+	}
+
+	void Run(const char* code) {
+		ASSERT_EQ(LUA_OK, luaL_dostring(*L, code)) << lua_tostring(*L, -1);
+	}
+
+	std::string Global(const char* name) {
+		lua_getglobal(*L, name);
+		std::string value = lua_isstring(*L, -1) ? lua_tostring(*L, -1) : "";
+		lua_pop(*L, 1);
+		return value;
+	}
+};
+
+TEST_F(TestLuaScheduler, YieldInterleavesTasks) {
+	LuaScheduler scheduler(*L);
+	Run("trace = ''\n"
+	    "for _, name in ipairs({'a', 'b', 'c'}) do\n"
+	    "  scheduler.spawn(function(n)\n"
+	    "    for i = 1, 2 do trace = trace .. n .. i .. ' '; scheduler.yield() end\n"
+	    "  end, name)\n"
+	    "end");
+	EXPECT_EQ(3u, scheduler.readyCount());
+
+	scheduler.run();
+	EXPECT_EQ("a1 b1 c1 a2 b2 c2 ", Global("trace"));
+	EXPECT_EQ(3u, scheduler.completedCount());
+	// Nobody joined them, so their (empty) results are still kept
+	EXPECT_EQ(3u, scheduler.taskCount());
+}
+
+TEST_F(TestLuaScheduler, SleepersWakeInDeadlineOrder) {
+	// A small wheel makes the 30 ms sleeper go round it several times
+	LuaScheduler scheduler(*L, SchedulerConfig().SetWheelSlots(4));
+	Run("trace = ''\n"
+	    "for _, ms in ipairs({30, 10, 20}) do\n"
+	    "  scheduler.detach(scheduler.spawn(function() scheduler.sleep(ms); trace = trace .. ms .. ' ' end))\n"
+	    "end");
+
+	auto start = std::chrono::steady_clock::now();
+	scheduler.runOnce();
+	EXPECT_EQ(3u, scheduler.sleepingCount());
+
+	scheduler.run();
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(30));
+	EXPECT_EQ("10 20 30 ", Global("trace"));
+	EXPECT_EQ(0u, scheduler.sleepingCount());
+	EXPECT_EQ(0u, scheduler.taskCount());
+}
+
+TEST_F(TestLuaScheduler, JoinReturnsResultsOrError) {
+	LuaScheduler scheduler(*L);
+	Run("local worker = scheduler.spawn(function(a, b) scheduler.sleep(2); return a + b, 'done' end, 1, 2)\n"
+	    "local broken = scheduler.spawn(function() error('broken', 0) end)\n"
+	    "scheduler.spawn(function()\n"
+	    "  ok, sum, text = scheduler.join(worker)\n"
+	    "  failed, err = scheduler.join(broken)\n"
+	    "  before = scheduler.status(worker)\n"
+	    "end)");
+
+	scheduler.run();
+	Run("assert(ok == true and sum == 3 and text == 'done')\n"
+	    "assert(failed == false and err == 'broken')\n"
+	    "assert(before == nil)");
+	EXPECT_EQ(1u, scheduler.failedCount());
+	// Only the joining task itself is left
+	EXPECT_EQ(1u, scheduler.taskCount());
+}
+
+TEST_F(TestLuaScheduler, AwaitFromCpp) {
+	LuaScheduler scheduler(*L);
+	ASSERT_EQ(LUA_OK, luaL_loadstring(*L, "local n = ...; scheduler.sleep(1); return n * 2"));
+	lua_pushinteger(*L, 21);
+	auto id = scheduler.spawn(1);
+	EXPECT_EQ(TaskStatus::Ready, scheduler.getStatus(id));
+
+	ASSERT_EQ(1, scheduler.await(id));
+	EXPECT_EQ(42, lua_tointeger(*L, -1));
+	lua_pop(*L, 1);
+	EXPECT_EQ(TaskStatus::Unknown, scheduler.getStatus(id));
+
+	ASSERT_EQ(LUA_OK, luaL_loadstring(*L, "scheduler.yield(); error('failed', 0)"));
+	id = scheduler.spawn();
+	EXPECT_THROW(scheduler.await(id), std::runtime_error);
+	EXPECT_EQ(0u, scheduler.taskCount());
+	EXPECT_EQ(0, lua_gettop(*L));
+}
+
+TEST_F(TestLuaScheduler, BlockingCallsNeedATask) {
+	LuaScheduler scheduler(*L);
+	EXPECT_NE(LUA_OK, luaL_dostring(*L, "scheduler.sleep(1)"));
+	lua_settop(*L, 0);
+
+	// A coroutine inside a task is not the task itself
+	Run("scheduler.spawn(function()\n"
+	    "  inner = pcall(coroutine.wrap(function() scheduler.yield() end))\n"
+	    "  me = scheduler.self()\n"
+	    "end)");
+	scheduler.run();
+	Run("assert(inner == false and me == 1)");
+}
+
+TEST_F(TestLuaScheduler, KeptLibraryFailsAfterDestruction) {
+	{
+		LuaScheduler scheduler(*L);
+		Run("kept = scheduler");
+	}
+	Run("assert(scheduler == nil)");
+
+	ASSERT_NE(LUA_OK, luaL_dostring(*L, "kept.spawn(function() end)"));
+	EXPECT_NE(std::string::npos, std::string(lua_tostring(*L, -1)).find("destroyed"));
+	lua_settop(*L, 0);
+}
+
+TEST_F(TestLuaScheduler, ThousandsOfTasksInOneState) {
+	LuaScheduler scheduler(*L);
+	Run("collectgarbage(); collectgarbage()");
+	int before = lua_gc(*L, LUA_GCCOUNT, 0);
+
+	Run("done = 0\n"
+	    "for i = 1, 10000 do\n"
+	    "  scheduler.detach(scheduler.spawn(function() scheduler.sleep(1); done = done + 1 end))\n"
+	    "end");
+	scheduler.runOnce();
+	EXPECT_EQ(10000u, scheduler.sleepingCount());
+	Run("collectgarbage()");
+	int used = lua_gc(*L, LUA_GCCOUNT, 0) - before;
+	// Well below the size of a full state per task
+	EXPECT_LT(used, 10000 * 2);
+
+	scheduler.run();
+	EXPECT_EQ("10000", Global("done"));
+	EXPECT_EQ(0u, scheduler.taskCount());
+}
+
+TEST_F(TestLuaScheduler, SpawnSnippetFromContext) {
+	ctx.CompileString("task", "result = (result or 0) + 1; scheduler.yield(); return result");
+	L = ctx.newState();
+	LuaScheduler scheduler(*L);
+
+	auto first = ctx.SpawnTask(scheduler, "task");
+	auto second = ctx.SpawnTask(scheduler, "task");
+	ASSERT_EQ(1, scheduler.await(first));
+	ASSERT_EQ(1, scheduler.await(second));
+	EXPECT_EQ(2, lua_tointeger(*L, -1));
+	EXPECT_EQ(2, lua_tointeger(*L, -2));
+	lua_settop(*L, 0);
+
+	EXPECT_THROW(ctx.SpawnTask(scheduler, "missing"), std::runtime_error);
+}
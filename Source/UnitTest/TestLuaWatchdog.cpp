@@ -0,0 +1,116 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <chrono>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+extern "C" {
+	static void noopHook(lua_State*, lua_Debug*) {
+	}
+}
+
+class TestLuaWatchdog : public ::testing::Test {
+protected:
+	static Deadline In(int ms) {
+		return std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	}
+};
+
+TEST_F(TestLuaWatchdog, RunawayScriptTimesOut) {
+	LuaContext ctx;
+	ctx.CompileString("spin", "while true do end");
+
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_THROW(ctx.RunWithEnvironment("spin", LuaEnvironment(), In(20)), LuaTimeoutException);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+	EXPECT_EQ(0u, LuaWatchdog::shared().watchCount());
+}
+
+TEST_F(TestLuaWatchdog, PcallCannotSwallowTimeout) {
+	LuaContext ctx;
+	ctx.CompileString("stubborn", "while true do pcall(function() while true do end end) end");
+	EXPECT_THROW(ctx.RunWithEnvironment("stubborn", LuaEnvironment(), In(10)), LuaTimeoutException);
+}
+
+TEST_F(TestLuaWatchdog, ScriptErrorsAreNotTimeouts) {
+	LuaContext ctx;
+	ctx.CompileString("fail", "error('plain failure')");
+	try {
+		ctx.RunWithEnvironment("fail", LuaEnvironment(), In(10000));
+		FAIL() << "expected an error";
+	} catch (const LuaTimeoutException&) {
+		FAIL() << "a script error is not a timeout";
+	} catch (const std::runtime_error& e) {
+		EXPECT_NE(std::string::npos, std::string(e.what()).find("plain failure"));
+	}
+}
+
+TEST_F(TestLuaWatchdog, ArmedStateRunsWithoutHook) {
+	LuaState L;
+	LuaWatchdog watchdog;
+
+	uint64_t id = watchdog.arm(L, In(10000));
+	EXPECT_EQ(nullptr, lua_gethook(L));
+	EXPECT_EQ(0, luaL_dostring(L, "local x = 0 for i = 1, 1000 do x = x + i end"));
+	EXPECT_FALSE(watchdog.disarm(id));
+	EXPECT_EQ(0u, watchdog.watchCount());
+	EXPECT_EQ(0u, watchdog.firedCount());
+}
+
+TEST_F(TestLuaWatchdog, DisarmRestoresPreviousHook) {
+	LuaState L;
+	LuaWatchdog watchdog;
+	lua_sethook(L, noopHook, LUA_MASKCOUNT, 1000);
+
+	{
+		DeadlineGuard guard(L, In(5), watchdog);
+		EXPECT_NE(LUA_OK, luaL_dostring(L, "while true do end"));
+		EXPECT_TRUE(guard.disarm());
+	}
+	lua_settop(L, 0);
+
+	EXPECT_EQ(1u, watchdog.firedCount());
+	EXPECT_EQ(noopHook, lua_gethook(L));
+	EXPECT_EQ(LUA_MASKCOUNT, lua_gethookmask(L));
+	EXPECT_EQ(1000, lua_gethookcount(L));
+}
+
+TEST_F(TestLuaWatchdog, PooledRunTimesOutAndStateIsReused) {
+	LuaContext ctx;
+	ctx.CompileString("spin", "while true do end");
+	ctx.CompileString("quick", "done = true");
+
+	EXPECT_THROW(ctx.RunWithEnvironmentPooled("spin", LuaEnvironment(), "default", In(10)), LuaTimeoutException);
+	EXPECT_EQ(0u, ctx.getPool("default").checkedOutCount());
+
+	// The same state runs normally again, without the timeout hook
+	ctx.RunWithEnvironmentPooled("quick", LuaEnvironment(), "default", In(10000));
+	ctx.RunPooled("quick");
+	EXPECT_EQ(1u, ctx.getPool("default").getCurrentSize());
+}
@@ -0,0 +1,312 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <atomic>
+#include <thread>
+#include <future>
+#include <vector>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+
+class TestPoolExecutor : public ::testing::Test {
+protected:
+	std::shared_ptr<StatePool> MakePool(const PoolConfig& config) {
+		auto pool = std::make_shared<StatePool>("test", config);
+		pool->setThreadSafe(true);
+		return pool;
+	}
+
+	/**
+	 * @brief Occupies a worker until `gate` is set
+	 */
+	std::future<void> Block(PoolExecutor& executor, const PoolHandle& pool, std::shared_future<void> gate) {
+		return executor.submit(pool, [gate](LuaState&) {
+			gate.wait();
+		});
+	}
+};
+
+TEST_F(TestPoolExecutor, SubmitRunsTaskOnPooledState) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(2));
+	EXPECT_EQ(2u, executor.getWorkerCount());
+
+	auto done = executor.submit(PoolHandle(pool), [](LuaState& state) {
+		ASSERT_EQ(0, luaL_dostring(state, "answer = 42"));
+	});
+	done.get();
+
+	ExecutorMetricsSnapshot metrics = executor.getMetrics();
+	EXPECT_EQ(1u, metrics.submitted);
+	EXPECT_EQ(1u, metrics.completed);
+	EXPECT_EQ(0u, metrics.failed);
+	EXPECT_EQ(1u, metrics.queueTime.count);
+	EXPECT_EQ(1u, metrics.runTime.count);
+}
+
+TEST_F(TestPoolExecutor, ErrorsReachFutureAndCallback) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(1));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1));
+
+	auto failed = executor.submit(PoolHandle(pool), [](LuaState&) {
+		throw std::runtime_error("boom");
+	});
+	EXPECT_THROW(failed.get(), std::runtime_error);
+
+	std::promise<std::exception_ptr> reported;
+	executor.submit(PoolHandle(pool), [](LuaState&) {
+		throw std::logic_error("bad");
+	}, [&reported](std::exception_ptr error) {
+		reported.set_value(error);
+	});
+	EXPECT_TRUE(reported.get_future().get() != nullptr);
+	EXPECT_EQ(2u, executor.getMetrics().failed);
+}
+
+TEST_F(TestPoolExecutor, FullQueueRejectsTasks) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(1));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1).SetQueueCapacity(1));
+	PoolHandle handle(pool);
+
+	std::promise<void> open;
+	std::shared_future<void> gate = open.get_future().share();
+	auto blocked = Block(executor, handle, gate);
+	while (executor.getMetrics().running == 0) {
+		std::this_thread::yield();
+	}
+
+	auto queued = executor.submit(handle, [](LuaState&) {});
+	EXPECT_EQ(1u, executor.queueDepth());
+	EXPECT_THROW(executor.submit(handle, [](LuaState&) {}), ExecutorQueueFullException);
+	EXPECT_EQ(1u, executor.getMetrics().rejected);
+
+	open.set_value();
+	blocked.get();
+	queued.get();
+	EXPECT_EQ(0u, executor.queueDepth());
+}
+
+TEST_F(TestPoolExecutor, WorkerReusesReleasedState) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1));
+	PoolHandle handle(pool);
+
+	std::promise<void> open;
+	auto blocked = Block(executor, handle, open.get_future().share());
+
+	std::vector<lua_State*> seen(3, nullptr);
+	std::vector<std::future<void>> runs;
+	for (size_t i = 0; i < seen.size(); i++) {
+		runs.push_back(executor.submit(handle, [&seen, i](LuaState& state) {
+			seen[i] = state;
+		}));
+	}
+	open.set_value();
+	for (auto& run : runs) {
+		run.get();
+	}
+
+	EXPECT_EQ(seen[0], seen[1]);
+	EXPECT_EQ(seen[1], seen[2]);
+	// Every task acquires and releases the same state
+	EXPECT_EQ(1u, pool->getMetrics().creates);
+	EXPECT_EQ(4u, pool->getMetrics().acquires);
+	EXPECT_EQ(3u, pool->getMetrics().hits);
+
+	// The state goes back after every task
+	for (int i = 0; i < 1000 && pool->checkedOutCount() > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(0u, pool->checkedOutCount());
+}
+
+TEST_F(TestPoolExecutor, TasksWaitForBusyStates) {
+	// No exhaustion timeout: a plain acquire fails at once
+	auto pool = MakePool(PoolConfig().SetMaxSize(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(8));
+	PoolHandle handle(pool);
+
+	std::atomic<size_t> busy{0};
+	std::atomic<size_t> mostBusy{0};
+	std::vector<std::future<void>> runs;
+	for (int i = 0; i < 40; i++) {
+		runs.push_back(executor.submit(handle, [&busy, &mostBusy](LuaState&) {
+			size_t now = ++busy;
+			size_t seen = mostBusy.load();
+			while (now > seen && !mostBusy.compare_exchange_weak(seen, now)) {
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			busy--;
+		}));
+	}
+	for (auto& run : runs) {
+		EXPECT_NO_THROW(run.get());
+	}
+
+	EXPECT_EQ(0u, executor.getMetrics().failed);
+	EXPECT_LE(mostBusy.load(), 2u);
+	EXPECT_LE(pool->getMetrics().creates, 2u);
+}
+
+TEST_F(TestPoolExecutor, WorkerCachesOneStatePerColor) {
+	auto exports = MakePool(PoolConfig().SetMaxSize(2));
+	auto sandboxed = MakePool(PoolConfig().SetMaxSize(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1));
+
+	std::promise<void> open;
+	auto blocked = Block(executor, PoolHandle(exports), open.get_future().share());
+
+	// The "exports" state waits in the worker while it runs another color
+	size_t cachedDuringOther = 0;
+	auto other = executor.submit(PoolHandle(sandboxed), [&cachedDuringOther, &exports](LuaState&) {
+		cachedDuringOther = exports->threadCachedCount();
+	});
+	auto again = executor.submit(PoolHandle(exports), [](LuaState&) {});
+	open.set_value();
+	blocked.get();
+	other.get();
+	again.get();
+
+	EXPECT_EQ(1u, cachedDuringOther);
+	EXPECT_EQ(1u, exports->getMetrics().creates);
+
+	// Handed back once the worker is idle
+	for (int i = 0; i < 1000 && exports->threadCachedCount() + sandboxed->threadCachedCount() > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(0u, exports->threadCachedCount());
+	EXPECT_EQ(0u, sandboxed->threadCachedCount());
+	EXPECT_EQ(1u, exports->availableCount());
+}
+
+TEST_F(TestPoolExecutor, SnapshotStatesAreResetBeforeEachTask) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(1).SetResetMode(ResetMode::Snapshot));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1));
+	PoolHandle handle(pool);
+
+	std::vector<std::future<void>> runs;
+	for (int i = 0; i < 3; i++) {
+		runs.push_back(executor.submit(handle, [](LuaState& state) {
+			lua_getglobal(state, "leaked");
+			EXPECT_TRUE(lua_isnil(state, -1));
+			ASSERT_EQ(0, luaL_dostring(state, "leaked = true"));
+		}));
+	}
+	for (auto& run : runs) {
+		run.get();
+	}
+	for (int i = 0; i < 1000 && pool->checkedOutCount() > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(3u, pool->getMetrics().releases);
+}
+
+TEST_F(TestPoolExecutor, DestructorRunsQueuedTasks) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(1));
+	std::atomic<int> runs{0};
+	{
+		PoolExecutor executor(ExecutorConfig().SetWorkers(1).SetQueueCapacity(16));
+		for (int i = 0; i < 10; i++) {
+			executor.submit(PoolHandle(pool), [&runs](LuaState&) {
+				runs++;
+			});
+		}
+	}
+	EXPECT_EQ(10, runs.load());
+	EXPECT_EQ(0u, pool->checkedOutCount());
+}
+
+TEST_F(TestPoolExecutor, IdleWorkersStealQueuedTasks) {
+	auto pool = MakePool(PoolConfig().SetMaxSize(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(2));
+	PoolHandle handle(pool);
+
+	// Tasks submitted from a task land in its worker's own queue; that
+	// worker stays busy, so the other one has to steal them
+	std::promise<void> open;
+	std::shared_future<void> gate = open.get_future().share();
+	std::atomic<int> runs{0};
+	std::promise<void> queued;
+	auto parent = executor.submit(handle, [&](LuaState&) {
+		for (int i = 0; i < 20; i++) {
+			executor.submit(handle, [&runs](LuaState&) {
+				runs++;
+			});
+		}
+		queued.set_value();
+		gate.wait();
+	});
+	queued.get_future().wait();
+
+	for (int i = 0; i < 1000 && runs < 20; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(20, runs.load());
+	EXPECT_GE(executor.getMetrics().steals, 20u);
+
+	open.set_value();
+	parent.get();
+}
+
+TEST_F(TestPoolExecutor, EveryTaskGetsAResetState) {
+	auto sandboxed = MakePool(PoolConfig().SetMaxSize(2).SetResetMode(ResetMode::Snapshot));
+	auto io = MakePool(PoolConfig().SetMaxSize(2).SetMaxUsesPerState(2));
+	PoolExecutor executor(ExecutorConfig().SetWorkers(1));
+
+	std::promise<void> open;
+	auto blocked = Block(executor, PoolHandle(sandboxed), open.get_future().share());
+
+	std::vector<std::future<void>> runs;
+	std::vector<bool> leaked;
+	for (int i = 0; i < 3; i++) {
+		runs.push_back(executor.submit(PoolHandle(sandboxed), [&leaked](LuaState& L) {
+			lua_getglobal(L, "counter");
+			leaked.push_back(!lua_isnil(L, -1));
+			lua_pushinteger(L, 1);
+			lua_setglobal(L, "counter");
+		}));
+	}
+	for (int i = 0; i < 3; i++) {
+		runs.push_back(executor.submit(PoolHandle(io), [](LuaState&) {}));
+	}
+	open.set_value();
+	blocked.get();
+	for (auto& run : runs) {
+		run.get();
+	}
+
+	// Every task got a reset state
+	EXPECT_EQ(std::vector<bool>(3, false), leaked);
+	EXPECT_EQ(4u, sandboxed->getMetrics().acquires);
+	EXPECT_EQ(4u, sandboxed->getMetrics().releases);
+	EXPECT_EQ(1u, sandboxed->getMetrics().creates);
+
+	// The use limit still recycles the state
+	EXPECT_EQ(3u, io->getMetrics().acquires);
+	EXPECT_EQ(1u, io->getMetrics().recycledByUses);
+}
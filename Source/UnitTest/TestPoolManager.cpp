@@ -22,6 +22,11 @@
    SOFTWARE.
    */
 
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <future>
+
 #include "../LuaCpp.hpp"
 #include "gtest/gtest.h"
 #include "PoolTestUtils.hpp"
@@ -253,3 +258,161 @@ TEST_F(TestPoolManager, ThreadSafeListPools) {
 	auto pools = manager.listPools();
 	EXPECT_EQ(4u, pools.size());
 }
+
+TEST_F(TestPoolManager, SnapshotMetricsCoversAllPools) {
+	PoolManager manager;
+	manager.createPool("custom", PoolConfig().SetMaxSize(1));
+
+	StatePool& pool = manager.getPool("custom");
+	pool.release(pool.acquire());
+	pool.release(pool.acquire());
+
+	auto metrics = manager.snapshotMetrics();
+	EXPECT_EQ(5u, metrics.size());
+	ASSERT_EQ(1u, metrics.count("custom"));
+
+	const PoolMetricsSnapshot& custom = metrics["custom"];
+	EXPECT_EQ("custom", custom.color);
+	EXPECT_EQ(2u, custom.acquires);
+	EXPECT_EQ(1u, custom.hits);
+	EXPECT_EQ(1u, custom.creates);
+	EXPECT_EQ(2u, custom.releases);
+	EXPECT_EQ(1u, custom.available);
+
+	EXPECT_EQ(0u, metrics["default"].acquires);
+}
+
+TEST_F(TestPoolManager, MaintenanceThreadEvictsIdleStates) {
+	PoolManager manager;
+	StatePool& pool = manager.createPool("custom", PoolConfig().SetMaxSize(3).SetIdleTimeoutMs(10));
+	pool.warmup(3);
+
+	manager.startMaintenance(std::chrono::milliseconds(5));
+	EXPECT_TRUE(manager.isMaintenanceRunning());
+	EXPECT_TRUE(manager.isThreadSafe());
+
+	for (int i = 0; i < 200 && pool.getCurrentSize() > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	manager.stopMaintenance();
+
+	EXPECT_FALSE(manager.isMaintenanceRunning());
+	EXPECT_EQ(0u, pool.getCurrentSize());
+	EXPECT_EQ(3u, pool.getMetrics().evictions);
+}
+
+TEST_F(TestPoolManager, DestroyedPoolLivesUntilStateReleased) {
+	PoolManager manager;
+	auto marker = std::make_shared<LuaTString>("alive");
+	manager.createPool("tenant", PoolConfig().AddGlobalVariable("marker", marker));
+	long held = marker.use_count();
+	EXPECT_GT(held, 1);
+
+	PoolHandle handle = manager.getHandle("tenant");
+	auto state = handle->acquire();
+	StatePool* pool = handle.get();
+	handle = PoolHandle();
+
+	manager.destroyPool("tenant");
+	EXPECT_FALSE(manager.hasPool("tenant"));
+	EXPECT_EQ(held, marker.use_count());
+
+	ASSERT_EQ(0, luaL_dostring(*state, "return marker"));
+	EXPECT_STREQ("alive", lua_tostring(*state, -1));
+
+	pool->release(std::move(state));
+	EXPECT_EQ(1, marker.use_count());
+}
+
+TEST_F(TestPoolManager, HandleKeepsDestroyedPoolUsable) {
+	PoolManager manager;
+	manager.createPool("tenant", PoolConfig().SetMaxSize(1));
+	PoolHandle handle = manager.getHandle("tenant");
+
+	manager.destroyPool("tenant");
+	EXPECT_THROW(manager.getHandle("tenant"), std::runtime_error);
+
+	PooledState state(handle->acquire(), handle.get());
+	EXPECT_TRUE(state);
+	state.release();
+	EXPECT_EQ(1u, handle->availableCount());
+}
+
+TEST_F(TestPoolManager, CreatedHandleOutlivesDestroy) {
+	PoolManager manager;
+	PoolHandle handle = manager.createHandle("tenant", PoolConfig().SetMaxSize(1));
+	EXPECT_EQ(handle, manager.getHandle("tenant"));
+	EXPECT_THROW(manager.createHandle("tenant", PoolConfig()), std::runtime_error);
+
+	manager.destroyPool("tenant");
+	EXPECT_FALSE(manager.hasPool("tenant"));
+
+	auto state = handle->acquire();
+	handle->release(std::move(state));
+	EXPECT_EQ(1u, handle->availableCount());
+}
+
+TEST_F(TestPoolManager, CreateAndDestroyPoolsUnderLoad) {
+	PoolManager manager;
+	manager.setThreadSafe(true);
+
+	std::atomic<bool> stop{false};
+	std::atomic<size_t> runs{0};
+	std::vector<std::thread> workers;
+	for (int t = 0; t < 4; t++) {
+		workers.emplace_back([&manager, &stop, &runs, t]() {
+			for (int i = 0; !stop.load(); i++) {
+				std::string color = "tenant" + std::to_string((t + i) % 3);
+				try {
+					PoolHandle handle = manager.getHandle(color);
+					auto state = handle->acquire(std::chrono::milliseconds(100));
+					lua_pushinteger(*state, i);
+					handle->release(std::move(state));
+					runs++;
+				} catch (const std::runtime_error&) {
+					// The pool is not there right now
+				}
+			}
+		});
+	}
+
+	for (int round = 0; round < 50; round++) {
+		std::string color = "tenant" + std::to_string(round % 3);
+		if (manager.hasPool(color)) {
+			manager.destroyPool(color);
+		} else {
+			manager.createPool(color, PoolConfig().SetMaxSize(2).SetLibraries({"base"}));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	stop = true;
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	EXPECT_GT(runs.load(), 0u);
+	for (const auto& pair : manager.snapshotMetrics()) {
+		EXPECT_EQ(0u, pair.second.checkedOut);
+	}
+}
+
+TEST_F(TestPoolManager, SubmitRunsOnSharedExecutor) {
+	PoolManager manager;
+	// Both workers can pick up an "exports" task at the same time
+	manager.createPool("exports", PoolConfig().SetMaxSize(1));
+	manager.configureExecutor(ExecutorConfig().SetWorkers(2));
+	EXPECT_TRUE(manager.isThreadSafe());
+
+	std::vector<std::future<void>> runs;
+	for (int i = 0; i < 10; i++) {
+		runs.push_back(manager.submit(i % 2 == 0 ? "exports" : "sandboxed", [](LuaState& state) {
+			ASSERT_EQ(0, luaL_dostring(state, "x = 1"));
+		}));
+	}
+	for (auto& run : runs) {
+		run.get();
+	}
+
+	EXPECT_EQ(10u, manager.getExecutor().getMetrics().completed);
+	EXPECT_THROW(manager.submit("missing", [](LuaState&) {}), std::runtime_error);
+}
@@ -0,0 +1,177 @@
+/*
+   MIT License
+
+   Copyright (c) 2021 Jordan Vrtanoski
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include <filesystem>
+#include <fstream>
+#include <cstdint>
+
+#include "../LuaCpp.hpp"
+#include "gtest/gtest.h"
+
+using namespace LuaCpp;
+using namespace LuaCpp::Engine;
+using namespace LuaCpp::Registry;
+
+class TestSnippetBundle : public ::testing::Test {
+protected:
+	virtual void SetUp() {
+		LuaContext ctx;
+		ctx.CompileString("rules.b", "result = 'b'");
+		ctx.CompileString("rules.a", "result = 'a'");
+		ctx.CompileString("rules.c.deep", "result = 'c'");
+		SnippetBundle::Write("TestSnippetBundle.bundle", ctx.getRegistry().getSnapshot()->snippets);
+	}
+
+	virtual void TearDown() {
+		std::filesystem::remove("TestSnippetBundle.bundle");
+	}
+
+	static std::string Result(LuaContext &ctx, const std::string &name) {
+		std::unique_ptr<LuaState> L = ctx.newStateFor(name);
+		if (lua_pcall(*L, 0, 0, 0) != LUA_OK) {
+			return lua_tostring(*L, -1);
+		}
+		lua_getglobal(*L, "result");
+		return lua_tostring(*L, -1);
+	}
+};
+
+TEST_F(TestSnippetBundle, OpenAndFind) {
+	std::shared_ptr<const SnippetBundle> bundle = SnippetBundle::Open("TestSnippetBundle.bundle");
+	ASSERT_EQ(3u, bundle->getCount());
+	EXPECT_EQ("rules.a", bundle->getName(0));
+	EXPECT_EQ("rules.b", bundle->getName(1));
+	EXPECT_EQ("rules.c.deep", bundle->getName(2));
+
+	std::unique_ptr<LuaCodeSnippet> snippet = bundle->Find("rules.b");
+	ASSERT_NE(nullptr, snippet);
+	EXPECT_EQ("rules.b", snippet->getName());
+	EXPECT_TRUE(bundle->Owns(*snippet));
+	// The code is aligned inside the mapping
+	EXPECT_EQ(0u, ((uintptr_t) snippet->getBuffer()) % 16);
+	EXPECT_EQ(nullptr, bundle->Find("rules"));
+	EXPECT_EQ(nullptr, bundle->Find("rules.z"));
+
+	// Snippets keep the mapping alive
+	bundle.reset();
+	LuaState L;
+	ASSERT_EQ(LUA_OK, snippet->UploadCode(L));
+	ASSERT_EQ(LUA_OK, lua_pcall(L, 0, 0, 0));
+	lua_getglobal(L, "result");
+	EXPECT_STREQ("b", lua_tostring(L, -1));
+}
+
+TEST_F(TestSnippetBundle, MountAndUnmount) {
+	LuaContext ctx;
+	ctx.CompileString("rules.a", "result = 'local'");
+	uint64_t version = ctx.getRegistry().getVersion();
+
+	EXPECT_EQ(2u, ctx.MountBundle("TestSnippetBundle.bundle"));
+	EXPECT_EQ(version + 1, ctx.getRegistry().getVersion());
+	EXPECT_EQ("local", Result(ctx, "rules.a"));
+	EXPECT_EQ("b", Result(ctx, "rules.b"));
+	EXPECT_EQ("c", Result(ctx, "rules.c.deep"));
+	EXPECT_THROW(ctx.MountBundle("TestSnippetBundle.bundle"), std::runtime_error);
+
+	ctx.RunPooled("rules.b");
+	std::shared_ptr<const LuaCodeSnippet> held = ctx.getRegistry().getByName("rules.b");
+
+	// A name replaced after the mount survives the unmount
+	ctx.CompileString("rules.c.deep", "result = 'replaced'", true);
+	EXPECT_EQ(1u, ctx.UnmountBundle("TestSnippetBundle.bundle"));
+	EXPECT_FALSE(ctx.getRegistry().Exists("rules.b"));
+	EXPECT_EQ("local", Result(ctx, "rules.a"));
+	EXPECT_EQ("replaced", Result(ctx, "rules.c.deep"));
+	EXPECT_TRUE(ctx.getRegistry().getSnapshot()->bundles.empty());
+	EXPECT_THROW(ctx.UnmountBundle("TestSnippetBundle.bundle"), std::runtime_error);
+
+	// A snippet still in use keeps the unmounted bundle mapped
+	LuaState L;
+	ASSERT_EQ(LUA_OK, held->UploadCode(L));
+	EXPECT_EQ(LUA_OK, lua_pcall(L, 0, 0, 0));
+
+	EXPECT_EQ(3u, ctx.MountBundle("TestSnippetBundle.bundle", true));
+	EXPECT_EQ("a", Result(ctx, "rules.a"));
+}
+
+TEST_F(TestSnippetBundle, UnmountedSnippetsLeaveTheChunkCache) {
+	LuaRegistry registry;
+	registry.MountBundle("TestSnippetBundle.bundle", false);
+	registry.CompileAndAddString("other", "result = 'other'");
+	LuaState L;
+	luaL_openlibs(L);
+
+	// Watch the cached closure through a table with weak keys
+	ASSERT_EQ(LUA_OK, luaL_dostring(L, "probe = setmetatable({}, { __mode = 'k' })"));
+	ASSERT_EQ(LUA_OK, registry.PushCachedChunk(L, "rules.b"));
+	lua_getglobal(L, "probe");
+	lua_insert(L, -2);
+	lua_pushboolean(L, 1);
+	lua_settable(L, -3);
+	lua_settop(L, 0);
+
+	registry.UnmountBundle("TestSnippetBundle.bundle");
+	ASSERT_EQ(LUA_OK, registry.PushCachedChunk(L, "other"));
+	lua_settop(L, 0);
+
+	ASSERT_EQ(LUA_OK, luaL_dostring(L, "collectgarbage() cached = next(probe) ~= nil"));
+	lua_getglobal(L, "cached");
+	EXPECT_FALSE(lua_toboolean(L, -1));
+}
+
+TEST_F(TestSnippetBundle, InvalidBundleIsRejected) {
+	EXPECT_THROW(SnippetBundle::Open("TestSnippetBundle.missing"), std::runtime_error);
+
+	std::ofstream("TestSnippetBundle.bundle", std::ios::binary | std::ios::trunc) << "not a bundle, but long enough to hold a header of a bundle";
+	EXPECT_THROW(SnippetBundle::Open("TestSnippetBundle.bundle"), std::runtime_error);
+
+	SetUp();
+	std::filesystem::resize_file("TestSnippetBundle.bundle", std::filesystem::file_size("TestSnippetBundle.bundle") - 1);
+	LuaContext ctx;
+	EXPECT_THROW(ctx.MountBundle("TestSnippetBundle.bundle"), std::runtime_error);
+	EXPECT_EQ(0u, ctx.getRegistry().getVersion());
+}
+
+TEST_F(TestSnippetBundle, OutOfRangeNameOffsetIsRejected) {
+	// The first entry follows the 64 byte header and starts with its name offset
+	uint64_t nameOffset = UINT64_MAX - 2;
+	std::fstream file("TestSnippetBundle.bundle", std::ios::in | std::ios::out | std::ios::binary);
+	file.seekp(64);
+	file.write((const char *) &nameOffset, sizeof(nameOffset));
+	file.close();
+
+	EXPECT_THROW(SnippetBundle::Open("TestSnippetBundle.bundle"), std::runtime_error);
+}
+
+TEST_F(TestSnippetBundle, CodeOffsetInsideHeaderIsRejected) {
+	// The code offset is the third field of the first entry; 0 points
+	// the code at the header itself
+	uint64_t codeOffset = 0;
+	std::fstream file("TestSnippetBundle.bundle", std::ios::in | std::ios::out | std::ios::binary);
+	file.seekp(64 + 2 * sizeof(uint64_t));
+	file.write((const char *) &codeOffset, sizeof(codeOffset));
+	file.close();
+
+	EXPECT_THROW(SnippetBundle::Open("TestSnippetBundle.bundle"), std::runtime_error);
+}
@@ -22,6 +22,11 @@
    SOFTWARE.
    */
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
 #include "../LuaCpp.hpp"
 #include "gtest/gtest.h"
 #include "PoolTestUtils.hpp"
@@ -142,6 +147,111 @@ TEST_F(TestStatePool, PoolExhausted) {
 	pool.release(std::move(state1));
 }
 
+TEST_F(TestStatePool, PoolExhaustedWithoutThreadSafetyDoesNotWait) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.exhaustionTimeoutMs = 60000;
+
+	StatePool pool("test", config);
+
+	auto state1 = pool.acquire();
+	EXPECT_THROW(pool.acquire(), PoolExhaustedException);
+	EXPECT_EQ(0u, pool.getWaitStatistics().waits);
+
+	pool.release(std::move(state1));
+}
+
+TEST_F(TestStatePool, AcquireWaitsForRelease) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.exhaustionTimeoutMs = 5000;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	auto state1 = pool.acquire();
+	LuaState* raw = state1.get();
+
+	std::thread releaser([&pool, &state1]() {
+		while (pool.waiterCount() == 0) {
+			std::this_thread::yield();
+		}
+		pool.release(std::move(state1));
+	});
+
+	auto state2 = pool.acquire();
+	releaser.join();
+
+	EXPECT_EQ(raw, state2.get());
+	EXPECT_EQ(1u, pool.checkedOutCount());
+	EXPECT_EQ(0u, pool.waiterCount());
+
+	WaitStatistics stats = pool.getWaitStatistics();
+	EXPECT_EQ(1u, stats.waits);
+	EXPECT_EQ(0u, stats.timeouts);
+
+	pool.release(std::move(state2));
+	VerifyAvailableCounts(pool, 1u, 1u);
+}
+
+TEST_F(TestStatePool, AcquireWithTimeoutExpires) {
+	PoolConfig config;
+	config.maxSize = 1;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	auto state1 = pool.acquire();
+
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_THROW(pool.acquire(std::chrono::milliseconds(20)), PoolExhaustedException);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+
+	WaitStatistics stats = pool.getWaitStatistics();
+	EXPECT_EQ(1u, stats.waits);
+	EXPECT_EQ(1u, stats.timeouts);
+	EXPECT_EQ(0u, pool.waiterCount());
+
+	pool.release(std::move(state1));
+}
+
+TEST_F(TestStatePool, WaitersAreServedInOrder) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.exhaustionTimeoutMs = 5000;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	auto held = pool.acquire();
+
+	std::mutex orderMutex;
+	std::vector<int> order;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 3; i++) {
+		threads.emplace_back([&pool, &orderMutex, &order, i]() {
+			auto state = pool.acquire();
+			{
+				std::lock_guard<std::mutex> guard(orderMutex);
+				order.push_back(i);
+			}
+			pool.release(std::move(state));
+		});
+		while (pool.waiterCount() != static_cast<size_t>(i + 1)) {
+			std::this_thread::yield();
+		}
+	}
+
+	pool.release(std::move(held));
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ((std::vector<int>{0, 1, 2}), order);
+	EXPECT_EQ(3u, pool.getWaitStatistics().waits);
+	VerifyAvailableCounts(pool, 1u, 1u);
+}
+
 TEST_F(TestStatePool, WarmupPool) {
 	PoolConfig config;
 	config.maxSize = 5;
@@ -440,3 +550,700 @@ TEST_F(TestStatePool, AcquireFromAvailableQueueThreadSafe) {
 	
 	pool.release(std::move(state2));
 }
+
+TEST_F(TestStatePool, MPMCQueueKeepsOrderAndCapacity) {
+	MPMCQueue<int> queue(3);
+	EXPECT_EQ(4u, queue.capacity());
+
+	for (int i = 0; i < 4; i++) {
+		EXPECT_TRUE(queue.tryPush(i));
+	}
+	EXPECT_FALSE(queue.tryPush(4));
+
+	int value = -1;
+	for (int i = 0; i < 4; i++) {
+		EXPECT_TRUE(queue.tryPop(value));
+		EXPECT_EQ(i, value);
+	}
+	EXPECT_FALSE(queue.tryPop(value));
+}
+
+TEST_F(TestStatePool, LockFreeQueueIsOptIn) {
+	PoolConfig config;
+	config.maxSize = 3;
+
+	StatePool plain("plain", config);
+	plain.setThreadSafe(true);
+	EXPECT_FALSE(plain.isLockFree());
+
+	config.lockFreeQueue = true;
+	StatePool pool("test", config);
+	EXPECT_FALSE(pool.isLockFree());
+
+	pool.setThreadSafe(true);
+	EXPECT_TRUE(pool.isLockFree());
+
+	pool.setThreadSafe(false);
+	EXPECT_FALSE(pool.isLockFree());
+}
+
+TEST_F(TestStatePool, LockFreeAcquireAndRelease) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.lockFreeQueue = true;
+
+	StatePool pool("test", config);
+	pool.warmup(2);
+	pool.setThreadSafe(true);
+
+	VerifyAvailableCounts(pool, 2u, 2u);
+
+	auto state1 = pool.acquire();
+	auto state2 = pool.acquire();
+	auto state3 = pool.acquire();
+	VerifyAcquireReleaseCounts(pool, 3u);
+
+	EXPECT_THROW(pool.acquire(), PoolExhaustedException);
+
+	pool.release(std::move(state1));
+	pool.release(std::move(state2));
+	pool.release(std::move(state3));
+	VerifyAvailableCounts(pool, 3u, 3u);
+
+	pool.drain();
+	VerifyAvailableCounts(pool, 0u, 0u);
+}
+
+TEST_F(TestStatePool, LockFreeStatesSurviveModeSwitch) {
+	PoolConfig config;
+	config.maxSize = 2;
+	config.lockFreeQueue = true;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+	pool.warmup(2);
+
+	pool.setThreadSafe(false);
+	VerifyAvailableCounts(pool, 2u, 2u);
+
+	auto state = pool.acquire();
+	EXPECT_NE(nullptr, state.get());
+	pool.release(std::move(state));
+}
+
+TEST_F(TestStatePool, LockFreeConcurrentAcquireRelease) {
+	PoolConfig config;
+	config.maxSize = 4;
+	config.exhaustionTimeoutMs = 10000;
+	config.lockFreeQueue = true;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; t++) {
+		threads.emplace_back([&pool]() {
+			for (int i = 0; i < 200; i++) {
+				auto state = pool.acquire();
+				lua_pushinteger(*state, i);
+				pool.release(std::move(state));
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_LE(pool.getCurrentSize(), 4u);
+	EXPECT_EQ(0u, pool.checkedOutCount());
+	EXPECT_EQ(pool.getCurrentSize(), pool.availableCount());
+	EXPECT_EQ(0u, pool.waiterCount());
+	EXPECT_EQ(0u, pool.getWaitStatistics().timeouts);
+}
+
+TEST_F(TestStatePool, LockFreeWaitersSeeFreedSlots) {
+	// Every release retires its state and frees the slot, racing with
+	// acquirers that are about to wait for it
+	PoolConfig config;
+	config.maxSize = 1;
+	config.maxUsesPerState = 1;
+	config.exhaustionTimeoutMs = 2000;
+	config.lockFreeQueue = true;
+	config.libraries = {"base"};
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([&pool]() {
+			for (int i = 0; i < 200; i++) {
+				auto state = pool.acquire();
+				pool.release(std::move(state));
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ(0u, pool.getWaitStatistics().timeouts);
+	EXPECT_EQ(0u, pool.checkedOutCount());
+	EXPECT_EQ(0u, pool.waiterCount());
+}
+
+TEST_F(TestStatePool, ThreadCacheKeepsCountsAccurate) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.threadCacheSize = 2;
+
+	StatePool pool("test", config);
+	AcquireVerifyReleaseThree(pool);
+
+	VerifyAvailableCounts(pool, 3u, 3u);
+	EXPECT_EQ(2u, pool.threadCachedCount());
+
+	auto state = pool.acquire();
+	EXPECT_EQ(1u, pool.threadCachedCount());
+	EXPECT_EQ(2u, pool.availableCount());
+	EXPECT_EQ(1u, pool.checkedOutCount());
+
+	pool.release(std::move(state));
+	VerifyAvailableCounts(pool, 3u, 3u);
+}
+
+TEST_F(TestStatePool, ThreadCacheSizeIsCapped) {
+	PoolConfig config;
+	config.maxSize = 6;
+	config.threadCacheSize = 10;
+
+	StatePool pool("test", config);
+	std::vector<std::unique_ptr<LuaState>> states;
+	for (int i = 0; i < 6; i++) {
+		states.push_back(pool.acquire());
+	}
+	for (auto& state : states) {
+		pool.release(std::move(state));
+	}
+
+	EXPECT_EQ(StatePool::MaxThreadCacheSize, pool.threadCachedCount());
+	VerifyAvailableCounts(pool, 6u, 6u);
+}
+
+TEST_F(TestStatePool, ThreadCacheFlushedOnThreadExit) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.threadCacheSize = 2;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::thread worker([&pool]() {
+		auto state1 = pool.acquire();
+		auto state2 = pool.acquire();
+		pool.release(std::move(state1));
+		pool.release(std::move(state2));
+		EXPECT_EQ(2u, pool.threadCachedCount());
+	});
+	worker.join();
+
+	EXPECT_EQ(0u, pool.threadCachedCount());
+	VerifyAvailableCounts(pool, 2u, 2u);
+}
+
+TEST_F(TestStatePool, ThreadCacheFlushedOnDrain) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.threadCacheSize = 4;
+
+	StatePool pool("test", config);
+	AcquireVerifyReleaseThree(pool);
+	EXPECT_EQ(3u, pool.threadCachedCount());
+
+	pool.drain();
+	EXPECT_EQ(0u, pool.threadCachedCount());
+	VerifyAvailableCounts(pool, 0u, 0u);
+}
+
+TEST_F(TestStatePool, ThreadCacheStatesAreStolenWhenExhausted) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.threadCacheSize = 1;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool released = false;
+	bool done = false;
+
+	// The worker keeps its magazine alive until the main thread is done
+	std::thread worker([&]() {
+		pool.release(pool.acquire());
+		std::unique_lock<std::mutex> lock(mutex);
+		released = true;
+		cv.notify_all();
+		cv.wait(lock, [&done]() { return done; });
+	});
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&released]() { return released; });
+	}
+	EXPECT_EQ(1u, pool.threadCachedCount());
+
+	auto state = pool.acquire();
+	EXPECT_NE(nullptr, state.get());
+	EXPECT_EQ(0u, pool.threadCachedCount());
+	EXPECT_EQ(1u, pool.getCurrentSize());
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+	}
+	cv.notify_all();
+	worker.join();
+
+	pool.release(std::move(state));
+	EXPECT_EQ(1u, pool.availableCount());
+}
+
+TEST_F(TestStatePool, ThreadCacheServesWaiters) {
+	PoolConfig config;
+	config.maxSize = 2;
+	config.exhaustionTimeoutMs = 10000;
+	config.threadCacheSize = 2;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 6; t++) {
+		threads.emplace_back([&pool]() {
+			for (int i = 0; i < 100; i++) {
+				auto state = pool.acquire();
+				lua_pushinteger(*state, i);
+				pool.release(std::move(state));
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ(0u, pool.checkedOutCount());
+	EXPECT_EQ(pool.getCurrentSize(), pool.availableCount());
+	EXPECT_EQ(0u, pool.threadCachedCount());
+	EXPECT_EQ(0u, pool.getWaitStatistics().timeouts);
+}
+
+TEST_F(TestStatePool, ShardedPoolSharesMaxSize) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.shards = 4;
+
+	StatePool pool("test", config);
+	EXPECT_EQ(4u, pool.getShardCount());
+
+	std::vector<std::unique_ptr<LuaState>> states;
+	for (int i = 0; i < 3; i++) {
+		states.push_back(pool.acquire());
+	}
+	EXPECT_THROW(pool.acquire(), PoolExhaustedException);
+
+	for (auto& state : states) {
+		pool.release(std::move(state));
+	}
+	EXPECT_EQ(3u, pool.getCurrentSize());
+	EXPECT_EQ(3u, pool.availableCount());
+	EXPECT_EQ(3u, pool.shardedCount());
+}
+
+TEST_F(TestStatePool, ShardedStateIsFoundFromAnyThread) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.shards = 2;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	auto state = pool.acquire();
+	lua_State* L = *state;
+	pool.release(std::move(state));
+
+	std::thread other([&pool, L]() {
+		auto stolen = pool.acquire();
+		EXPECT_EQ(L, stolen->getState());
+		pool.release(std::move(stolen));
+	});
+	other.join();
+
+	PoolMetricsSnapshot metrics = pool.getMetrics();
+	EXPECT_EQ(1u, metrics.shardHits + metrics.shardSteals);
+	EXPECT_EQ(1u, metrics.creates);
+}
+
+TEST_F(TestStatePool, ShardedPoolServesWaiters) {
+	PoolConfig config;
+	config.maxSize = 2;
+	config.exhaustionTimeoutMs = 10000;
+	config.shards = 3;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 6; t++) {
+		threads.emplace_back([&pool]() {
+			for (int i = 0; i < 100; i++) {
+				auto state = pool.acquire();
+				lua_pushinteger(*state, i);
+				pool.release(std::move(state));
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ(0u, pool.checkedOutCount());
+	EXPECT_EQ(pool.getCurrentSize(), pool.availableCount());
+	EXPECT_EQ(0u, pool.getWaitStatistics().timeouts);
+}
+
+TEST_F(TestStatePool, ShardedStatesAreDrainedAndMaintained) {
+	PoolConfig config;
+	config.maxSize = 4;
+	config.maxIdle = 1;
+	config.shards = 2;
+
+	StatePool pool("test", config);
+	auto first = pool.acquire();
+	auto second = pool.acquire();
+	pool.release(std::move(first));
+	pool.release(std::move(second));
+	EXPECT_EQ(2u, pool.shardedCount());
+
+	// The survivor stays in its shard
+	EXPECT_EQ(1u, pool.maintain());
+	EXPECT_EQ(1u, pool.shardedCount());
+	EXPECT_EQ(1u, pool.availableCount());
+
+	pool.release(pool.acquire());
+	EXPECT_EQ(1u, pool.shardedCount());
+	pool.drain();
+	EXPECT_EQ(0u, pool.getCurrentSize());
+	EXPECT_EQ(0u, pool.availableCount());
+}
+
+TEST_F(TestStatePool, MetricsCountAcquiresHitsAndCreates) {
+	PoolConfig config;
+	config.maxSize = 2;
+
+	StatePool pool("test", config);
+	pool.warmup(1);
+
+	auto state1 = pool.acquire();
+	auto state2 = pool.acquire();
+	EXPECT_THROW(pool.acquire(), PoolExhaustedException);
+	pool.release(std::move(state1));
+	pool.release(std::move(state2));
+
+	auto state3 = pool.acquire();
+	pool.release(std::move(state3));
+
+	PoolMetricsSnapshot metrics = pool.getMetrics();
+	EXPECT_EQ("test", metrics.color);
+	EXPECT_EQ(3u, metrics.acquires);
+	EXPECT_EQ(1u, metrics.hits);
+	EXPECT_EQ(2u, metrics.creates);
+	EXPECT_EQ(1u, metrics.exhaustions);
+	EXPECT_EQ(3u, metrics.releases);
+	EXPECT_EQ(2u, metrics.currentSize);
+	EXPECT_EQ(2u, metrics.available);
+	EXPECT_EQ(0u, metrics.checkedOut);
+
+	EXPECT_EQ(2u, metrics.creationTime.count);
+	EXPECT_EQ(3u, metrics.holdTime.count);
+	EXPECT_EQ(3u, metrics.resetTime.count);
+	EXPECT_EQ(0u, metrics.waitTime.count);
+}
+
+TEST_F(TestStatePool, MetricsRecordHoldTime) {
+	PoolConfig config;
+	config.maxSize = 1;
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	pool.release(std::move(state));
+
+	LatencyHistogramSnapshot hold = pool.getMetrics().holdTime;
+	EXPECT_EQ(1u, hold.count);
+	EXPECT_GE(hold.max, std::chrono::microseconds(5000));
+	EXPECT_GE(hold.percentile(50), std::chrono::microseconds(5000));
+	EXPECT_EQ(hold.total, hold.mean());
+}
+
+TEST_F(TestStatePool, LatencyHistogramBuckets) {
+	LatencyHistogram histogram;
+	histogram.record(std::chrono::microseconds(0));
+	histogram.record(std::chrono::microseconds(1));
+	histogram.record(std::chrono::microseconds(3));
+	histogram.record(std::chrono::microseconds(1000));
+	histogram.record(std::chrono::hours(1));
+
+	LatencyHistogramSnapshot snapshot = histogram.snapshot();
+	EXPECT_EQ(5u, snapshot.count);
+	EXPECT_EQ(1u, snapshot.buckets[0]);
+	EXPECT_EQ(1u, snapshot.buckets[1]);
+	EXPECT_EQ(1u, snapshot.buckets[2]);
+	EXPECT_EQ(1u, snapshot.buckets[10]);
+	EXPECT_EQ(1u, snapshot.buckets[LatencyHistogramSnapshot::BucketCount - 1]);
+	EXPECT_EQ(std::chrono::microseconds(1), LatencyHistogramSnapshot::upperBound(0));
+	EXPECT_EQ(std::chrono::microseconds(1024), LatencyHistogramSnapshot::upperBound(10));
+	EXPECT_EQ(std::chrono::microseconds(4), snapshot.percentile(60));
+	EXPECT_EQ(std::chrono::hours(1), snapshot.percentile(100));
+	EXPECT_EQ(std::chrono::hours(1), snapshot.max);
+}
+
+TEST_F(TestStatePool, MaintainEvictsExpiredIdleStates) {
+	PoolConfig config;
+	config.maxSize = 4;
+	config.idleTimeoutMs = 20;
+	config.minIdle = 1;
+
+	StatePool pool("test", config);
+	pool.warmup(3);
+	EXPECT_EQ(0u, pool.maintain());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	EXPECT_EQ(2u, pool.maintain());
+	VerifyAvailableCounts(pool, 1u, 1u);
+	EXPECT_EQ(2u, pool.getMetrics().evictions);
+}
+
+TEST_F(TestStatePool, MaintainEvictsLargestHeapsAboveMaxIdle) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.maxIdle = 2;
+
+	StatePool pool("test", config);
+	auto small1 = pool.acquire();
+	auto big = pool.acquire();
+	auto small2 = pool.acquire();
+	lua_State* bigL = *big;
+	lua_createtable(*big, 100000, 0);
+	lua_setglobal(*big, "ballast");
+
+	pool.release(std::move(small1));
+	pool.release(std::move(big));
+	pool.release(std::move(small2));
+
+	EXPECT_EQ(1u, pool.maintain());
+	VerifyAvailableCounts(pool, 2u, 2u);
+
+	auto state1 = pool.acquire();
+	auto state2 = pool.acquire();
+	EXPECT_NE(bigL, state1->getState());
+	EXPECT_NE(bigL, state2->getState());
+	pool.release(std::move(state1));
+	pool.release(std::move(state2));
+}
+
+TEST_F(TestStatePool, MaintainTopsUpToMinIdle) {
+	PoolConfig config;
+	config.maxSize = 4;
+	config.minIdle = 2;
+
+	StatePool pool("test", config);
+	EXPECT_EQ(0u, pool.maintain());
+	VerifyAvailableCounts(pool, 2u, 2u);
+
+	auto state = pool.acquire();
+	pool.maintain();
+	EXPECT_EQ(3u, pool.getCurrentSize());
+	EXPECT_EQ(2u, pool.availableCount());
+	pool.release(std::move(state));
+}
+
+TEST_F(TestStatePool, MaintainLeavesIdleStatesAvailable) {
+	PoolConfig config;
+	config.maxSize = 2;
+	config.maxIdle = 2;
+	config.shards = 2;
+
+	StatePool pool("test", config);
+	pool.setThreadSafe(true);
+	pool.warmup(2);
+
+	// At maxSize a timeout-0 acquire only succeeds if an idle state is visible
+	std::atomic<bool> done{false};
+	std::thread maintenance([&pool, &done]() {
+		while (!done) {
+			pool.maintain();
+		}
+	});
+	for (int i = 0; i < 2000; i++) {
+		auto state = pool.acquire(std::chrono::milliseconds(0));
+		pool.release(std::move(state));
+	}
+	done = true;
+	maintenance.join();
+
+	EXPECT_EQ(0u, pool.getMetrics().exhaustions);
+	EXPECT_EQ(2u, pool.getCurrentSize());
+}
+
+TEST_F(TestStatePool, LightResetKeepsScriptGlobals) {
+	PoolConfig config;
+	config.maxSize = 1;
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state, "leaked = 1"));
+	pool.release(std::move(state));
+
+	state = pool.acquire();
+	ExpectGlobalIsNumber(*state, "leaked", 1);
+	pool.release(std::move(state));
+}
+
+TEST_F(TestStatePool, SnapshotResetRestoresGlobals) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.resetMode = ResetMode::Snapshot;
+	config.AddGlobalVariable("test_var", std::make_shared<LuaTNumber>(42.0));
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state,
+		"leaked = 1\n"
+		"print = nil\n"
+		"math = 'overwritten'\n"
+		"test_var = 7\n"
+		"setmetatable(_G, { __index = function() return 'x' end })"));
+	pool.release(std::move(state));
+
+	state = pool.acquire();
+	ExpectGlobalIsNil(*state, "leaked");
+	ExpectGlobalIsFunction(*state, "print");
+	ExpectGlobalIsTable(*state, "math");
+	ExpectGlobalIsNumber(*state, "test_var", 42);
+	lua_pushglobaltable(*state);
+	EXPECT_EQ(0, lua_getmetatable(*state, -1));
+	lua_pop(*state, 1);
+	EXPECT_EQ(0, lua_gettop(*state));
+	pool.release(std::move(state));
+}
+
+TEST_F(TestStatePool, SnapshotResetRestoresPackageLoaded) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.resetMode = ResetMode::Snapshot;
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state,
+		"package.preload.mod = function() return { answer = 42 } end\n"
+		"mod = require('mod')\n"
+		"package.loaded.string = nil"));
+	pool.release(std::move(state));
+
+	state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state, "return package.loaded.mod == nil and package.loaded.string == string"));
+	EXPECT_TRUE(lua_toboolean(*state, -1));
+	lua_pop(*state, 1);
+	ExpectGlobalIsNil(*state, "mod");
+	pool.release(std::move(state));
+}
+
+TEST_F(TestStatePool, RecycleAfterMaxUses) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.maxUsesPerState = 2;
+
+	StatePool pool("test", config);
+	auto state = pool.acquire();
+	lua_State* first = *state;
+	pool.release(std::move(state));
+
+	state = pool.acquire();
+	EXPECT_EQ(first, state->getState());
+	pool.release(std::move(state));
+	EXPECT_EQ(0u, pool.getCurrentSize());
+
+	state = pool.acquire();
+	EXPECT_EQ(1u, state->getPoolUsage().uses);
+	pool.release(std::move(state));
+
+	PoolMetricsSnapshot metrics = pool.getMetrics();
+	EXPECT_EQ(1u, metrics.recycledByUses);
+	EXPECT_EQ(2u, metrics.creates);
+}
+
+TEST_F(TestStatePool, RecycleAboveMaxHeapAfterFullGc) {
+	PoolConfig config;
+	config.maxSize = 1;
+	config.maxHeapBytes = 1024 * 1024;
+
+	StatePool pool("test", config);
+
+	// Garbage alone does not trip the policy
+	auto state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state, "local t = {} for i = 1, 100000 do t[i] = i end"));
+	pool.release(std::move(state));
+	EXPECT_EQ(1u, pool.getCurrentSize());
+
+	state = pool.acquire();
+	ASSERT_EQ(0, luaL_dostring(*state, "kept = {} for i = 1, 200000 do kept[i] = i end"));
+	pool.release(std::move(state));
+	EXPECT_EQ(0u, pool.getCurrentSize());
+	EXPECT_EQ(1u, pool.getMetrics().recycledByHeap);
+}
+
+TEST_F(TestStatePool, RecycleAfterMaxAge) {
+	PoolConfig config;
+	config.maxSize = 2;
+	config.maxStateAgeMs = 10;
+
+	StatePool pool("test", config);
+	pool.warmup(1);
+	auto state = pool.acquire();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	pool.release(std::move(state));
+	EXPECT_EQ(0u, pool.getCurrentSize());
+
+	pool.warmup(1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	pool.maintain();
+	EXPECT_EQ(0u, pool.getCurrentSize());
+	EXPECT_EQ(2u, pool.getMetrics().recycledByAge);
+	EXPECT_EQ(0u, pool.getMetrics().evictions);
+}
+
+TEST_F(TestStatePool, AsyncRecycleClosesInMaintenance) {
+	PoolConfig config;
+	config.maxSize = 3;
+	config.maxUsesPerState = 1;
+	config.asyncRecycle = true;
+
+	StatePool pool("test", config);
+	pool.release(pool.acquire());
+	pool.release(pool.acquire());
+
+	EXPECT_EQ(0u, pool.getCurrentSize());
+	EXPECT_EQ(2u, pool.retiredCount());
+	EXPECT_EQ(2u, pool.getMetrics().retired);
+
+	pool.maintain();
+	EXPECT_EQ(0u, pool.retiredCount());
+
+	// The backlog never grows beyond maxSize states
+	for (int i = 0; i < 5; i++) {
+		pool.release(pool.acquire());
+	}
+	EXPECT_LT(pool.retiredCount(), 3u);
+	EXPECT_EQ(7u, pool.getMetrics().recycledByUses);
+}